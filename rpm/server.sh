@@ -11,12 +11,27 @@ then
 	echo "VNCD_UID is not set"
 	exit 1
 fi
-if ! test ${VNCD_PORT+x}
+if ! test ${VNCD_PORT+x} && ! test ${VNCD_SOCKET+x} && ! test ${VNCD_FD+x}
 then
-	echo "VNCD_PORT is not set"
+	echo "neither VNCD_PORT nor VNCD_SOCKET nor VNCD_FD is set"
 	exit 1
 fi
 
+# client's socket (-z option of vncd), Unix socket (-u option of vncd)
+# or loopback TCP port
+if test ${VNCD_FD+x}
+then
+	# the client is served on the standard input, the descriptor itself
+	# is not inherited by the X clients
+	set -- -inetd
+	exec <&"$VNCD_FD" 3<&-
+elif test ${VNCD_SOCKET+x}
+then
+	set -- -rfbunixpath "$VNCD_SOCKET" -rfbport -1
+else
+	set -- -rfbport "$VNCD_PORT" -localhost
+fi
+
 # log everything to home directory
 log_directory=$HOME/.local/log
 mkdir -p "$log_directory"
@@ -29,14 +44,15 @@ key=$HOME/.config/VirtualGL/xauth-server-key
 xauth add "$h/unix:$VNCD_UID" . $(mcookie)
 xauth merge $key
 
-# X server
+# X server checks the user's password itself: the client may come via
+# the single port of vncd or be handed off to the server directly
+# (no -once: VNCD terminates the server when the client disconnects
+# or when the grace period ends)
 exec /opt/TurboVNC/bin/Xvnc \
 	:$VNCD_UID \
-	-securitytypes none \
+	-securitytypes UnixLogin,Plain \
 	-pamsession \
-	-rfbport "$VNCD_PORT" \
+	"$@" \
 	-fp catalogue:/etc/X11/fontpath.d \
-	-once \
 	-nevershared \
-	-noreverse \
-	-localhost
+	-noreverse
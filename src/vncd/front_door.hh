@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_FRONT_DOOR_HH
+#define VNCD_FRONT_DOOR_HH
+
+#include <netinet/in.h>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <unistdx/base/log_message>
+#include <unistdx/net/socket>
+#include <unistdx/net/socket_address>
+
+#include <vncd/rfb.hh>
+#include <vncd/server.hh>
+#include <vncd/user.hh>
+
+namespace vncd {
+
+    class Front_door;
+
+    /// Peer connected via loopback interface (IPv4 or IPv6, including mapped IPv4).
+    inline bool
+    is_loopback(const sys::socket_address& address) {
+        const auto* sa = address.sockaddr();
+        if (sa->sa_family == AF_INET) {
+            const auto* in = reinterpret_cast<const ::sockaddr_in*>(sa);
+            return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+        }
+        if (sa->sa_family == AF_INET6) {
+            const auto* in6 = reinterpret_cast<const ::sockaddr_in6*>(sa);
+            const auto& a = in6->sin6_addr;
+            return IN6_IS_ADDR_LOOPBACK(&a) ||
+                (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127);
+        }
+        return sa->sa_family == AF_UNIX;
+    }
+
+    /// Starts the session in the user's shard.
+    class Attach_session_task: public Task {
+
+    private:
+        User _user;
+        Rfb_credentials _credentials;
+        sys::socket _socket;
+        sys::socket_address _address;
+        sys::port_type _port;
+        sys::port_type _vnc_port;
+        Session_options _options;
+
+    public:
+
+        inline explicit
+        Attach_session_task(
+            const User& user,
+            const Rfb_credentials& credentials,
+            sys::socket&& socket,
+            const sys::socket_address& address,
+            sys::port_type port,
+            sys::port_type vnc_port,
+            const Session_options& options
+        ):
+        _user(user),
+        _credentials(credentials),
+        _socket(std::move(socket)),
+        _address(address),
+        _port(port),
+        _vnc_port(vnc_port),
+        _options(options) {}
+
+        ~Attach_session_task() {
+            this->_credentials.clear();
+        }
+
+        void run() override {
+            Task::run();
+            auto& session = this->parent().session(this->_user.id());
+            if (session && session->detached() && !session->has_been_terminated()) {
+                session->reattach();
+                session->credentials(this->_credentials);
+                start_session(this->parent(), session, std::move(this->_socket), this->_address);
+                return;
+            }
+            if (session && !session->has_been_terminated()) {
+                session->log("refusing multiple connections");
+                auto message = rfb_security_failure(
+                    this->_credentials.version,
+                    "the session is already in use"
+                );
+                this->_socket.write(message.data(), message.size());
+                return;
+            }
+            session = new_session(this->parent(), this->_user, this->_port,
+                                  this->_vnc_port, this->_options);
+            session->credentials(this->_credentials);
+            start_session(this->parent(), session, std::move(this->_socket), this->_address);
+        }
+
+    };
+
+    /// Remote client that has not sent its user name yet.
+    class Front_door_client: public Connection {
+
+    private:
+        Front_door& _door;
+        sys::socket_address _address;
+        Rfb_server_handshake _handshake;
+
+    public:
+
+        inline explicit
+        Front_door_client(Front_door& door, sys::socket&& socket,
+                          const sys::socket_address& address):
+        _door(door),
+        _address(address) {
+            this->_socket = std::move(socket);
+        }
+
+        void process(const sys::epoll_event& event) override;
+
+    private:
+
+        template <class ... Args>
+        inline void
+        log(const char* message, const Args& ... args) const {
+            sys::log_message("front-door", message, args...);
+        }
+
+    };
+
+    /**
+    Single listening socket for all users. The user is determined from
+    the RFB handshake (VeNCrypt Plain or UnixLogin security type), and
+    the connection is routed to this user's session. Both security types
+    send the password in clear text, so only loopback clients (e.g. SSH
+    tunnels) are accepted unless remote clients are explicitly allowed.
+    */
+    class Front_door: public Connection {
+
+    private:
+        Server_pool& _servers;
+        sys::socket_address _address;
+        sys::port_type _vnc_base_port;
+        Session_options _options;
+        std::unordered_map<std::string,User> _users;
+        bool _remote_clients = false;
+
+    public:
+
+        inline explicit
+        Front_door(
+            Server_pool& servers,
+            const sys::socket_address& address,
+            sys::port_type vnc_base_port,
+            const Session_options& options,
+            bool remote_clients
+        ):
+        Connection(address.family()),
+        _servers(servers),
+        _address(address),
+        _vnc_base_port(vnc_base_port),
+        _options(options),
+        _remote_clients(remote_clients) {
+            this->_socket.set(sys::socket::options::reuse_address);
+            // accepted sockets inherit the buffer sizes before the handshake
+            options.remote_profile.apply_buffers(this->_socket.fd());
+            this->_socket.bind(this->_address);
+            this->_socket.listen();
+            this->log("listen _", this->_address);
+        }
+
+        /// Allow the user to connect.
+        inline void
+        allow(const User& user) {
+            this->_users[user.name()] = user;
+        }
+
+        /// Do not allow the user to connect any more.
+        inline void
+        deny(const User& user) {
+            this->_users.erase(user.name());
+        }
+
+        /// Hand over the connection to the user's shard.
+        bool
+        route(sys::socket&& socket, const sys::socket_address& address,
+              const Rfb_credentials& credentials) {
+            auto result = this->_users.find(credentials.user);
+            if (result == this->_users.end()) {
+                return false;
+            }
+            const auto& user = result->second;
+            this->_servers.shard(user.id()).submit(new Attach_session_task(
+                user,
+                credentials,
+                std::move(socket),
+                address,
+                sys::socket_address_cast<sys::ipv4_socket_address>(this->_address).port(),
+                this->_vnc_base_port + user.id(),
+                this->_options
+            ));
+            return true;
+        }
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            if (started() && event.in()) {
+                sys::socket socket;
+                sys::socket_address address;
+                while (this->_socket.accept(socket, address)) {
+                    if (!this->_remote_clients && !is_loopback(address)) {
+                        // the password would be sent in clear text
+                        this->log("refusing remote client _ (use -c to allow)", address);
+                        socket.close();
+                        continue;
+                    }
+                    auto fd = socket.fd();
+                    this->parent().add(
+                        new Front_door_client(*this, std::move(socket), address),
+                        sys::event::inout
+                    );
+                    // unauthenticated peers do not hold file descriptors
+                    this->parent().submit(new Connection_timeout_task(
+                        fd, this->parent().generation(fd), this->_options.start_timeout,
+                        "front-door"
+                    ));
+                }
+            }
+        }
+
+    private:
+
+        template <class ... Args>
+        inline void
+        log(const char* message, const Args& ... args) const {
+            sys::log_message("front-door", message, args...);
+        }
+
+    };
+
+    inline void
+    Front_door_client::process(const sys::epoll_event& event) {
+        Connection::process(event);
+        if (!started()) {
+            return;
+        }
+        this->_handshake.process(this->_socket);
+        if (this->_handshake.failed()) {
+            this->log("handshake with _ failed: _", this->_address, this->_handshake.reason());
+            this->state(State::Stopped);
+            return;
+        }
+        if (this->_handshake.running()) {
+            this->parent().modify(
+                this->fd(),
+                this->_handshake.writing() ? sys::event::inout : sys::event::in
+            );
+            return;
+        }
+        auto& credentials = this->_handshake.credentials();
+        this->parent().unwatch(this->fd());
+        if (!this->_door.route(std::move(this->_socket), this->_address, credentials)) {
+            this->log("unknown user _ from _", credentials.user, this->_address);
+            auto message = rfb_security_failure(credentials.version, "authentication failed");
+            this->_socket.write(message.data(), message.size());
+        }
+        credentials.clear();
+        this->state(State::Stopped);
+    }
+
+}
+
+#endif // vim:filetype=cpp
@@ -7,34 +7,39 @@ SPDX-License-Identifier: gpl3+
 
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <unistdx/io/pipe>
 #include <unistdx/ipc/signal>
 #include <unistdx/net/socket_address>
 #include <unistdx/system/nss>
 
+#include <vncd/front_door.hh>
+#include <vncd/metrics_server.hh>
+#include <vncd/nss_pool.hh>
+#include <vncd/nss_watch.hh>
 #include <vncd/port.hh>
 #include <vncd/server.hh>
 #include <vncd/user.hh>
 
 namespace vncd {
 
-    template <class T>
-    std::unordered_set<T>
-    set_difference(
-        const std::unordered_set<T>& a,
-        const std::unordered_set<T>& b
-    ) {
-        std::unordered_set<T> result(a);
-        for (const auto& x : b) {
-            result.erase(x);
-        }
-        return result;
+    inline size_t
+    parse_positive(const char* arg) {
+        long tmp;
+        if (!(std::stringstream(arg) >> tmp) || tmp <= 0) {
+            throw std::invalid_argument("bad number");
+        }
+        return static_cast<size_t>(tmp);
     }
 
     inline void
@@ -46,54 +51,259 @@ namespace vncd {
         t = std::chrono::seconds(tmp);
     }
 
+    /**
+    Looks up group members in user database in a worker thread.
+    Members that are found in the cache are not looked up again.
+    */
+    class Group_lookup: public Nss_job {
+
+    public:
+        typedef std::unordered_set<User> set_type;
+        typedef std::unordered_map<std::string,User> member_map;
+        typedef std::function<void(Group_lookup&)> function_type;
+
+    private:
+        std::string _group;
+        member_map _members;
+        set_type _users;
+        bool _failed = false;
+        function_type _function;
+
+    public:
+
+        inline explicit
+        Group_lookup(std::string group, member_map cache, function_type function):
+        _group(std::move(group)), _members(std::move(cache)),
+        _function(std::move(function)) {}
+
+        void
+        run() override {
+            sys::group group;
+            if (!sys::find_group(this->_group.data(), group)) {
+                this->_failed = true;
+                sys::log_message("server", "unknown group _", this->_group);
+                return;
+            }
+            sys::uid_type overflow_uid = 65534;
+            if (!(std::stringstream("/proc/sys/fs/overflowuid") >> overflow_uid)) {
+                overflow_uid = 65534;
+            }
+            sys::gid_type overflow_gid = 65534;
+            if (!(std::stringstream("/proc/sys/fs/overflowgid") >> overflow_gid)) {
+                overflow_gid = 65534;
+            }
+            member_map members;
+            for (const auto& member : group) {
+                auto known = this->_members.find(member);
+                if (known != this->_members.end()) {
+                    this->_users.emplace(known->second);
+                    members.emplace(known->first, known->second);
+                    continue;
+                }
+                try {
+                    sys::user user;
+                    if (!sys::find_user(member, user)) {
+                        throw std::invalid_argument("unknown user in group");
+                    }
+                    if (user.id() < 1000 || user.group_id() < 1000) {
+                        throw std::invalid_argument(
+                            "will not work for unpriviledged user"
+                        );
+                    }
+                    if (user.id() == overflow_uid || user.group_id() == overflow_gid) {
+                        throw std::invalid_argument(
+                            "will not work for overflow user/group"
+                        );
+                    }
+                    this->_users.emplace(user);
+                    members.emplace(member, User(user));
+                } catch (const std::exception& err) {
+                    sys::log_message(
+                        "server",
+                        "skipping user _: _",
+                        member,
+                        err.what()
+                    );
+                }
+            }
+            this->_members.swap(members);
+        }
+
+        void
+        complete() override {
+            this->_function(*this);
+        }
+
+        /// The group was not found (e.g. the directory server is not available).
+        inline bool
+        failed() const {
+            return this->_failed;
+        }
+
+        inline set_type&
+        users() {
+            return this->_users;
+        }
+
+        /// Valid group members (the cache for the next lookup).
+        inline member_map&
+        members() {
+            return this->_members;
+        }
+
+    };
+
     class Update_users: public Task {
 
     public:
         typedef std::unordered_set<User> set_type;
+        /// The size of the sockmap for the kernel relay.
+        static constexpr const size_t max_sessions = 65536;
 
     private:
-        Server& _server;
+        Server_pool& _servers;
         std::string _group;
         Port _port = 50000;
         Port _vnc_base_port = 40000;
+        Port _single_port;
+        Front_door* _front_door = nullptr;
+        /// Accept clear text passwords from non-loopback clients in single port mode.
+        bool _remote_clients = false;
+        Nss_pool* _nss = nullptr;
         sys::socket_address _address;
         set_type _old_users;
+        /// Valid group members resolved by previous updates.
+        Group_lookup::member_map _members;
+        /// The lookup is running in a worker thread.
+        bool _lookup_running = false;
+        /// Another update was requested while the lookup was running.
+        bool _update_pending = false;
+        /// User database has changed since the last lookup was started.
+        bool _users_changed = false;
         std::chrono::seconds _tcp_user_timeout{60};
         std::chrono::seconds _update_period{30};
-        bool _verbose = false;
+        size_t _nthreads = 1;
+        Session_options _session_options;
+        Warm_pool_options _warm_options;
+        std::string _metrics_endpoint;
+        std::string _tls_certificate;
+        std::string _tls_key;
 
     public:
 
         inline explicit
-        Update_users(Server& server): _server(server) {
+        Update_users(Server_pool& servers): _servers(servers) {
             this->period(this->_update_period);
             this->repeat_forever();
         }
 
         void
         parse_arguments(int argc, char* argv[]) {
-            for (int opt; (opt = ::getopt(argc, argv, "hg:p:P:t:T:v")) != -1;) {
+            const char* optstring = "bcC:he:g:G:i:j:k:K:l:m:M:o:O:"
+                "p:P:q:r:Rs:S:t:T:u:vw:W:z";
+            for (int opt; (opt = ::getopt(argc, argv, optstring)) != -1;) {
                 switch (opt) {
+                case 'b':
+                    this->_session_options.kernel_relay = true;
+                    break;
+                case 'c':
+                    this->_remote_clients = true;
+                    break;
+                case 'C':
+                    this->_tls_certificate = ::optarg;
+                    break;
                 case 'h':
                     usage();
                     std::exit(EXIT_SUCCESS);
+                case 'e':
+                    this->_metrics_endpoint = ::optarg;
+                    break;
                 case 'g':
                     this->_group = ::optarg;
                     break;
+                case 'G': {
+                    std::chrono::seconds t;
+                    ::optarg >> t;
+                    this->_session_options.grace_period = t;
+                    break;
+                }
+                case 'i': {
+                    std::chrono::seconds t;
+                    ::optarg >> t;
+                    this->_warm_options.idle_timeout = t;
+                    break;
+                }
+                case 'j':
+                    this->_nthreads = parse_positive(::optarg);
+                    break;
+                case 'k':
+                    this->_tls_key = ::optarg;
+                    break;
+                case 'K': {
+                    std::chrono::seconds t;
+                    ::optarg >> t;
+                    this->_session_options.kill_timeout = t;
+                    break;
+                }
+                case 'l':
+                    this->parse_bandwidth(::optarg);
+                    break;
+                case 'm':
+                    this->_warm_options.memory_budget = parse_positive(::optarg) << 20;
+                    break;
+                case 'M':
+                    this->_warm_options.server_memory = parse_positive(::optarg) << 20;
+                    break;
+                case 'o':
+                    this->_session_options.remote_profile.parse(::optarg);
+                    break;
+                case 'O':
+                    this->_session_options.local_profile.parse(::optarg);
+                    break;
                 case 'p':
                     ::optarg >> this->_port;
                     break;
                 case 'P':
                     ::optarg >> this->_vnc_base_port;
                     break;
+                case 'q':
+                    this->_session_options.quantum = parse_positive(::optarg);
+                    break;
+                case 'r':
+                    this->_warm_options.users.emplace(::optarg);
+                    break;
+                case 'R':
+                    this->_warm_options.predict = true;
+                    break;
+                case 's':
+                    ::optarg >> this->_single_port;
+                    break;
+                case 'S': {
+                    std::chrono::seconds t;
+                    ::optarg >> t;
+                    this->_session_options.start_timeout = t;
+                    break;
+                }
                 case 't':
                     ::optarg >> this->_tcp_user_timeout;
                     break;
                 case 'T':
                     ::optarg >> this->_update_period;
                     break;
+                case 'u':
+                    this->_session_options.socket_directory = ::optarg;
+                    break;
                 case 'v':
-                    this->_verbose = true;
+                    this->_session_options.verbose = true;
+                    break;
+                case 'w':
+                    this->_session_options.high_water = parse_positive(::optarg);
+                    break;
+                case 'W':
+                    this->_session_options.low_water = parse_positive(::optarg);
+                    break;
+                case 'z':
+                    this->_session_options.handoff = true;
                     break;
                 default:
                     usage();
@@ -103,6 +313,58 @@ namespace vncd {
             if (this->_group.empty()) {
                 throw std::invalid_argument("bad group");
             }
+            {
+                // the only lookup in the event loop thread: before the loop is started
+                sys::group group;
+                if (!sys::find_group(this->_group.data(), group)) {
+                    throw std::invalid_argument("unknown group");
+                }
+            }
+            const auto& options = this->_session_options;
+            if (options.low_water != 0) {
+                // the marks are limited by pipe capacity in each session
+                size_t high_water = sys::pipe().in().pipe_buffer_size();
+                if (options.high_water != 0) {
+                    high_water = std::min(options.high_water, high_water);
+                }
+                if (options.low_water >= high_water) {
+                    throw std::invalid_argument("low water mark is not below high water mark");
+                }
+            }
+            if (options.grace_period != Task::duration::zero() &&
+                options.socket_directory.empty()) {
+                // detached VNC servers would listen on loopback TCP ports that
+                // any local user can connect to
+                throw std::invalid_argument(
+                    "grace period requires Unix sockets (-u option)"
+                );
+            }
+            if (this->_remote_clients && this->_single_port == 0) {
+                throw std::invalid_argument("-c option requires single port mode (-s option)");
+            }
+            if (options.handoff && this->_single_port != 0) {
+                throw std::invalid_argument(
+                    "can not hand off connections to VNC servers in single port mode"
+                );
+            }
+            if (this->_warm_options.enabled() && options.socket_directory.empty()) {
+                // warm VNC servers wait for the users on loopback TCP ports
+                // that any local user can connect to
+                throw std::invalid_argument("warm VNC servers require Unix sockets (-u option)");
+            }
+            if (options.handoff && this->_warm_options.enabled()) {
+                throw std::invalid_argument(
+                    "can not hand off connections to warm VNC servers"
+                );
+            }
+#if defined(VNCD_IO_URING)
+            // io_uring relays the data without the event loop's round robin
+            if (options.bandwidth != 0 || !options.user_bandwidth.empty()) {
+                throw std::invalid_argument("bandwidth caps are not supported with io_uring");
+            }
+#endif
+            options.remote_profile.validate();
+            options.local_profile.validate();
             if (::optind+1 < argc) {
                 throw std::invalid_argument("trailing arguments");
             }
@@ -120,89 +382,309 @@ namespace vncd {
             if (!std::getenv("VNCD_SESSION")) {
                 throw std::invalid_argument("VNCD_SESSION variable is not set");
             }
-            this->_server.set_user_timeout(this->_tcp_user_timeout);
+        }
+
+        /// Open the sockets and start the event loop threads.
+        void
+        start() {
+            const auto& options = this->_session_options;
+            if (!options.socket_directory.empty()) {
+                this->make_socket_directory();
+            }
+            if (options.kernel_relay) {
+                this->start_sockmap();
+            }
+            if (!this->_tls_certificate.empty() || !this->_tls_key.empty()) {
+                this->load_certificates();
+            }
+            this->period(this->_update_period);
+            this->_servers.resize(this->_nthreads);
+            this->_servers.set_user_timeout(this->_tcp_user_timeout);
+            if (this->_warm_options.enabled()) {
+                this->_warm_options.session = this->_session_options;
+                this->_servers.warm_pool(this->_warm_options);
+            }
+            if (this->_single_port != 0) {
+                this->_front_door = new Front_door(
+                    this->_servers,
+                    sys::socket_address{this->_address, this->_single_port},
+                    this->_vnc_base_port,
+                    this->_session_options,
+                    this->_remote_clients
+                );
+                this->_servers.front().add(this->_front_door);
+            }
+            if (!this->_metrics_endpoint.empty()) {
+                this->_servers.front().add(new Metrics_server(this->_metrics_endpoint));
+            }
+            this->_nss = new Nss_pool;
+            this->_servers.front().add(this->_nss);
+            this->_servers.front().add(new Nss_watch(
+                [this] (bool users_changed) { this->update(users_changed); }
+            ));
+            this->_servers.front().add(new Helper_watch(Spawner::instance()));
+        }
+
+        /// Parse bandwidth cap in KiB/s either for all users or for USER=KBPS.
+        void
+        parse_bandwidth(const char* arg) {
+            auto& options = this->_session_options;
+            const char* eq = std::strchr(arg, '=');
+            if (!eq) {
+                options.bandwidth = parse_positive(arg) << 10;
+                return;
+            }
+            if (eq == arg) {
+                throw std::invalid_argument("bad user name");
+            }
+            options.user_bandwidth[std::string(arg, eq)] = parse_positive(eq+1) << 10;
         }
 
         void
         usage() {
             std::cout <<
-                "usage: vncd [-h] [-p PORT] [-P PORT] [-t TIMEOUT] [-T PERIOD] -v"
-                " -g GROUP [ADDRESS]\n"
+                "usage: vncd [-b] [-c] [-C FILE] [-h] [-e ENDPOINT] [-G SECONDS]"
+                " [-i TIMEOUT] [-j THREADS] [-k FILE] [-K SECONDS]"
+                " [-l [USER=]KBPS]... [-m MEGABYTES] [-M MEGABYTES]"
+                " [-o OPTIONS] [-O OPTIONS] [-p PORT] [-P PORT] [-q BYTES]"
+                " [-r USER]... [-R] [-s PORT] [-S TIMEOUT] [-t TIMEOUT]"
+                " [-T PERIOD] [-u DIRECTORY] [-w BYTES] [-W BYTES] [-z]"
+                " -v -g GROUP [ADDRESS]\n"
+                "    -b  relay the data in the kernel via BPF sockmap\n"
+                "        (falls back to splice)\n"
+                "    -c  accept non-loopback clients in single port mode\n"
+                "        (passwords are sent in clear text)\n"
+                "    -C  TLS certificate chain (PEM)\n"
+                "    -e  serve metrics on this local TCP port or Unix socket path\n"
+                "    -G  keep the session running for this long after the client\n"
+                "        disconnects (requires -u, the VNC server must not be\n"
+                "        started with -once)\n"
+                "    -i  stop predicted warm VNC servers that were not used\n"
+                "        for this long\n"
+                "    -j  no. of event loop threads\n"
+                "    -k  TLS private key (PEM)\n"
+                "    -K  send SIGKILL to the processes that did not exit\n"
+                "        this long after SIGTERM\n"
+                "    -l  bandwidth cap in KiB/s for all users or for the user\n"
+                "    -m  memory budget for warm VNC servers\n"
+                "    -M  memory usage of a warm VNC server until the running\n"
+                "        ones are measured\n"
+                "    -o  socket options of client connections\n"
+                "        (e.g. low-latency,congestion=bbr)\n"
+                "    -O  socket options of VNC server connections (see below)\n"
                 "    -p  input port\n"
                 "    -P  output port\n"
+                "    -q  how many bytes each session relays in turn\n"
+                "    -r  always keep warm VNC server for the user (requires -u)\n"
+                "    -R  start VNC servers ahead of users' usual login time\n"
+                "        (requires -u)\n"
+                "    -s  single input port for all users\n"
+                "        (user name is taken from RFB handshake)\n"
+                "    -S  VNC server start timeout\n"
+                "        (and handshake timeout in single port mode)\n"
                 "    -t  TCP user timeout\n"
-                "    -T  update period\n"
+                "    -T  full update period, 30 seconds by default\n"
+                "        (changes in /etc/group, /etc/passwd and SSSD memory\n"
+                "        cache are applied immediately, other NSS sources,\n"
+                "        e.g. LDAP, only on full update)\n"
+                "    -u  connect to VNC servers via Unix sockets in this\n"
+                "        directory instead of output ports\n"
+                "    -w  high water mark\n"
+                "        (stop reading when this many bytes are buffered)\n"
+                "    -W  low water mark\n"
+                "        (resume reading when this many bytes are buffered)\n"
+                "    -z  pass client's socket to VNC server instead of relaying\n"
                 "    -v  be verbose\n"
-                "    -g  access group\n";
+                "    -g  access group\n"
+                "socket options (comma-separated):\n"
+                "    nodelay, quickack, notsent-lowat=BYTES, sndbuf=BYTES,\n"
+                "    rcvbuf=BYTES, congestion=NAME, busy-poll=MICROSECONDS,\n"
+                "    default (no options),\n"
+                "    low-latency (nodelay, quickack, notsent-lowat=16384)\n";
+        }
+
+        /// Load BPF programs for the kernel relay or fall back to splice.
+        void
+        start_sockmap() {
+#if defined(VNCD_IO_URING)
+            throw std::invalid_argument("kernel relay is not supported with io_uring");
+#else
+            try {
+                Sockmap::instance().start(max_sessions);
+            } catch (const std::exception& err) {
+                sys::log_message("server", "BPF is not available, relay via splice: _",
+                                 err.what());
+            }
+#endif
+        }
+
+        /// Load TLS certificate chain and private key for all sessions.
+        void
+        load_certificates() {
+#if defined(VNCD_TLS) && !defined(VNCD_IO_URING)
+            if (this->_tls_certificate.empty() || this->_tls_key.empty()) {
+                throw std::invalid_argument("both TLS certificate and key are required");
+            }
+            if (this->_single_port != 0) {
+                throw std::invalid_argument("TLS is not supported in single port mode");
+            }
+            if (this->_session_options.handoff) {
+                throw std::invalid_argument("can not hand off TLS connections");
+            }
+            if (!kernel_tls_available()) {
+                throw std::invalid_argument("kernel TLS is not available (load tls module)");
+            }
+            this->_session_options.tls =
+                std::make_shared<Tls_context>(this->_tls_certificate, this->_tls_key);
+#elif defined(VNCD_TLS)
+            throw std::invalid_argument("TLS is not supported with io_uring");
+#else
+            throw std::invalid_argument("VNCD is built without TLS support");
+#endif
+        }
+
+        /// Create the base directory for VNC servers' Unix sockets.
+        void
+        make_socket_directory() {
+            const auto& dir = this->_session_options.socket_directory;
+            if (dir.front() != '/') {
+                throw std::invalid_argument("socket directory is not an absolute path");
+            }
+            ::sockaddr_un address;
+            if (vnc_socket_path(dir, sys::uid_type(-1)).size() >= sizeof(address.sun_path)) {
+                throw std::invalid_argument("socket directory path is too long");
+            }
+            if (::mkdir(dir.data(), 0755) == -1 && errno != EEXIST) {
+                throw sys::bad_call();
+            }
         }
 
+        /// Full resynchronisation (a fallback for changes that were not watched).
         void
         run() override {
-            auto new_users = find_new_users();
-            auto users_to_add = set_difference(new_users, this->_old_users);
-            auto users_to_remove = set_difference(this->_old_users, new_users);
-            this->_old_users = std::move(new_users);
-            for (const auto& user : users_to_remove) {
-                Port port = this->_port + user.id();
-                this->_server.remove(port);
-            }
-            for (const auto& user : users_to_add) {
-                Port port = this->_port + user.id();
-                Port vnc_port = this->_vnc_base_port + user.id();
-                sys::socket_address address{this->_address, port};
-                this->_server.add(new Local_server(
-                    address,
-                    vnc_port,
-                    user,
-                    this->_verbose
-                ));
+            Task::run();
+            this->update(true);
+        }
+
+        /**
+        Look up group members in a worker thread and apply the changes in group
+        membership when the lookup completes. Group members are looked up
+        in user database only if they are new or if the database has changed.
+        Only one lookup runs at a time, the updates that are requested in the
+        meantime are coalesced into one.
+        */
+        void
+        update(bool users_changed) {
+            this->_users_changed |= users_changed;
+            if (this->_lookup_running) {
+                this->_update_pending = true;
+                return;
+            }
+            if (this->_users_changed) {
+                this->_members.clear();
+                this->_users_changed = false;
             }
+            this->_lookup_running = true;
+            this->_update_pending = false;
+            this->_nss->submit(new Group_lookup(
+                this->_group,
+                this->_members,
+                [this] (Group_lookup& lookup) { this->apply(lookup); }
+            ));
         }
 
     private:
 
-        set_type
-        find_new_users() {
-            sys::group group;
-            if (!sys::find_group(_group.data(), group)) {
-                throw std::invalid_argument("unknown group");
+        void
+        apply(Group_lookup& lookup) {
+            this->_lookup_running = false;
+            if (!lookup.failed()) {
+                this->_members.swap(lookup.members());
+                this->apply(lookup.users());
             }
-            sys::uid_type overflow_uid = 65534;
-            if (!(std::stringstream("/proc/sys/fs/overflowuid") >> overflow_uid)) {
-                overflow_uid = 65534;
+            if (this->_update_pending) {
+                this->update(false);
             }
-            sys::gid_type overflow_gid = 65534;
-            if (!(std::stringstream("/proc/sys/fs/overflowgid") >> overflow_gid)) {
-                overflow_gid = 65534;
+        }
+
+        void
+        apply(const set_type& new_users) {
+            bool changed = false;
+            for (auto first = this->_old_users.begin(); first != this->_old_users.end(); ) {
+                if (new_users.count(*first) != 0) {
+                    ++first;
+                    continue;
+                }
+                // the removal is retried by the next update if it fails
+                try {
+                    this->remove(*first);
+                    first = this->_old_users.erase(first);
+                    changed = true;
+                } catch (const std::exception& err) {
+                    sys::log_message("server", "failed to remove user _: _",
+                                     first->name(), err.what());
+                    ++first;
+                }
             }
-            set_type result;
-            for (const auto& member : group) {
+            for (const auto& user : new_users) {
+                if (this->_old_users.count(user) != 0) {
+                    continue;
+                }
+                // a port that can not be bound does not block the other users
                 try {
-                    sys::user user;
-                    if (!sys::find_user(member, user)) {
-                        throw std::invalid_argument("unknown user in group");
-                    }
-                    if (user.id() < 1000 || user.group_id() < 1000) {
-                        throw std::invalid_argument(
-                            "will not work for unpriviledged user"
-                        );
-                    }
-                    if (user.id() == overflow_uid || user.group_id() == overflow_gid) {
-                        throw std::invalid_argument(
-                            "will not work for overflow user/group"
-                        );
-                    }
-                    result.emplace(user);
+                    this->add(user);
+                    this->_old_users.insert(user);
+                    changed = true;
                 } catch (const std::exception& err) {
-                    sys::log_message(
-                        "server",
-                        "skipping user _: _",
-                        member,
-                        err.what()
-                    );
+                    sys::log_message("server", "failed to add user _: _",
+                                     user.name(), err.what());
                 }
             }
-            return result;
+            if (changed && this->_warm_options.enabled()) {
+                this->update_warm_candidates(this->_old_users);
+            }
+        }
+
+        void
+        add(const User& user) {
+            if (this->_front_door) {
+                this->_front_door->allow(user);
+                return;
+            }
+            Port port = this->_port + user.id();
+            Port vnc_port = this->_vnc_base_port + user.id();
+            sys::socket_address address{this->_address, port};
+            this->_servers.add(user.id(), new Local_server(
+                address,
+                vnc_port,
+                user,
+                this->_session_options
+            ));
+        }
+
+        void
+        remove(const User& user) {
+            if (this->_front_door) {
+                this->_front_door->deny(user);
+            }
+            // terminates the user's session in single port mode as well
+            this->_servers.remove(user.id());
+        }
+
+        void
+        update_warm_candidates(const set_type& users) {
+            std::vector<Warm_candidate> candidates;
+            for (const auto& user : users) {
+                Port port = this->_front_door
+                    ? this->_single_port
+                    : Port(this->_port + user.id());
+                candidates.emplace_back(Warm_candidate{
+                    user,
+                    port,
+                    Port(this->_vnc_base_port + user.id())
+                });
+            }
+            this->_servers.warm_candidates(candidates);
         }
 
     };
@@ -217,11 +699,15 @@ main(int argc, char* argv[]) {
 //      sys::this_process::ignore_signal(sys::signal::child);
 //      sys::this_process::ignore_signal(sys::signal::broken_pipe);
 //      sys::this_process::ignore_signal(sys::signal::terminal_window_resize);
-        Server server;
-        std::unique_ptr<Update_users> update_users(new Update_users(server));
+        // the shards are created after the arguments are parsed
+        Server_pool servers;
+        std::unique_ptr<Update_users> update_users(new Update_users(servers));
         update_users->parse_arguments(argc, argv);
-        server.submit(std::move(update_users));
-        server.run();
+        // fork the helper before any sockets are opened
+        Spawner::instance().start();
+        update_users->start();
+        servers.front().submit(std::move(update_users));
+        servers.run();
     } catch (const std::exception& err) {
         std::cerr << err.what() << std::endl;
         ret = EXIT_FAILURE;
@@ -0,0 +1,475 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_METRICS_HH
+#define VNCD_METRICS_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <unistdx/base/simple_lock>
+#include <unistdx/base/spin_mutex>
+
+namespace vncd {
+
+    /**
+    Counter that is updated by a single thread (the shard that owns it)
+    and read by any thread. The update is a relaxed load and store,
+    i.e. no locked instructions on the relay path.
+    */
+    class Counter {
+
+    private:
+        std::atomic<uint64_t> _value{0};
+
+    public:
+
+        inline void
+        add(uint64_t n) {
+            this->_value.store(this->_value.load(std::memory_order_relaxed) + n,
+                               std::memory_order_relaxed);
+        }
+
+        inline uint64_t
+        get() const {
+            return this->_value.load(std::memory_order_relaxed);
+        }
+
+    };
+
+    /**
+    Log-linear (HDR-style) histogram of durations in microseconds.
+    Each power of two is divided into 16 linear sub-buckets, i.e. the
+    relative error of a percentile is at most 1/16. Values up to
+    2^40 us (about 12 days) are recorded, larger values are clamped.
+    Like counters, the histogram is updated by a single thread.
+    */
+    class Histogram {
+
+    public:
+        typedef std::chrono::microseconds unit_type;
+
+    private:
+        static constexpr const unsigned sub_bits = 4;
+        static constexpr const unsigned nsub = 1u << sub_bits;
+        static constexpr const unsigned max_bits = 40;
+        static constexpr const uint64_t max_value = (uint64_t(1) << max_bits) - 1;
+
+    public:
+        static constexpr const unsigned nbuckets = (max_bits - sub_bits + 1)*nsub;
+
+    private:
+        Counter _buckets[nbuckets];
+        Counter _count;
+        /// The sum of all values in microseconds.
+        Counter _sum;
+
+    public:
+
+        template <class Rep, class Period>
+        inline void
+        record(std::chrono::duration<Rep,Period> d) {
+            using std::chrono::duration_cast;
+            auto us = duration_cast<unit_type>(d).count();
+            this->record(us < 0 ? uint64_t(0) : uint64_t(us));
+        }
+
+        inline void
+        record(uint64_t value) {
+            if (value > max_value) {
+                value = max_value;
+            }
+            this->_buckets[index(value)].add(1);
+            this->_count.add(1);
+            this->_sum.add(value);
+        }
+
+        inline uint64_t
+        count() const {
+            return this->_count.get();
+        }
+
+        inline uint64_t
+        sum() const {
+            return this->_sum.get();
+        }
+
+        /// Add bucket counts to the vector (to merge histograms of all shards).
+        inline void
+        add_to(std::vector<uint64_t>& counts) const {
+            counts.resize(nbuckets);
+            for (unsigned i=0; i<nbuckets; ++i) {
+                counts[i] += this->_buckets[i].get();
+            }
+        }
+
+        /// The largest value that is equivalent to the value at the quantile.
+        static uint64_t
+        quantile(const std::vector<uint64_t>& counts, double q) {
+            uint64_t total = 0;
+            for (auto n : counts) {
+                total += n;
+            }
+            if (total == 0) {
+                return 0;
+            }
+            auto rank = uint64_t(q*double(total) + 0.5);
+            if (rank == 0) {
+                rank = 1;
+            }
+            uint64_t sum = 0;
+            for (unsigned i=0; i<counts.size(); ++i) {
+                sum += counts[i];
+                if (sum >= rank) {
+                    return upper_bound(i);
+                }
+            }
+            return max_value;
+        }
+
+    private:
+
+        static inline unsigned
+        index(uint64_t value) {
+            if (value < nsub) {
+                return unsigned(value);
+            }
+            const unsigned exponent = 63 - unsigned(__builtin_clzll(value));
+            const unsigned shift = exponent - sub_bits;
+            return (shift + 1)*nsub + unsigned(value >> shift) - nsub;
+        }
+
+        static inline uint64_t
+        upper_bound(unsigned i) {
+            if (i < nsub) {
+                return i;
+            }
+            const unsigned shift = i/nsub - 1;
+            const uint64_t lower = uint64_t(nsub + i%nsub) << shift;
+            return lower + (uint64_t(1) << shift) - 1;
+        }
+
+    };
+
+    enum class Direction { Upstream=0, Downstream=1 };
+
+    inline const char*
+    to_string(Direction d) {
+        return d == Direction::Upstream ? "upstream" : "downstream";
+    }
+
+    /// Login phases that are measured from the moment the connection is accepted.
+    enum class Phase {
+        /// VNC server process is forked.
+        Spawn=0,
+        /// The connection to the local VNC server is established.
+        Connect=1,
+        /// The first byte from the local VNC server is relayed to the client.
+        First_byte=2,
+        /// X session process is forked.
+        X_session=3
+    };
+
+    constexpr const int nphases = 4;
+
+    inline const char*
+    to_string(Phase p) {
+        switch (p) {
+            case Phase::Spawn: return "spawn";
+            case Phase::Connect: return "connect";
+            case Phase::First_byte: return "first_byte";
+            case Phase::X_session: return "x_session";
+            default: return "unknown";
+        }
+    }
+
+    /// Counters of one relay direction.
+    struct Relay_metrics {
+        Counter bytes;
+        Counter splices;
+        /// Splice calls that returned EAGAIN.
+        Counter eagain;
+
+        inline void
+        add(uint64_t bytes, uint64_t splices, uint64_t eagain) {
+            if (bytes != 0) { this->bytes.add(bytes); }
+            if (splices != 0) { this->splices.add(splices); }
+            if (eagain != 0) { this->eagain.add(eagain); }
+        }
+    };
+
+    /// Counters of one session.
+    struct Session_metrics {
+
+        enum class State: uint8_t { Idle, Active, Detached, Terminated };
+
+        /// Distinguishes the sessions of the same user (e.g. warm and live ones).
+        const uint64_t id = next_id();
+        std::string user;
+        Relay_metrics relay[2];
+        std::atomic<State> state{State::Idle};
+
+        inline Relay_metrics&
+        operator[](Direction d) {
+            return this->relay[int(d)];
+        }
+
+    private:
+
+        static inline uint64_t
+        next_id() {
+            static std::atomic<uint64_t> last{0};
+            return ++last;
+        }
+
+    };
+
+    /// Counters of one shard.
+    struct Server_metrics {
+        Relay_metrics relay[2];
+        Counter sessions;
+        Counter spawns;
+        Counter spawn_failures;
+        /// Time spent in event and task processing in nanoseconds.
+        Counter events_time;
+        Counter tasks_time;
+        Counter iterations;
+        /// Time from accepting the connection to the end of each login phase.
+        Histogram login[nphases];
+        /// Time spent processing the events of one loop iteration.
+        Histogram iteration;
+
+        inline Relay_metrics&
+        operator[](Direction d) {
+            return this->relay[int(d)];
+        }
+
+        inline Histogram&
+        operator[](Phase p) {
+            return this->login[int(p)];
+        }
+    };
+
+    /// All counters of the process. Formats them in Prometheus text format.
+    class Metrics_registry {
+
+    private:
+        typedef sys::spin_mutex mutex_type;
+        typedef sys::simple_lock<mutex_type> lock_type;
+
+    private:
+        std::vector<const Server_metrics*> _servers;
+        std::unordered_set<const Session_metrics*> _sessions;
+        mutable mutex_type _mutex;
+
+    public:
+
+        static inline Metrics_registry&
+        instance() {
+            static Metrics_registry registry;
+            return registry;
+        }
+
+        inline void
+        add(const Server_metrics* m) {
+            lock_type lock(this->_mutex);
+            this->_servers.emplace_back(m);
+        }
+
+        inline void
+        remove(const Server_metrics* m) {
+            lock_type lock(this->_mutex);
+            auto& v = this->_servers;
+            for (auto first = v.begin(); first != v.end(); ++first) {
+                if (*first == m) {
+                    v.erase(first);
+                    break;
+                }
+            }
+        }
+
+        inline void
+        add(const Session_metrics* m) {
+            lock_type lock(this->_mutex);
+            this->_sessions.emplace(m);
+        }
+
+        inline void
+        remove(const Session_metrics* m) {
+            lock_type lock(this->_mutex);
+            this->_sessions.erase(m);
+        }
+
+        std::string
+        text() const {
+            typedef Session_metrics::State State;
+            std::stringstream out;
+            lock_type lock(this->_mutex);
+            this->relay(out, "vncd_relay_bytes_total",
+                        "Bytes relayed between the sockets.", &Relay_metrics::bytes);
+            this->relay(out, "vncd_relay_splices_total",
+                        "Splice calls.", &Relay_metrics::splices);
+            this->relay(out, "vncd_relay_splices_eagain_total",
+                        "Splice calls that would block.", &Relay_metrics::eagain);
+            this->counter(out, "vncd_sessions_started_total",
+                          "Sessions that were started.", &Server_metrics::sessions);
+            this->counter(out, "vncd_spawns_total",
+                          "Processes that were spawned.", &Server_metrics::spawns);
+            this->counter(out, "vncd_spawn_failures_total",
+                          "Processes that failed to spawn.", &Server_metrics::spawn_failures);
+            this->counter(out, "vncd_loop_iterations_total",
+                          "Event loop iterations.", &Server_metrics::iterations);
+            out << "# HELP vncd_loop_seconds_total Time spent in event loop phases.\n";
+            out << "# TYPE vncd_loop_seconds_total counter\n";
+            out << "vncd_loop_seconds_total{phase=\"events\"} "
+                << seconds(this->sum(&Server_metrics::events_time)) << '\n';
+            out << "vncd_loop_seconds_total{phase=\"tasks\"} "
+                << seconds(this->sum(&Server_metrics::tasks_time)) << '\n';
+            out << "# HELP vncd_login_seconds Time from accepting the connection "
+                "to the end of the login phase.\n";
+            out << "# TYPE vncd_login_seconds summary\n";
+            for (int i=0; i<nphases; ++i) {
+                std::string labels = "phase=\"";
+                labels += to_string(Phase(i));
+                labels += '"';
+                this->summary(out, "vncd_login_seconds", labels,
+                              [i] (const Server_metrics& m) -> const Histogram& {
+                                  return m.login[i];
+                              });
+            }
+            out << "# HELP vncd_loop_iteration_seconds Time spent processing "
+                "the events of one loop iteration.\n";
+            out << "# TYPE vncd_loop_iteration_seconds summary\n";
+            this->summary(out, "vncd_loop_iteration_seconds", "",
+                          [] (const Server_metrics& m) -> const Histogram& {
+                              return m.iteration;
+                          });
+            size_t nactive = 0, ndetached = 0, nidle = 0;
+            for (const auto* s : this->_sessions) {
+                switch (s->state.load(std::memory_order_relaxed)) {
+                    case State::Idle: ++nidle; break;
+                    case State::Active: ++nactive; break;
+                    case State::Detached: ++ndetached; break;
+                    case State::Terminated: break;
+                }
+            }
+            out << "# HELP vncd_sessions Live sessions by state.\n";
+            out << "# TYPE vncd_sessions gauge\n";
+            out << "vncd_sessions{state=\"active\"} " << nactive << '\n';
+            out << "vncd_sessions{state=\"detached\"} " << ndetached << '\n';
+            out << "vncd_sessions{state=\"idle\"} " << nidle << '\n';
+            this->session(out, "vncd_session_bytes_total",
+                          "Bytes relayed by live sessions.", &Relay_metrics::bytes);
+            this->session(out, "vncd_session_splices_total",
+                          "Splice calls of live sessions.", &Relay_metrics::splices);
+            this->session(out, "vncd_session_splices_eagain_total",
+                          "Splice calls of live sessions that would block.",
+                          &Relay_metrics::eagain);
+            return out.str();
+        }
+
+    private:
+
+        void
+        relay(std::ostream& out, const char* name, const char* help,
+              Counter Relay_metrics::*field) const {
+            out << "# HELP " << name << ' ' << help << '\n';
+            out << "# TYPE " << name << " counter\n";
+            for (auto d : {Direction::Upstream, Direction::Downstream}) {
+                uint64_t result = 0;
+                for (const auto* m : this->_servers) {
+                    result += (m->relay[int(d)].*field).get();
+                }
+                out << name << "{direction=\"" << to_string(d) << "\"} " << result << '\n';
+            }
+        }
+
+        void
+        session(std::ostream& out, const char* name, const char* help,
+                Counter Relay_metrics::*field) const {
+            out << "# HELP " << name << ' ' << help << '\n';
+            out << "# TYPE " << name << " counter\n";
+            for (const auto* s : this->_sessions) {
+                for (auto d : {Direction::Upstream, Direction::Downstream}) {
+                    out << name << "{user=\"" << escape(s->user) << "\",session=\"" << s->id
+                        << "\",direction=\"" << to_string(d) << "\"} "
+                        << (s->relay[int(d)].*field).get() << '\n';
+                }
+            }
+        }
+
+        void
+        counter(std::ostream& out, const char* name, const char* help,
+                Counter Server_metrics::*field) const {
+            out << "# HELP " << name << ' ' << help << '\n';
+            out << "# TYPE " << name << " counter\n";
+            out << name << ' ' << this->sum(field) << '\n';
+        }
+
+        /// Merge the histograms of all shards and print the quantiles.
+        template <class Get>
+        void
+        summary(std::ostream& out, const char* name, const std::string& labels,
+                Get get) const {
+            std::vector<uint64_t> counts;
+            uint64_t count = 0, sum = 0;
+            for (const auto* m : this->_servers) {
+                const Histogram& h = get(*m);
+                h.add_to(counts);
+                count += h.count();
+                sum += h.sum();
+            }
+            const std::string sep = labels.empty() ? "" : ",";
+            for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                out << name << '{' << labels << sep << "quantile=\"" << q << "\"} "
+                    << from_microseconds(Histogram::quantile(counts, q)) << '\n';
+            }
+            const std::string suffix = labels.empty() ? "" : '{' + labels + '}';
+            out << name << "_sum" << suffix << ' ' << from_microseconds(sum) << '\n';
+            out << name << "_count" << suffix << ' ' << count << '\n';
+        }
+
+        uint64_t
+        sum(Counter Server_metrics::*field) const {
+            uint64_t result = 0;
+            for (const auto* m : this->_servers) {
+                result += (m->*field).get();
+            }
+            return result;
+        }
+
+        /// Escape the label value as the text exposition format requires.
+        static std::string
+        escape(const std::string& value) {
+            std::string result;
+            result.reserve(value.size());
+            for (char ch : value) {
+                switch (ch) {
+                    case '\\': result += "\\\\"; break;
+                    case '"': result += "\\\""; break;
+                    case '\n': result += "\\n"; break;
+                    default: result += ch; break;
+                }
+            }
+            return result;
+        }
+
+        static inline double
+        seconds(uint64_t ns) {
+            return double(ns) * 1e-9;
+        }
+
+        static inline double
+        from_microseconds(uint64_t us) {
+            return double(us) * 1e-6;
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
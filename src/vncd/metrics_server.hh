@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_METRICS_SERVER_HH
+#define VNCD_METRICS_SERVER_HH
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <unistdx/base/log_message>
+#include <unistdx/net/socket>
+#include <unistdx/net/socket_address>
+
+#include <vncd/metrics.hh>
+#include <vncd/server.hh>
+
+namespace vncd {
+
+    /// HTTP client that receives the metrics in Prometheus text format.
+    class Metrics_client: public Connection {
+
+    private:
+        std::string _request;
+        std::string _response;
+        size_t _offset = 0;
+
+    public:
+
+        inline explicit
+        Metrics_client(sys::socket&& socket) {
+            this->_socket = std::move(socket);
+        }
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            if (!started()) {
+                this->state(State::Stopped);
+                return;
+            }
+            if (this->_response.empty()) {
+                char buf[1024];
+                ssize_t n;
+                while ((n = this->_socket.read(buf, sizeof(buf))) > 0) {
+                    this->_request.append(buf, size_t(n));
+                }
+                if (n == 0 || this->_request.size() > 8192) {
+                    this->state(State::Stopped);
+                    return;
+                }
+                if (this->_request.find("\r\n\r\n") == std::string::npos &&
+                    this->_request.find("\n\n") == std::string::npos) {
+                    return;
+                }
+                this->respond();
+            }
+            while (this->_offset != this->_response.size()) {
+                auto n = this->_socket.write(this->_response.data() + this->_offset,
+                                             this->_response.size() - this->_offset);
+                if (n <= 0) {
+                    this->parent().modify(this->fd(), sys::event::out);
+                    return;
+                }
+                this->_offset += size_t(n);
+            }
+            this->state(State::Stopped);
+        }
+
+        void
+        set_user_timeout(const duration&) override {}
+
+    private:
+
+        void
+        respond() {
+            std::string status = "200 OK", body;
+            if (this->_request.compare(0, 4, "GET ") != 0) {
+                status = "405 Method Not Allowed";
+            } else {
+                body = Metrics_registry::instance().text();
+            }
+            this->_response =
+                "HTTP/1.0 " + status + "\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "Connection: close\r\n"
+                "\r\n" + body;
+        }
+
+    };
+
+    /**
+    Serves the metrics on local TCP port or Unix socket.
+    The endpoint is either a port number (bound to the loopback address)
+    or an absolute path of the Unix socket.
+    */
+    class Metrics_server: public Connection {
+
+    private:
+        std::string _endpoint;
+        std::string _path;
+
+    public:
+
+        inline explicit
+        Metrics_server(const std::string& endpoint):
+        _endpoint(endpoint) {
+            if (!endpoint.empty() && endpoint.front() == '/') {
+                this->listen_unix(endpoint);
+            } else {
+                this->listen_tcp(endpoint);
+            }
+            sys::log_message("metrics", "listen _", endpoint);
+        }
+
+        ~Metrics_server() {
+            if (!this->_path.empty()) {
+                ::unlink(this->_path.data());
+            }
+        }
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            if (started() && event.in()) {
+                sys::socket socket;
+                sys::socket_address address;
+                while (this->_socket.accept(socket, address)) {
+                    auto fd = socket.fd();
+                    this->parent().add(new Metrics_client(std::move(socket)));
+                    // scrapers that send nothing do not hold file descriptors
+                    this->parent().submit(new Connection_timeout_task(
+                        fd, this->parent().generation(fd), client_timeout(), "metrics"
+                    ));
+                }
+            }
+        }
+
+        void
+        set_user_timeout(const duration&) override {}
+
+        sys::port_type
+        port() const override {
+            return 0;
+        }
+
+    private:
+
+        /// The time the client has to send the request and receive the response.
+        static inline duration
+        client_timeout() {
+            return std::chrono::seconds(5);
+        }
+
+        void
+        listen_tcp(const std::string& endpoint) {
+            long port = 0;
+            try {
+                port = std::stol(endpoint);
+            } catch (const std::exception&) {
+                throw std::invalid_argument("bad metrics endpoint");
+            }
+            if (port <= 0 || port > 65535) {
+                throw std::invalid_argument("bad metrics port");
+            }
+            sys::ipv4_socket_address address{{127,0,0,1},sys::port_type(port)};
+            this->_socket = sys::socket(sys::family_type::ipv4);
+            this->_socket.set(sys::socket::options::reuse_address);
+            this->_socket.bind(address);
+            this->_socket.listen();
+        }
+
+        void
+        listen_unix(const std::string& path) {
+            ::sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path)) {
+                throw std::invalid_argument("metrics socket path is too long");
+            }
+            std::memcpy(address.sun_path, path.data(), path.size());
+            int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            UNISTDX_CHECK(fd);
+            this->_socket = sys::socket(fd);
+            ::unlink(path.data());
+            UNISTDX_CHECK(::bind(fd, reinterpret_cast<::sockaddr*>(&address),
+                                 sizeof(address)));
+            UNISTDX_CHECK(::listen(fd, SOMAXCONN));
+            this->_path = path;
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_NSS_POOL_HH
+#define VNCD_NSS_POOL_HH
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistdx/base/log_message>
+
+#include <vncd/server.hh>
+
+namespace vncd {
+
+    /// Blocking job that runs in a worker thread and completes in the event loop.
+    class Nss_job {
+
+    public:
+
+        virtual ~Nss_job() = default;
+
+        /// Called in a worker thread.
+        virtual void run() = 0;
+
+        /// Called in the event loop thread after run() has returned.
+        virtual void complete() = 0;
+
+    };
+
+    /**
+    Worker threads for user database lookups. With SSSD or LDAP backends each
+    lookup may block for hundreds of milliseconds, so they are never done in
+    the event loop. Finished jobs are queued and the loop is woken up via eventfd
+    that is registered in the poller as a connection.
+    */
+    class Nss_pool: public Fd_connection {
+
+    private:
+        typedef std::unique_ptr<Nss_job> job_pointer;
+
+    private:
+        std::vector<std::thread> _threads;
+        std::deque<job_pointer> _jobs;
+        std::vector<job_pointer> _finished;
+        std::mutex _mutex;
+        std::condition_variable _semaphore;
+        bool _stopped = false;
+
+    public:
+
+        inline explicit
+        Nss_pool(size_t nthreads=2):
+        Fd_connection(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+            UNISTDX_CHECK(this->fd());
+            for (size_t i=0; i<nthreads; ++i) {
+                this->_threads.emplace_back([this] () { this->loop(); });
+            }
+        }
+
+        ~Nss_pool() {
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_stopped = true;
+            }
+            this->_semaphore.notify_all();
+            for (auto& t : this->_threads) {
+                t.join();
+            }
+        }
+
+        Nss_pool(const Nss_pool&) = delete;
+        Nss_pool& operator=(const Nss_pool&) = delete;
+
+        /// Queue the job. Can be called from any thread.
+        inline void
+        submit(Nss_job* job) {
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_jobs.emplace_back(job);
+            }
+            this->_semaphore.notify_one();
+        }
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            uint64_t n = 0;
+            if (::read(this->fd(), &n, sizeof(n)) == -1) {
+                return;
+            }
+            std::vector<job_pointer> finished;
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                finished.swap(this->_finished);
+            }
+            for (auto& job : finished) {
+                try {
+                    job->complete();
+                } catch (const std::exception& err) {
+                    sys::log_message("nss", "error: _", err.what());
+                }
+            }
+        }
+
+    private:
+
+        void
+        loop() {
+            while (true) {
+                job_pointer job;
+                {
+                    std::unique_lock<std::mutex> lock(this->_mutex);
+                    this->_semaphore.wait(lock, [this] () {
+                        return this->_stopped || !this->_jobs.empty();
+                    });
+                    if (this->_stopped) {
+                        break;
+                    }
+                    job = std::move(this->_jobs.front());
+                    this->_jobs.pop_front();
+                }
+                try {
+                    job->run();
+                } catch (const std::exception& err) {
+                    sys::log_message("nss", "error: _", err.what());
+                }
+                {
+                    std::lock_guard<std::mutex> lock(this->_mutex);
+                    this->_finished.emplace_back(std::move(job));
+                }
+                const uint64_t one = 1;
+                while (::write(this->fd(), &one, sizeof(one)) == -1 && errno == EINTR) {}
+            }
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
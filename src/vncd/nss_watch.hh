@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_NSS_WATCH_HH
+#define VNCD_NSS_WATCH_HH
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <unistdx/base/log_message>
+
+#include <vncd/server.hh>
+
+namespace vncd {
+
+    /**
+    Watches the files of user and group databases via inotify and
+    calls the function when they change. Files are watched via their
+    directories, because they are usually replaced by renaming a temporary file.
+    Bursts of events are coalesced into a single call.
+    */
+    class Nss_watch: public Fd_connection {
+
+    public:
+        /// The argument is true if user database has changed.
+        typedef std::function<void(bool)> function_type;
+
+    private:
+        struct Directory {
+            int descriptor;
+            std::string path;
+            std::vector<std::string> group_files;
+            std::vector<std::string> user_files;
+        };
+
+        class Flush_task: public Task {
+
+        private:
+            Nss_watch& _watch;
+
+        public:
+
+            inline explicit
+            Flush_task(Nss_watch& watch, duration delay): _watch(watch) {
+                this->at(clock_type::now() + delay);
+            }
+
+            void run() override {
+                Task::run();
+                this->_watch.flush();
+            }
+
+        };
+
+    private:
+        function_type _function;
+        std::vector<Directory> _directories;
+        duration _delay = std::chrono::milliseconds(500);
+        bool _group_changed = false;
+        bool _users_changed = false;
+        bool _pending = false;
+
+    public:
+
+        inline explicit
+        Nss_watch(function_type function):
+        Fd_connection(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+        _function(std::move(function)) {
+            UNISTDX_CHECK(this->fd());
+            const uint32_t replaced = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+            this->watch("/etc", replaced, {"group"}, {"passwd"});
+            // SSSD memory cache files are recreated on invalidation;
+            // the database in /var/lib/sss/db is not watched, because
+            // it is written on every lookup including our own.
+            this->watch("/var/lib/sss/mc", IN_MOVED_TO | IN_CREATE | IN_DELETE,
+                        {"group", "initgroups"}, {"passwd"});
+        }
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            if (!started() || !event.in()) {
+                return;
+            }
+            alignas(::inotify_event) char buf[4096];
+            ssize_t n;
+            while ((n = ::read(this->fd(), buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + n; ) {
+                    const auto* ev = reinterpret_cast<const ::inotify_event*>(p);
+                    if (ev->len != 0) {
+                        this->changed(ev->wd, ev->name);
+                    }
+                    p += sizeof(::inotify_event) + ev->len;
+                }
+            }
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                UNISTDX_CHECK(n);
+            }
+            if ((this->_group_changed || this->_users_changed) && !this->_pending) {
+                this->_pending = true;
+                this->parent().submit(new Flush_task(*this, this->_delay));
+            }
+        }
+
+    private:
+
+        void
+        watch(const char* path, uint32_t events,
+              std::vector<std::string> group_files,
+              std::vector<std::string> user_files) {
+            int wd = ::inotify_add_watch(this->fd(), path, events | IN_ONLYDIR);
+            if (wd == -1) {
+                sys::log_message("nss", "not watching _: _", path, std::strerror(errno));
+                return;
+            }
+            this->_directories.emplace_back(Directory{
+                wd, path, std::move(group_files), std::move(user_files)
+            });
+        }
+
+        void
+        changed(int wd, const char* name) {
+            for (const auto& dir : this->_directories) {
+                if (dir.descriptor != wd) {
+                    continue;
+                }
+                for (const auto& file : dir.group_files) {
+                    if (file == name) {
+                        this->_group_changed = true;
+                    }
+                }
+                for (const auto& file : dir.user_files) {
+                    if (file == name) {
+                        this->_users_changed = true;
+                    }
+                }
+            }
+        }
+
+        void
+        flush() {
+            bool users_changed = this->_users_changed;
+            this->_group_changed = false;
+            this->_users_changed = false;
+            this->_pending = false;
+            this->_function(users_changed);
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_RFB_HH
+#define VNCD_RFB_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include <unistdx/net/socket>
+
+namespace vncd {
+
+    /// RFB security types that carry user name.
+    enum class Rfb_security: uint8_t {
+        VeNCrypt = 19,
+        Unix_login = 129,
+    };
+
+    /// VeNCrypt Plain subtype.
+    constexpr const uint32_t rfb_vencrypt_plain = 256;
+
+    /// User name and password received from VNC client.
+    struct Rfb_credentials {
+        std::string version;
+        std::string user;
+        std::string password;
+        Rfb_security security = Rfb_security::Unix_login;
+
+        inline bool
+        empty() const {
+            return this->user.empty();
+        }
+
+        /// Overwrite the password in memory.
+        inline void
+        clear() {
+            std::fill(this->password.begin(), this->password.end(), '\0');
+            this->password.clear();
+            this->user.clear();
+        }
+    };
+
+    inline uint32_t
+    rfb_u32(const char* s) {
+        auto* p = reinterpret_cast<const unsigned char*>(s);
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+            (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+
+    inline void
+    rfb_append_u32(std::string& s, uint32_t x) {
+        s += char((x >> 24) & 0xff);
+        s += char((x >> 16) & 0xff);
+        s += char((x >> 8) & 0xff);
+        s += char(x & 0xff);
+    }
+
+    /// SecurityResult message that reports authentication failure.
+    inline std::string
+    rfb_security_failure(const std::string& version, const std::string& reason) {
+        std::string message;
+        rfb_append_u32(message, 1);
+        if (version == "RFB 003.008\n") {
+            rfb_append_u32(message, uint32_t(reason.size()));
+            message += reason;
+        }
+        return message;
+    }
+
+    /**
+    Non-blocking RFB handshake. Each message is read exactly
+    (no more bytes than needed are read from the socket), so that
+    after the handshake the rest of the stream can be relayed as is.
+    */
+    class Rfb_handshake {
+
+    public:
+        enum class Status { Running, Finished, Failed };
+
+    private:
+        std::string _input;
+        std::string _output;
+        size_t _need = 0;
+        Status _status = Status::Running;
+        const char* _reason = "";
+
+    protected:
+        Rfb_credentials _credentials;
+
+    public:
+
+        virtual ~Rfb_handshake() = default;
+
+        /// Read and write as much as possible without blocking.
+        void
+        process(sys::socket& socket) {
+            this->flush(socket);
+            while (this->_status == Status::Running) {
+                if (this->_input.size() < this->_need) {
+                    char buf[512];
+                    auto m = std::min(sizeof(buf), this->_need - this->_input.size());
+                    auto n = socket.read(buf, m);
+                    if (n == 0) {
+                        this->fail("connection closed");
+                    }
+                    if (n <= 0) {
+                        break;
+                    }
+                    this->_input.append(buf, size_t(n));
+                }
+                if (this->_input.size() == this->_need) {
+                    std::string message;
+                    message.swap(this->_input);
+                    this->receive(message);
+                    this->flush(socket);
+                }
+            }
+            this->flush(socket);
+        }
+
+        /// The handshake is complete and all messages are sent.
+        inline bool
+        finished() const {
+            return this->_status == Status::Finished && this->_output.empty();
+        }
+
+        inline bool
+        failed() const {
+            return this->_status == Status::Failed;
+        }
+
+        inline bool
+        running() const {
+            return !this->finished() && !this->failed();
+        }
+
+        /// There are messages that were not sent yet.
+        inline bool
+        writing() const {
+            return !this->_output.empty();
+        }
+
+        inline const char*
+        reason() const {
+            return this->_reason;
+        }
+
+        inline const Rfb_credentials&
+        credentials() const {
+            return this->_credentials;
+        }
+
+        inline Rfb_credentials&
+        credentials() {
+            return this->_credentials;
+        }
+
+    protected:
+
+        virtual void receive(const std::string& message) = 0;
+
+        inline void
+        expect(size_t n) {
+            this->_need = n;
+        }
+
+        inline void
+        send(const std::string& message) {
+            this->_output += message;
+        }
+
+        inline void
+        finish() {
+            this->_status = Status::Finished;
+            this->_need = 0;
+        }
+
+        inline void
+        fail(const char* reason) {
+            this->_status = Status::Failed;
+            this->_reason = reason;
+            this->_need = 0;
+        }
+
+        inline bool
+        valid_version(const std::string& version) const {
+            return version == "RFB 003.008\n" || version == "RFB 003.007\n";
+        }
+
+    private:
+
+        void
+        flush(sys::socket& socket) {
+            while (!this->_output.empty()) {
+                auto n = socket.write(this->_output.data(), this->_output.size());
+                if (n <= 0) {
+                    break;
+                }
+                this->_output.erase(0, size_t(n));
+            }
+        }
+
+    };
+
+    /**
+    Server side of the handshake with VNC client: protocol version and
+    security type negotiation up to the point where the client sends its
+    user name and password.
+    */
+    class Rfb_server_handshake: public Rfb_handshake {
+
+    private:
+        enum class State {
+            Version,
+            Security_type,
+            VeNCrypt_version,
+            VeNCrypt_subtype,
+            Lengths,
+            Credentials,
+        };
+
+    private:
+        State _state = State::Version;
+        uint32_t _user_length = 0;
+        uint32_t _password_length = 0;
+
+    public:
+
+        inline
+        Rfb_server_handshake() {
+            this->send("RFB 003.008\n");
+            this->expect(12);
+        }
+
+    protected:
+
+        void
+        receive(const std::string& message) override {
+            switch (this->_state) {
+                case State::Version:
+                    if (!this->valid_version(message)) {
+                        this->fail("unsupported protocol version");
+                        break;
+                    }
+                    this->_credentials.version = message;
+                    this->send(std::string{
+                        char(2),
+                        char(Rfb_security::VeNCrypt),
+                        char(Rfb_security::Unix_login)
+                    });
+                    this->_state = State::Security_type;
+                    this->expect(1);
+                    break;
+                case State::Security_type:
+                    this->_credentials.security = Rfb_security(uint8_t(message[0]));
+                    if (this->_credentials.security == Rfb_security::VeNCrypt) {
+                        this->send(std::string{char(0), char(2)});
+                        this->_state = State::VeNCrypt_version;
+                        this->expect(2);
+                    } else if (this->_credentials.security == Rfb_security::Unix_login) {
+                        this->_state = State::Lengths;
+                        this->expect(8);
+                    } else {
+                        this->fail("unsupported security type");
+                    }
+                    break;
+                case State::VeNCrypt_version: {
+                    if (message[0] != 0 || message[1] != 2) {
+                        this->send(std::string{char(1)});
+                        this->fail("unsupported VeNCrypt version");
+                        break;
+                    }
+                    std::string reply{char(0), char(1)};
+                    rfb_append_u32(reply, rfb_vencrypt_plain);
+                    this->send(reply);
+                    this->_state = State::VeNCrypt_subtype;
+                    this->expect(4);
+                    break;
+                }
+                case State::VeNCrypt_subtype:
+                    if (rfb_u32(message.data()) != rfb_vencrypt_plain) {
+                        this->fail("unsupported VeNCrypt subtype");
+                        break;
+                    }
+                    this->_state = State::Lengths;
+                    this->expect(8);
+                    break;
+                case State::Lengths:
+                    this->_user_length = rfb_u32(message.data());
+                    this->_password_length = rfb_u32(message.data() + 4);
+                    if (this->_user_length == 0 || this->_user_length > 256 ||
+                        this->_password_length > 4096) {
+                        this->fail("bad credentials length");
+                        break;
+                    }
+                    this->_state = State::Credentials;
+                    this->expect(this->_user_length + this->_password_length);
+                    break;
+                case State::Credentials:
+                    this->_credentials.user = message.substr(0, this->_user_length);
+                    this->_credentials.password = message.substr(this->_user_length);
+                    this->finish();
+                    break;
+            }
+        }
+
+    };
+
+    /**
+    Client side of the handshake with the local VNC server: replays the
+    protocol version, security type and credentials received from
+    the remote client. After that the server's security result is relayed to
+    the remote client as is.
+    */
+    class Rfb_client_handshake: public Rfb_handshake {
+
+    private:
+        enum class State {
+            Version,
+            Number_of_security_types,
+            Security_types,
+            VeNCrypt_version,
+            VeNCrypt_ack,
+            Number_of_subtypes,
+            Subtypes,
+        };
+
+    private:
+        State _state = State::Version;
+
+    public:
+
+        inline explicit
+        Rfb_client_handshake(const Rfb_credentials& credentials) {
+            this->_credentials = credentials;
+            this->expect(12);
+        }
+
+        ~Rfb_client_handshake() {
+            this->_credentials.clear();
+        }
+
+    protected:
+
+        void
+        receive(const std::string& message) override {
+            switch (this->_state) {
+                case State::Version:
+                    if (!this->valid_version(message)) {
+                        this->fail("unsupported protocol version");
+                        break;
+                    }
+                    this->send(this->_credentials.version);
+                    this->_state = State::Number_of_security_types;
+                    this->expect(1);
+                    break;
+                case State::Number_of_security_types:
+                    if (message[0] == 0) {
+                        this->fail("VNC server refused the connection");
+                        break;
+                    }
+                    this->_state = State::Security_types;
+                    this->expect(uint8_t(message[0]));
+                    break;
+                case State::Security_types:
+                    if (message.find(char(this->_credentials.security)) ==
+                        std::string::npos) {
+                        this->fail("VNC server does not support client's security type");
+                        break;
+                    }
+                    this->send(std::string{char(this->_credentials.security)});
+                    if (this->_credentials.security == Rfb_security::VeNCrypt) {
+                        this->_state = State::VeNCrypt_version;
+                        this->expect(2);
+                    } else {
+                        this->send_credentials();
+                    }
+                    break;
+                case State::VeNCrypt_version:
+                    this->send(std::string{char(0), char(2)});
+                    this->_state = State::VeNCrypt_ack;
+                    this->expect(1);
+                    break;
+                case State::VeNCrypt_ack:
+                    if (message[0] != 0) {
+                        this->fail("VNC server does not support VeNCrypt 0.2");
+                        break;
+                    }
+                    this->_state = State::Number_of_subtypes;
+                    this->expect(1);
+                    break;
+                case State::Number_of_subtypes:
+                    this->_state = State::Subtypes;
+                    this->expect(4*size_t(uint8_t(message[0])));
+                    if (message[0] == 0) {
+                        this->fail("VNC server offered no VeNCrypt subtypes");
+                    }
+                    break;
+                case State::Subtypes: {
+                    bool found = false;
+                    for (size_t i=0; i<message.size(); i+=4) {
+                        if (rfb_u32(message.data()+i) == rfb_vencrypt_plain) {
+                            found = true;
+                        }
+                    }
+                    if (!found) {
+                        this->fail("VNC server does not support VeNCrypt Plain");
+                        break;
+                    }
+                    std::string reply;
+                    rfb_append_u32(reply, rfb_vencrypt_plain);
+                    this->send(reply);
+                    this->send_credentials();
+                    break;
+                }
+            }
+        }
+
+    private:
+
+        void
+        send_credentials() {
+            const auto& c = this->_credentials;
+            std::string message;
+            rfb_append_u32(message, uint32_t(c.user.size()));
+            rfb_append_u32(message, uint32_t(c.password.size()));
+            message += c.user;
+            message += c.password;
+            this->send(message);
+            std::fill(message.begin(), message.end(), '\0');
+            this->finish();
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
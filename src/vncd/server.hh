@@ -3,26 +3,51 @@
 #ifndef VNCD_SERVER_HH
 #define VNCD_SERVER_HH
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
-#include <queue>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <unistdx/base/log_message>
 #include <unistdx/base/simple_lock>
 #include <unistdx/base/spin_mutex>
+#include <unistdx/io/fildes>
 #include <unistdx/io/poller>
-#include <unistdx/ipc/execute>
-#include <unistdx/ipc/identity>
-#include <unistdx/ipc/process_group>
 #include <unistdx/net/socket>
 #include <unistdx/net/socket_address>
 
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <vncd/metrics.hh>
+#include <vncd/rfb.hh>
+#include <vncd/slab.hh>
+#include <vncd/socket_profile.hh>
+#include <vncd/sockmap.hh>
+#include <vncd/spawner.hh>
 #include <vncd/task.hh>
+#include <vncd/timer_wheel.hh>
+#include <vncd/tls.hh>
+#include <vncd/uring.hh>
 #include <vncd/user.hh>
 
 namespace vncd {
@@ -32,6 +57,12 @@ namespace vncd {
     class Local_server;
     class Remote_client;
     class Server;
+    class Session;
+    class Warm_pool;
+    struct Warm_candidate;
+    struct Warm_pool_options;
+
+    typedef std::shared_ptr<Session> session_pointer;
 
     struct No_lock {
         No_lock() {}
@@ -40,19 +71,92 @@ namespace vncd {
         void unlock() {}
     };
 
-    template <class T>
-    inline void
-    environment(const char* key, const T& value) {
-        std::stringstream str;
-        str << value;
-        UNISTDX_CHECK(::setenv(key, str.str().data(), 1));
+    /// Edge-triggered events for relayed sockets.
+    inline sys::event
+    relay_events(bool in, bool out) {
+        return static_cast<sys::event>(
+            EPOLLRDHUP | EPOLLET | (in ? int(EPOLLIN) : 0) | (out ? int(EPOLLOUT) : 0)
+        );
     }
 
-    inline void
-    environment(const char* key, const std::string& value) {
-        std::stringstream str;
-        str << value;
-        UNISTDX_CHECK(::setenv(key, value.data(), 1));
+    /// Parameters that are common to all sessions.
+    struct Session_options {
+        /// Stop reading from the source socket when the pipe has this many bytes
+        /// (zero means pipe capacity).
+        size_t high_water = 0;
+        /// Resume reading from the source socket when the pipe has this many bytes
+        /// (zero means a quarter of the high water mark).
+        size_t low_water = 0;
+        /// How long to wait for the local VNC server to start listening.
+        Task::duration start_timeout = std::chrono::seconds(30);
+        /// How long VNC server and X session are kept running after
+        /// the client disconnects (zero means terminate immediately).
+        Task::duration grace_period = Task::duration::zero();
+        /// How long to wait for the processes to exit after SIGTERM before sending SIGKILL.
+        Task::duration kill_timeout = std::chrono::seconds(10);
+        /// Connect to local VNC servers via Unix sockets in per-user subdirectories
+        /// of this directory instead of TCP ports (empty means TCP).
+        std::string socket_directory;
+        /// Pass the client's socket to the VNC server instead of relaying the data.
+        bool handoff = false;
+        /// Relay the data in the kernel via BPF sockmap when it is available.
+        bool kernel_relay = false;
+        /// Socket options of the connections from the clients.
+        Socket_profile remote_profile;
+        /// Socket options of the connections to the VNC servers.
+        Socket_profile local_profile;
+        /// How many bytes each session may relay per round (deficit round robin).
+        size_t quantum = 65536;
+        /// Bandwidth cap for each user in bytes per second (zero means no cap).
+        size_t bandwidth = 0;
+        /// Bandwidth caps of particular users that override the default one.
+        std::unordered_map<std::string,size_t> user_bandwidth;
+#if defined(VNCD_TLS)
+        /// Terminate TLS on the client's connection (no TLS if null).
+        std::shared_ptr<Tls_context> tls;
+#endif
+        bool verbose = false;
+    };
+
+    /// Per-user directory with the VNC server's Unix socket.
+    inline std::string
+    vnc_socket_directory(const std::string& directory, sys::uid_type uid) {
+        return directory + '/' + std::to_string(uid);
+    }
+
+    /// The path of the VNC server's Unix socket.
+    inline std::string
+    vnc_socket_path(const std::string& directory, sys::uid_type uid) {
+        return vnc_socket_directory(directory, uid) + "/vnc.sock";
+    }
+
+    /// The socket of X display number \p uid (the display of the user's VNC server).
+    inline std::string
+    x_display_socket(sys::uid_type uid) {
+        return "/tmp/.X11-unix/X" + std::to_string(uid);
+    }
+
+    /**
+    Returns true if X server accepts connections on the display socket.
+    The socket that was left by the crashed server refuses connections.
+    */
+    inline bool
+    x_display_ready(sys::uid_type uid) {
+        auto path = x_display_socket(uid);
+        ::sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        std::memcpy(address.sun_path, path.data(), path.size());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            return false;
+        }
+        sys::fildes socket(fd);
+        // the backlog is full, but the server is listening
+        return ::connect(fd, reinterpret_cast<const ::sockaddr*>(&address),
+                         sizeof(address)) == 0 || errno == EAGAIN;
     }
 
     class Connection {
@@ -71,9 +175,16 @@ namespace vncd {
             Stopped,
         };
 
+    public:
+        /// The connection does not belong to any user.
+        static constexpr const sys::uid_type no_owner = sys::uid_type(-1);
+
     private:
         Server* _parent = nullptr;
         State _state = State::Initial;
+        sys::uid_type _owner = no_owner;
+        /// Local port cached on the first call to port().
+        mutable sys::port_type _port = 0;
 
     protected:
         sys::socket _socket;
@@ -88,6 +199,17 @@ namespace vncd {
 
         virtual ~Connection() {}
 
+        /// Connections are allocated from the slab arena.
+        static inline void*
+        operator new(size_t n) {
+            return Slab_arena::instance().allocate(n);
+        }
+
+        static inline void
+        operator delete(void* ptr, size_t n) {
+            Slab_arena::instance().deallocate(ptr, n);
+        }
+
         virtual void
         process(const sys::epoll_event& event) {
             if (initial()) { throw std::logic_error("bad state"); }
@@ -96,11 +218,17 @@ namespace vncd {
             if (stopping()) { this->state(State::Stopped); }
         }
 
-        inline void
+        virtual void
         set_user_timeout(const duration& d) {
             this->_socket.set_user_timeout(d);
         }
 
+#if defined(VNCD_IO_URING)
+        /// Submit the first io_uring requests when the connection is added to the server.
+        virtual void
+        submit(Uring&) {}
+#endif
+
         inline void
         parent(Server* rhs) {
             this->_parent = rhs;
@@ -116,7 +244,7 @@ namespace vncd {
             return *this->_parent;
         }
 
-        inline sys::fd_type
+        virtual sys::fd_type
         fd() const noexcept {
             return this->_socket.fd();
         }
@@ -172,9 +300,53 @@ namespace vncd {
             this->_state = State::Stopping;
         }
 
-        inline sys::port_type
+        virtual sys::port_type
         port() const {
-            return sys::socket_address_cast<sys::ipv4_socket_address>(this->_socket.bind_addr()).port();
+            if (this->_port == 0) {
+                this->_port = sys::socket_address_cast<sys::ipv4_socket_address>(
+                    this->_socket.bind_addr()).port();
+            }
+            return this->_port;
+        }
+
+        /// The user this connection belongs to.
+        inline sys::uid_type
+        owner() const {
+            return this->_owner;
+        }
+
+        inline void
+        owner(sys::uid_type uid) {
+            this->_owner = uid;
+        }
+
+    };
+
+    /**
+    Polled file descriptor that is not a socket (e.g. eventfd, inotify or pidfd).
+    It has neither port nor TCP user timeout.
+    */
+    class Fd_connection: public Connection {
+
+    private:
+        sys::fildes _file;
+
+    public:
+
+        inline explicit
+        Fd_connection(sys::fd_type fd): _file(fd) {}
+
+        sys::fd_type
+        fd() const noexcept override {
+            return this->_file.fd();
+        }
+
+        void
+        set_user_timeout(const duration&) override {}
+
+        sys::port_type
+        port() const override {
+            return 0;
         }
 
     };
@@ -183,6 +355,17 @@ namespace vncd {
 
     private:
         typedef std::unique_ptr<Connection> connection_pointer;
+
+        /**
+        Connection indexed by its file descriptor. The generation is incremented
+        each time the slot is reused, and is stored in epoll data together
+        with the file descriptor to ignore events of the closed connections.
+        */
+        struct Slot {
+            connection_pointer connection;
+            uint32_t generation = 0;
+        };
+
         typedef sys::spin_mutex mutex_type;
         typedef No_lock lock_type;
         typedef std::unique_ptr<Task> task_pointer;
@@ -192,13 +375,61 @@ namespace vncd {
 
     private:
         sys::event_poller _poller;
-        std::unordered_map<sys::fd_type,connection_pointer> _connections;
-        std::priority_queue<task_pointer> _tasks;
+        std::vector<Slot> _slots;
+        /// Connections by their owner.
+        std::unordered_multimap<sys::uid_type,sys::fd_type> _owners;
+        Timer_wheel _timers;
+        Timer_fd _timer_fd;
+        /// Scheduled tasks by their owner.
+        std::unordered_multimap<const void*,Task*> _owned_tasks;
+        /// Expired tasks that are being run (cancelled ones are set to null).
+        std::vector<Task*> _expired;
+        Server_metrics _metrics;
+        /// Sessions by user id.
+        std::unordered_map<sys::uid_type,session_pointer> _sessions;
+        /// Tasks submitted from any thread that are not yet in the queue.
+        std::vector<task_pointer> _new_tasks;
+        /// Pre-started sessions of this shard (owned by the task queue).
+        Warm_pool* _warm_pool = nullptr;
+        /// Sessions that have data to relay in deficit round robin order.
+        std::deque<session_pointer> _relay_queue;
         duration _timeout = duration::zero();
         mutex_type _mutex;
+#if defined(VNCD_IO_URING)
+        Uring _uring;
+#endif
 
     public:
 
+        inline
+        Server() {
+            this->_poller.emplace(this->_timer_fd.fd(), sys::event::in);
+#if defined(VNCD_IO_URING)
+            this->_poller.emplace(this->_uring.fd(), sys::event::in);
+#endif
+            Metrics_registry::instance().add(&this->_metrics);
+        }
+
+        inline
+        ~Server() {
+            Metrics_registry::instance().remove(&this->_metrics);
+        }
+
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+
+        inline Server_metrics&
+        metrics() {
+            return this->_metrics;
+        }
+
+#if defined(VNCD_IO_URING)
+        inline Uring&
+        uring() {
+            return this->_uring;
+        }
+#endif
+
         inline void
         set_user_timeout(const duration& d) {
             this->_timeout = d;
@@ -213,27 +444,85 @@ namespace vncd {
             connection->set_user_timeout(this->_timeout);
             auto fd = connection->fd();
             lock_type lock(this->_mutex);
-            this->_connections.emplace(fd, connection_pointer(connection));
-            this->_poller.emplace(fd, events);
+            if (fd < 0) {
+                delete connection;
+                throw std::invalid_argument("bad fd");
+            }
+            if (size_t(fd) >= this->_slots.size()) {
+                this->_slots.resize(std::max(size_t(fd)+1, 2*this->_slots.size()));
+            }
+            auto& slot = this->_slots[fd];
+            if (slot.connection && slot.connection->fd() == fd) {
+                // the descriptor was closed behind the stale connection's back
+                // and now belongs to the new one: destroying the stale
+                // connection would close it, so the object is abandoned
+                this->log("fd _ is reused while its connection is in the table", fd);
+                this->forget_owner(fd);
+                slot.connection.release();
+            } else if (slot.connection) {
+                // the socket was moved out of the stale connection
+                this->erase(fd);
+            }
+            slot.connection.reset(connection);
+            ++slot.generation;
+            if (connection->owner() != Connection::no_owner) {
+                this->_owners.emplace(connection->owner(), fd);
+            }
+            auto ev = this->make_event(fd, events);
+            UNISTDX_CHECK(::epoll_ctl(this->_poller.fd(), EPOLL_CTL_ADD, fd, &ev));
             connection->start();
+#if defined(VNCD_IO_URING)
+            connection->submit(this->_uring);
+#endif
         }
 
-        inline void
-        remove(sys::port_type port) {
-            lock_type lock(this->_mutex);
-            auto first = this->_connections.begin();
-            auto last = this->_connections.end();
-            while (first != last) {
-                auto& connection = *first->second;
-                if (connection.port() == port) {
-                    first = this->_connections.erase(first);
-                    last = this->_connections.end();
-                } else {
-                    ++first;
-                }
+        /// The generation of the file descriptor's slot (see find()).
+        inline uint32_t
+        generation(sys::fd_type fd) const {
+            return size_t(fd) < this->_slots.size() ? this->_slots[fd].generation : 0;
+        }
+
+        /// The connection if the slot was not reused since the generation was obtained.
+        inline Connection*
+        find(sys::fd_type fd, uint32_t generation) {
+            if (fd < 0 || size_t(fd) >= this->_slots.size()) {
+                return nullptr;
             }
+            auto& slot = this->_slots[fd];
+            return slot.generation == generation ? slot.connection.get() : nullptr;
+        }
+
+        /// Stop polling the file descriptor without closing it.
+        inline void
+        unwatch(sys::fd_type fd) {
+            UNISTDX_CHECK(::epoll_ctl(this->_poller.fd(), EPOLL_CTL_DEL, fd, nullptr));
+        }
+
+        inline session_pointer&
+        session(sys::uid_type uid) {
+            return this->_sessions[uid];
+        }
+
+        inline Warm_pool*
+        warm_pool() {
+            return this->_warm_pool;
+        }
+
+        inline void
+        warm_pool(Warm_pool* rhs) {
+            this->_warm_pool = rhs;
+        }
+
+        /// Change the events the poller reports for the file descriptor.
+        inline void
+        modify(sys::fd_type fd, sys::event events) {
+            auto ev = this->make_event(fd, events);
+            UNISTDX_CHECK(::epoll_ctl(this->_poller.fd(), EPOLL_CTL_MOD, fd, &ev));
         }
 
+        /// Terminate the user's session and remove all connections of the user.
+        void remove(sys::uid_type uid);
+
         template <class T>
         inline void
         submit(std::unique_ptr<T>&& task) {
@@ -241,27 +530,63 @@ namespace vncd {
             this->submit(task.release());
         }
 
+        /// Thread-safe: the task is queued and the event loop is woken up.
         inline void
         submit(Task* task) {
             if (!task) {
                 throw std::invalid_argument("bad task");
             }
             task->parent(this);
-            lock_type lock(this->_mutex);
-            this->_tasks.emplace(task);
+            sys::simple_lock<mutex_type> lock(this->_mutex);
+            this->_new_tasks.emplace_back(task);
             this->_poller.notify_one();
         }
 
+        /// Relay the session's data in the next round (must be called from the server's thread).
+        inline void
+        schedule_relay(session_pointer session) {
+            this->_relay_queue.emplace_back(std::move(session));
+        }
+
+        /**
+        Delete all scheduled tasks of the owner including the submitted ones and
+        the expired ones that have not been run yet (must be called from the
+        server's thread).
+        */
+        inline void
+        cancel(const void* owner) {
+            auto range = this->_owned_tasks.equal_range(owner);
+            for (auto first = range.first; first != range.second; ++first) {
+                auto* task = first->second;
+                this->_timers.erase(task);
+                std::replace(this->_expired.begin(), this->_expired.end(), task,
+                             static_cast<Task*>(nullptr));
+                delete task;
+            }
+            this->_owned_tasks.erase(range.first, range.second);
+            sys::simple_lock<mutex_type> lock(this->_mutex);
+            auto& tasks = this->_new_tasks;
+            tasks.erase(
+                std::remove_if(tasks.begin(), tasks.end(),
+                    [owner] (const task_pointer& t) { return t->owner() == owner; }),
+                tasks.end()
+            );
+        }
+
         void
         run() {
             lock_type lock(this->_mutex);
             while (true) {
-                duration timeout = std::chrono::milliseconds(-1); // no timeout
-                if (!this->_tasks.empty()) {
-                    auto dt = this->_tasks.top()->at() - clock_type::now();
-                    timeout = std::max(dt, duration::zero());
-                    using namespace std::chrono;
-                    auto s = duration_cast<seconds>(dt);
+                // do not wait for the events while the sessions have data to relay
+                const duration timeout = this->_relay_queue.empty()
+                    ? duration(std::chrono::milliseconds(-1))
+                    : duration::zero();
+                this->accept_tasks();
+                time_point t;
+                if (this->_timers.next_expiry(t)) {
+                    this->_timer_fd.arm(t);
+                } else {
+                    this->_timer_fd.disarm();
                 }
                 std::cv_status status;
                 bool success = false;
@@ -275,16 +600,42 @@ namespace vncd {
                         }
                     }
                 }
-                if (status == std::cv_status::timeout) {
-                    this->process_tasks();
-                } else {
+                auto t0 = clock_type::now();
+                if (status != std::cv_status::timeout) {
                     this->process_events();
                 }
+                this->relay_sessions();
+                auto t1 = clock_type::now();
+                if (status != std::cv_status::timeout) {
+                    this->_metrics.iteration.record(t1-t0);
+                }
+                this->process_tasks();
+#if defined(VNCD_IO_URING)
+                this->_uring.submit();
+#endif
+                auto t2 = clock_type::now();
+                using std::chrono::nanoseconds;
+                using std::chrono::duration_cast;
+                this->_metrics.events_time.add(duration_cast<nanoseconds>(t1-t0).count());
+                this->_metrics.tasks_time.add(duration_cast<nanoseconds>(t2-t1).count());
+                this->_metrics.iterations.add(1);
             }
         }
 
     private:
 
+        /// One round of deficit round robin over the sessions that have data to relay.
+        void relay_sessions();
+
+        void
+        accept_tasks() {
+            sys::simple_lock<mutex_type> lock(this->_mutex);
+            for (auto& task : this->_new_tasks) {
+                this->schedule(task.release());
+            }
+            this->_new_tasks.clear();
+        }
+
         void
         process_events() {
             auto pipe_fd = this->_poller.pipe_in();
@@ -292,19 +643,93 @@ namespace vncd {
                 if (event.fd() == pipe_fd) {
                     continue;
                 }
-                auto result = this->_connections.find(event.fd());
-                if (result == this->_connections.end()) {
-                    this->log("bad fd _", event.fd());
+                if (event.fd() == this->_timer_fd.fd()) {
+                    this->_timer_fd.clear();
+                    continue;
+                }
+#if defined(VNCD_IO_URING)
+                if (event.fd() == this->_uring.fd()) {
+                    try {
+                        this->_uring.process();
+                    } catch (const std::exception& err) {
+                        this->log("io_uring error: _", err.what());
+                    }
+                    continue;
+                }
+#endif
+                auto fd = sys::fd_type(event.data.u64 & 0xffffffffu);
+                auto generation = uint32_t(event.data.u64 >> 32);
+                if (size_t(fd) >= this->_slots.size()) {
+                    this->log("bad fd _", fd);
                     continue;
                 }
-                auto& connection = *result->second;
+                auto& slot = this->_slots[fd];
+                if (!slot.connection || slot.generation != generation) {
+                    // the connection was removed while the events were being processed
+                    continue;
+                }
+                auto& connection = *slot.connection;
                 try {
                     connection.process(event);
                 } catch (const std::exception& err) {
                     this->log("session error: _", err.what());
                 }
                 if (connection.stopped()) {
-                    this->_connections.erase(result);
+                    this->erase(fd);
+                }
+            }
+        }
+
+        void
+        erase(sys::fd_type fd) {
+            this->forget_owner(fd);
+            this->_slots[fd].connection.reset();
+        }
+
+        /// Remove the connection from the owners' index.
+        void
+        forget_owner(sys::fd_type fd) {
+            auto& slot = this->_slots[fd];
+            auto uid = slot.connection->owner();
+            if (uid != Connection::no_owner) {
+                auto range = this->_owners.equal_range(uid);
+                for (auto first = range.first; first != range.second; ++first) {
+                    if (first->second == fd) {
+                        this->_owners.erase(first);
+                        break;
+                    }
+                }
+            }
+        }
+
+        /// The low 32 bits of epoll data are the file descriptor (as in sys::epoll_event).
+        inline ::epoll_event
+        make_event(sys::fd_type fd, sys::event events) const {
+            ::epoll_event ev{};
+            ev.events = static_cast<uint32_t>(events);
+            ev.data.u64 = (uint64_t(this->_slots[fd].generation) << 32) | uint32_t(fd);
+            return ev;
+        }
+
+        void
+        schedule(Task* task) {
+            this->_timers.insert(task);
+            if (task->owner()) {
+                this->_owned_tasks.emplace(task->owner(), task);
+            }
+        }
+
+        /// The task that is about to run can no longer be cancelled.
+        void
+        forget(Task* task) {
+            if (!task->owner()) {
+                return;
+            }
+            auto range = this->_owned_tasks.equal_range(task->owner());
+            for (auto first = range.first; first != range.second; ++first) {
+                if (first->second == task) {
+                    this->_owned_tasks.erase(first);
+                    break;
                 }
             }
         }
@@ -312,10 +737,16 @@ namespace vncd {
         void
         process_tasks() {
             auto now = clock_type::now();
-            while (!this->_tasks.empty() && this->_tasks.top()->at() <= now) {
-                task_pointer& tmp = const_cast<task_pointer&>(this->_tasks.top());
-                task_pointer task = std::move(tmp);
-                this->_tasks.pop();
+            auto& expired = this->_expired;
+            this->_timers.advance(now, expired);
+            // the tasks may cancel the other expired tasks
+            for (size_t i=0; i<expired.size(); ++i) {
+                if (!expired[i]) {
+                    continue;
+                }
+                task_pointer task(expired[i]);
+                expired[i] = nullptr;
+                this->forget(task.get());
                 try {
                     task->run();
                 } catch (const std::exception& err) {
@@ -323,9 +754,10 @@ namespace vncd {
                 }
                 if (task->remaining_attempts() != 0 && task->has_period()) {
                     task->at(now + task->period());
-                    this->_tasks.emplace(std::move(task));
+                    this->schedule(task.release());
                 }
             }
+            expired.clear();
         }
 
         template <class ... Args>
@@ -336,22 +768,229 @@ namespace vncd {
 
     };
 
+    /// Adds connection to the server in the server's thread.
+    class Add_connection_task: public Task {
+
+    private:
+        std::unique_ptr<Connection> _connection;
+        sys::event _events;
+
+    public:
+
+        inline explicit
+        Add_connection_task(Connection* connection, sys::event events):
+        _connection(connection), _events(events) {}
+
+        void run() override {
+            Task::run();
+            this->parent().add(this->_connection.release(), this->_events);
+        }
+
+    };
+
+    /// Removes connections of the user from the server in the server's thread.
+    class Remove_connection_task: public Task {
+
+    private:
+        sys::uid_type _uid;
+
+    public:
+
+        inline explicit
+        Remove_connection_task(sys::uid_type uid): _uid(uid) {}
+
+        void run() override {
+            Task::run();
+            this->parent().remove(this->_uid);
+        }
+
+    };
+
+    /**
+    Multiple servers (shards) each running its own event loop in a separate thread.
+    All connections of a particular user are handled by the same shard.
+    */
+    class Server_pool {
+
+    private:
+        typedef std::unique_ptr<Server> server_pointer;
+        typedef Task::duration duration;
+
+    private:
+        std::vector<server_pointer> _servers;
+
+    public:
+
+        /// The shards are created by \link resize\endlink.
+        Server_pool() = default;
+
+        inline explicit
+        Server_pool(size_t nthreads) {
+            this->resize(nthreads);
+        }
+
+        inline void
+        resize(size_t nthreads) {
+            if (nthreads == 0) {
+                throw std::invalid_argument("bad no. of threads");
+            }
+            this->_servers.resize(nthreads);
+            for (auto& server : this->_servers) {
+                if (!server) {
+                    server.reset(new Server);
+                }
+            }
+        }
+
+        inline size_t
+        size() const {
+            return this->_servers.size();
+        }
+
+        inline Server&
+        front() {
+            return *this->_servers.front();
+        }
+
+        inline Server&
+        shard(sys::uid_type uid) {
+            return *this->_servers[uid % this->_servers.size()];
+        }
+
+        inline void
+        set_user_timeout(const duration& d) {
+            for (auto& server : this->_servers) {
+                server->set_user_timeout(d);
+            }
+        }
+
+        inline void
+        add(sys::uid_type uid, Connection* connection,
+            sys::event events=sys::event::in) {
+            this->shard(uid).submit(new Add_connection_task(connection, events));
+        }
+
+        inline void
+        remove(sys::uid_type uid) {
+            this->shard(uid).submit(new Remove_connection_task(uid));
+        }
+
+        /// Create warm pool in each shard.
+        void warm_pool(const Warm_pool_options& options);
+
+        /// Send the users that may have warm servers to their shards.
+        void warm_candidates(const std::vector<Warm_candidate>& candidates);
+
+        /// Runs the first shard in the current thread and the others in new threads.
+        void
+        run() {
+            std::vector<std::thread> threads;
+            const auto n = this->_servers.size();
+            for (size_t i=1; i<n; ++i) {
+                Server* server = this->_servers[i].get();
+                threads.emplace_back([server] () { server->run(); });
+            }
+            front().run();
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+
+    };
+
     /// VNC client state.
-    class Session {
+    class Session: public std::enable_shared_from_this<Session> {
+
+    private:
+
+        /**
+        Data flow from the source socket to the destination socket through the pipe.
+        Readiness of both sockets is tracked for edge-triggered polling.
+        */
+        struct Channel {
+            /// The source socket may have data to read.
+            bool readable = false;
+            /// The destination socket may have space to write.
+            bool writable = true;
+            /// The last read failed when the pipe was not empty, i.e. it might be full.
+            bool pipe_full = false;
+            /// The source socket is not polled until the pipe is drained below low water mark.
+            bool throttled = false;
+            /// The number of bytes in the pipe.
+            size_t pending = 0;
+            /// How many times the source socket was throttled.
+            uint64_t nthrottles = 0;
+        };
 
     private:
+        Server* _parent = nullptr;
         User _user;
         sys::socket _remote_socket;
         sys::socket _local_socket;
-        sys::process_group _processes;
+        std::vector<Child_process> _processes;
         sys::port_type _port;
         sys::port_type _vnc_port;
+        /// Base directory for VNC server's Unix socket (empty means TCP port).
+        std::string _socket_directory;
         sys::pipe _in;
         sys::pipe _out;
         size_t _buffer_size = 65536;
+        size_t _high_water = 65536;
+        size_t _low_water = 16384;
+        Task::duration _start_timeout = std::chrono::seconds(30);
+        Task::duration _grace_period = Task::duration::zero();
+        Task::duration _kill_timeout = std::chrono::seconds(10);
         sys::splice _splice;
+        /// From remote to local socket.
+        Channel _upstream;
+        /// From local to remote socket.
+        Channel _downstream;
+        /// File descriptors registered in the poller and their events.
+        sys::fd_type _remote_fd = -1;
+        sys::fd_type _local_fd = -1;
+        sys::event _remote_events = relay_events(true, false);
+        sys::event _local_events{};
+        Rfb_credentials _credentials;
+#if defined(VNCD_IO_URING)
+        Uring_relay _relay;
+#endif
+        /// Incremented each time the client disconnects,
+        /// connections of the previous generation are stopped.
+        uint64_t _generation = 0;
+        bool _vnc_started = false;
+        bool _x_session_started = false;
+        bool _detached = false;
         bool _terminated = false;
+        bool _handoff = false;
+        bool _kernel_relay = false;
+        Socket_profile _remote_profile;
+        Socket_profile _local_profile;
+#if defined(VNCD_TLS)
+        std::shared_ptr<Tls_context> _tls;
+#endif
+        /// The sockets of the current client were inserted into the sockmap
+        /// (or the attempt failed).
+        bool _offloaded = false;
+        /// The first bytes from the VNC server were relayed by VNCD.
+        bool _downstream_started = false;
+        /// The session is in the server's relay queue.
+        bool _scheduled = false;
+        /// How many bytes the session may relay in the current round.
+        size_t _deficit = 0;
+        size_t _quantum = 65536;
+        /// Bandwidth cap in bytes per second (zero means no cap).
+        size_t _rate = 0;
+        /// Token bucket of the bandwidth cap.
+        double _tokens = 0;
+        Task::time_point _refilled{};
+        /// The session waits for the tokens.
+        bool _rate_limited = false;
         bool _verbose = false;
+        Session_metrics _metrics;
+        /// When the current client's connection was accepted.
+        Task::time_point _accepted{};
+        /// Login phases that were recorded for the current client.
+        unsigned _phases = 0;
 
     public:
 
@@ -359,11 +998,52 @@ namespace vncd {
         Session(const User& user):
         _user(user) {
             this->_buffer_size = this->_in.in().pipe_buffer_size();
+            this->_metrics.user = user.name();
+            Metrics_registry::instance().add(&this->_metrics);
+        }
+
+        inline
+        ~Session() {
+            Metrics_registry::instance().remove(&this->_metrics);
+        }
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        inline void
+        options(const Session_options& rhs) {
+            this->_verbose = rhs.verbose;
+            this->_start_timeout = rhs.start_timeout;
+            this->_grace_period = rhs.grace_period;
+            this->_kill_timeout = rhs.kill_timeout;
+            this->_socket_directory = rhs.socket_directory;
+            this->_handoff = rhs.handoff;
+            this->_kernel_relay = rhs.kernel_relay;
+            this->_remote_profile = rhs.remote_profile;
+            this->_local_profile = rhs.local_profile;
+            this->_quantum = std::max<size_t>(rhs.quantum, 1);
+            this->_rate = rhs.bandwidth;
+            auto result = rhs.user_bandwidth.find(this->_user.name());
+            if (result != rhs.user_bandwidth.end()) {
+                this->_rate = result->second;
+            }
+            this->_tokens = this->burst();
+#if defined(VNCD_TLS)
+            this->_tls = rhs.tls;
+#endif
+            this->_high_water = this->_buffer_size;
+            if (rhs.high_water != 0) {
+                this->_high_water = std::min(rhs.high_water, this->_buffer_size);
+            }
+            this->_low_water = this->_high_water / 4;
+            if (rhs.low_water != 0) {
+                this->_low_water = std::min(rhs.low_water, this->_high_water);
+            }
         }
 
         inline void
-        verbose(bool b) {
-            this->_verbose = b;
+        parent(Server* rhs) {
+            this->_parent = rhs;
         }
 
         inline void
@@ -386,194 +1066,371 @@ namespace vncd {
             return this->_vnc_port;
         }
 
+        /// The path of VNC server's Unix socket or empty string if TCP port is used.
+        inline std::string
+        vnc_socket() const {
+            if (this->_socket_directory.empty()) {
+                return std::string();
+            }
+            return vnc_socket_path(this->_socket_directory, this->_user.id());
+        }
+
+        inline Task::duration
+        start_timeout() const {
+            return this->_start_timeout;
+        }
+
+        inline bool
+        verbose() const {
+            return this->_verbose;
+        }
+
+        /// Set the options of the client's socket (the buffer sizes are inherited
+        /// from the listening socket).
         inline void
-        set_identity() {
-            if (sys::this_process::user() == this->_user.id() &&
-                sys::this_process::group() == this->_user.group_id()) {
-                return;
+        tune_remote_socket(sys::fd_type fd) {
+            this->tune_socket(fd, this->_remote_profile, "remote", false);
+        }
+
+        /// Set the options of VNC server's socket (before it is connected).
+        inline void
+        tune_local_socket(sys::fd_type fd) {
+            this->tune_socket(fd, this->_local_profile, "local", true);
+        }
+
+#if defined(VNCD_TLS)
+        /// TLS context for the client's connection or null.
+        inline const Tls_context*
+        tls() const {
+            return this->_tls.get();
+        }
+#endif
+
+        /// The client's socket is passed to the VNC server.
+        inline bool
+        handoff() const {
+            return this->_handoff;
+        }
+
+        /// Credentials that are replayed to the local VNC server.
+        inline void
+        credentials(const Rfb_credentials& rhs) {
+            this->_credentials = rhs;
+        }
+
+        inline Rfb_credentials&
+        credentials() {
+            return this->_credentials;
+        }
+
+        /// Request to execute the script as the user of this session.
+        Spawn_request
+        spawn_request(const char* variable) const {
+            const char* script = std::getenv(variable);
+            if (!script) {
+                throw std::invalid_argument(std::string(variable) + " variable is not set");
             }
-            sys::this_process::workdir("/");
-            UNISTDX_CHECK(::initgroups(
-                this->_user.name().data(),
-                this->_user.group_id()
-            ));
-            sys::this_process::set_identity(
-                this->_user.id(),
-                this->_user.group_id()
-            );
-            sys::this_process::workdir(this->_user.home().data());
-            environment("HOME", this->_user.home());
-            environment("SHELL", this->_user.shell());
-            environment("USER", this->_user.name());
+            Spawn_request request;
+            request.uid = this->_user.id();
+            request.gid = this->_user.group_id();
+            request.user = this->_user.name();
+            request.workdir = this->_user.home();
+            request.script = script;
+            request.inherit_environment();
+            request.set("HOME", this->_user.home());
+            request.set("SHELL", this->_user.shell());
+            request.set("USER", this->_user.name());
+            return request;
         }
 
         inline void
         set_remote_socket(const sys::socket& s) {
+            this->_remote_fd = s.fd();
             this->_remote_socket = s;
+            this->state(Session_metrics::State::Active);
+            this->_accepted = Task::clock_type::now();
+            this->_phases = 0;
         }
 
         inline void
         set_local_socket(const sys::socket& s) {
+            this->_local_fd = s.fd();
             this->_local_socket = s;
         }
 
+        /**
+        Start VNC server unless it was pre-started.
+        The client's socket (if any) is inherited by the server.
+        */
         void
-        vnc_start() {
+        vnc_start(sys::fd_type client=-1) {
+            if (this->_vnc_started) {
+                return;
+            }
+            this->_vnc_started = true;
             try {
-                this->_processes.emplace([this] () {this->vnc_main();});
+                auto request = this->spawn_request("VNCD_SERVER");
+                request.set("VNCD_UID", this->_user.id());
+                request.set("VNCD_GID", this->_user.group_id());
+                if (this->_socket_directory.empty()) {
+                    request.set("VNCD_PORT", vnc_port());
+                } else {
+                    this->prepare_socket_directory();
+                    request.set("VNCD_SOCKET", this->vnc_socket());
+                }
+                if (client != -1) {
+                    request.set("VNCD_FD", int(Spawner::client_fd));
+                }
+                this->log("executing _", request.script);
+                this->_processes.emplace_back(Spawner::instance().spawn(request, client));
+                this->spawned(true);
+                this->record(Phase::Spawn);
             } catch (const std::exception& err) {
+                this->spawned(false);
                 this->log("failed to start VNC server: _", err.what());
             }
         }
 
+        /**
+        Create the directory for the VNC server's socket that only the user
+        can write to (so that other users can not listen on the same path)
+        and remove the socket of the previous server.
+        */
         void
-        vnc_main() {
-            this->set_identity();
-            const char* script = std::getenv("VNCD_SERVER");
-            if (!script) {
-                throw std::invalid_argument("VNCD_SERVER variable is not set");
+        prepare_socket_directory() {
+            auto dir = vnc_socket_directory(this->_socket_directory, this->_user.id());
+            if (::mkdir(dir.data(), 0700) == -1 && errno != EEXIST) {
+                throw sys::bad_call();
+            }
+            int fd = ::open(dir.data(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            UNISTDX_CHECK(fd);
+            sys::fildes directory(fd);
+            UNISTDX_CHECK(::fchown(directory.fd(), this->_user.id(), this->_user.group_id()));
+            UNISTDX_CHECK(::fchmod(directory.fd(), 0700));
+            if (::unlinkat(directory.fd(), "vnc.sock", 0) == -1 && errno != ENOENT) {
+                throw sys::bad_call();
             }
-            sys::argstream args;
-            args.append(script);
-            this->log("executing _", args);
-            environment("VNCD_UID", this->_user.id());
-            environment("VNCD_GID", this->_user.group_id());
-            environment("VNCD_PORT", vnc_port());
-            sys::this_process::execute(args);
         }
 
+        /// Start X session unless it is already running.
         void
         x_session_start() {
+            if (this->_x_session_started) {
+                return;
+            }
+            this->_x_session_started = true;
             try {
-                this->_processes.emplace([this] () {this->x_session_main();});
+                auto request = this->spawn_request("VNCD_SESSION");
+                request.set("DISPLAY", ':' + std::to_string(this->_user.id()));
+                this->log("executing _", request.script);
+                this->_processes.emplace_back(Spawner::instance().spawn(request));
+                this->spawned(true);
+                this->record(Phase::X_session);
             } catch (const std::exception& err) {
+                this->spawned(false);
                 this->log("failed to start X session: _", err.what());
             }
         }
 
+        /// Called when the remote socket becomes readable and/or writable.
         void
-        x_session_main() {
-            this->set_identity();
-            const char* script = std::getenv("VNCD_SESSION");
-            if (!script) {
-                throw std::invalid_argument("VNCD_SESSION variable is not set");
-            }
-            sys::argstream args;
-            args.append(script);
-            this->log("executing _", args);
-            environment("DISPLAY", ':' + std::to_string(this->_user.id()));
-            sys::this_process::execute(args);
+        remote_ready(bool in, bool out) {
+            if (in) { this->_upstream.readable = true; }
+            if (out) { this->_downstream.writable = true; }
+            this->schedule();
         }
 
+        /// Called when the local socket becomes readable and/or writable.
         void
-        copy_from_remote_to_pipe() {
-            if (!this->_remote_socket) {
-                return;
-            }
-            ssize_t n = 0;
-            do {
-                n = this->_splice(
-                    this->_remote_socket,
-                    this->_in,
-                    this->_buffer_size
-                );
-            } while (n > 0);
-            if (this->_verbose) {
-                this->log("_ _", __func__, n);
-            }
+        local_ready(bool in, bool out) {
+            if (in) { this->_downstream.readable = true; }
+            if (out) { this->_upstream.writable = true; }
+            this->schedule();
         }
 
-        void
-        copy_from_pipe_to_local() {
-            if (!this->_local_socket) {
+        /// Put the session in the server's relay queue.
+        inline void
+        schedule() {
+            if (this->_scheduled) {
                 return;
             }
-            ssize_t n = 0;
-            do {
-                n = this->_splice(
-                    this->_in,
-                    this->_local_socket,
-                    this->_buffer_size
-                );
-            } while (n > 0);
-            if (this->_verbose) {
-                this->log("_ _", __func__, n);
+            if (!this->_parent) {
+                this->relay_remaining();
+                return;
             }
+            this->_scheduled = true;
+            this->_parent->schedule_relay(this->shared_from_this());
         }
 
-        void
-        copy_from_local_to_pipe() {
-            if (!this->_local_socket) {
-                return;
+        /**
+        Relay the data within the session's deficit and bandwidth cap.
+        Returns true if the session has more data to relay in the next round.
+        */
+        bool
+        relay_round() {
+            this->_scheduled = false;
+            if (this->has_been_terminated() || this->detached()) {
+                this->_deficit = 0;
+                return false;
             }
-            ssize_t n = 0;
-            do {
-                n = this->_splice(
-                    this->_local_socket,
-                    this->_out,
-                    this->_buffer_size
-                );
-            } while (n > 0);
-            if (this->_verbose) {
-                this->log("_ _", __func__, n);
+            this->_deficit += this->_quantum;
+            size_t budget = this->_deficit;
+            if (this->_rate != 0) {
+                this->refill();
+                budget = std::min(budget, size_t(this->_tokens));
             }
-        }
-
-        void
-        copy_from_pipe_to_remote() {
-            if (!this->_remote_socket) {
-                return;
+            const size_t initial_budget = budget;
+            bool more = this->relay(budget);
+            const size_t used = initial_budget - budget;
+            this->_deficit -= used;
+            if (this->_rate != 0) {
+                this->_tokens -= double(used);
             }
-            ssize_t n = 0;
-            do {
-                n = this->_splice(
-                    this->_out,
-                    this->_remote_socket,
-                    this->_buffer_size
-                );
-            } while (n > 0);
-            if (this->_verbose) {
-                this->log("_ _", __func__, n);
+            if (!more) {
+                // the deficit is not accumulated by idle sessions
+                this->_deficit = 0;
+                return false;
+            }
+            if (this->_rate != 0 && this->_tokens < double(this->_quantum)) {
+                this->_deficit = 0;
+                this->wait_for_tokens();
+                return false;
             }
+            this->_scheduled = true;
+            return true;
+        }
+
+        /// Relay all the data that can be relayed without blocking
+        /// (before the connection is closed).
+        inline void
+        relay_remaining() {
+            size_t budget = std::numeric_limits<size_t>::max();
+            this->relay(budget);
+        }
+
+        /// Called when the session has waited for the tokens.
+        inline void
+        tokens_refilled() {
+            this->_rate_limited = false;
+            this->schedule();
         }
 
+#if defined(VNCD_IO_URING)
+        /// Relay the data in both directions via io_uring instead of the poller.
         void
-        flush() {
-            copy_from_local_to_pipe();
-            copy_from_pipe_to_local();
-            copy_from_remote_to_pipe();
-            copy_from_pipe_to_remote();
+        relay(Uring& ring) {
+            this->_relay.start(
+                ring,
+                this->shared_from_this(),
+                this->_high_water,
+                this->_low_water,
+                this->_remote_socket.fd(),
+                this->_local_socket.fd(),
+                this->_in,
+                this->_out,
+                [this] () { this->terminate(); },
+                [this] (size_t channel, const Uring_relay::Progress& p) {
+                    auto direction = Direction(channel);
+                    (direction == Direction::Upstream
+                     ? this->_upstream
+                     : this->_downstream).nthrottles += p.nthrottles;
+                    this->account(direction, p.nwritten, p.nsplices, p.neagain);
+                }
+            );
         }
+#endif
 
         inline bool
         has_been_terminated() const {
             return _terminated;
         }
 
+        inline const User&
+        user() const {
+            return this->_user;
+        }
+
+        inline uint64_t
+        generation() const {
+            return this->_generation;
+        }
+
+        /// The client has disconnected, but the processes are still running.
+        inline bool
+        detached() const {
+            return this->_detached;
+        }
+
+        /**
+        Called when the client's connection is closed. The session is either
+        detached (grace period) or terminated. When the connection to the VNC
+        server is closed, the session is terminated instead: the server has
+        exited or crashed and there is nothing to reattach to.
+        */
+        void disconnect();
+
+        /**
+        Pass the accepted socket to the new VNC server and supervise the server
+        instead of relaying the data. The session is terminated when the server exits.
+        */
+        void hand_off(sys::socket&& socket);
+
+        /// Called before the new client is connected to the detached session.
+        inline void
+        reattach() {
+            this->log("reattach");
+            this->_detached = false;
+            // the tasks are cancelled below
+            this->_rate_limited = false;
+            this->state(Session_metrics::State::Idle);
+            if (this->_parent) {
+                // the grace period timer
+                this->_parent->cancel(this);
+            }
+        }
+
+        /// Resident set size of the session's processes in bytes.
+        size_t
+        memory_usage() const {
+            static const long page_size = ::sysconf(_SC_PAGESIZE);
+            size_t total = 0;
+            for (const auto& process : this->_processes) {
+                std::ifstream in("/proc/" + std::to_string(process.id()) + "/statm");
+                size_t size = 0, resident = 0;
+                if (in >> size >> resident) {
+                    total += resident*size_t(page_size);
+                }
+            }
+            return total;
+        }
+
         void
         terminate() {
             if (has_been_terminated()) {
                 return;
             }
-            this->log("terminate");
-            try {
-                this->_processes.terminate();
-            } catch (const sys::bad_call& err) {
-                if (err.errc() != std::errc::no_such_process) {
-                    throw;
-                }
+            if (this->_parent) {
+                this->_parent->cancel(this);
             }
-            try {
-                No_lock lock;
-                this->_processes.wait(
-                    lock,
-                    [this](const sys::process&, const sys::process_status& status) {
-                        this->log("process exited with status _", status);
-                    }
-                );
-            } catch (const sys::bad_call& err) {
-                if (err.errc() != std::errc::no_child_process) {
-                    throw;
+            this->log("terminate, throttled upstream _ downstream _ times",
+                      this->_upstream.nthrottles, this->_downstream.nthrottles);
+            for (auto& process : this->_processes) {
+                process.terminate();
+            }
+            this->watch_processes();
+#if defined(VNCD_IO_URING)
+            if (this->_relay.started()) {
+                // file descriptors are closed when the last request completes
+                this->_relay.stop();
+                this->_terminated = true;
+                this->state(Session_metrics::State::Terminated);
+                return;
+            }
+#endif
+            // wake up the connections that own the sockets
+            for (auto* s : {&this->_local_socket, &this->_remote_socket}) {
+                if (*s) {
+                    ::shutdown(s->fd(), SHUT_RDWR);
                 }
             }
             this->_in.close();
@@ -581,6 +1438,7 @@ namespace vncd {
             this->_local_socket.close();
             this->_remote_socket.close();
             this->_terminated = true;
+            this->state(Session_metrics::State::Terminated);
         }
 
         template <class ... Args>
@@ -589,121 +1447,580 @@ namespace vncd {
             sys::log_message(this->_user.name().data(), message, args...);
         }
 
-    };
+        /// Record the time from accepting the connection to the end of the phase
+        /// (only once per client).
+        inline void
+        record(Phase phase) {
+            const auto bit = 1u << unsigned(phase);
+            if (!this->_parent || this->_accepted == Task::time_point{} ||
+                (this->_phases & bit)) {
+                return;
+            }
+            this->_phases |= bit;
+            auto t = Task::clock_type::now() - this->_accepted;
+            this->_parent->metrics()[phase].record(t);
+            if (this->_verbose) {
+                using namespace std::chrono;
+                this->log("_ after _us", to_string(phase),
+                          duration_cast<microseconds>(t).count());
+            }
+        }
 
-    typedef std::shared_ptr<Session> session_pointer;
+    private:
+
+        inline void
+        state(Session_metrics::State s) {
+            this->_metrics.state.store(s, std::memory_order_relaxed);
+        }
+
+        inline void
+        spawned(bool success) {
+            if (!this->_parent) {
+                return;
+            }
+            auto& m = this->_parent->metrics();
+            (success ? m.spawns : m.spawn_failures).add(1);
+        }
+
+        /**
+        Relay the data in both directions until either the sockets would block
+        or the budget is spent (upstream, i.e. the input events, goes first).
+        Returns true if there is more data to relay.
+        */
+        bool
+        relay(size_t& budget) {
+            if (this->has_been_terminated() || this->detached()) {
+                return false;
+            }
+            bool more = false;
+            bool remote_eof = !this->relay(this->_upstream, this->_remote_socket,
+                                           this->_in, this->_local_socket, Direction::Upstream,
+                                           budget, more);
+            bool local_eof = !this->relay(this->_downstream, this->_local_socket,
+                                          this->_out, this->_remote_socket, Direction::Downstream,
+                                          budget, more);
+            if (!remote_eof && !local_eof && !more && this->offload()) {
+                // the data that arrived before the insertion is not redirected
+                size_t unlimited = std::numeric_limits<size_t>::max();
+                this->_upstream.readable = true;
+                this->_downstream.readable = true;
+                remote_eof = !this->relay(this->_upstream, this->_remote_socket,
+                                          this->_in, this->_local_socket, Direction::Upstream,
+                                          unlimited, more);
+                local_eof = !this->relay(this->_downstream, this->_local_socket,
+                                         this->_out, this->_remote_socket, Direction::Downstream,
+                                         unlimited, more);
+            }
+            if (local_eof) {
+                this->log("VNC server closed the connection");
+                this->terminate();
+                return false;
+            }
+            if (remote_eof) {
+                this->disconnect();
+                return false;
+            }
+            this->update_events(this->_remote_fd, this->_remote_events,
+                                this->_upstream, this->_downstream);
+            this->update_events(this->_local_fd, this->_local_events,
+                                this->_downstream, this->_upstream);
+            return more;
+        }
+
+        void
+        tune_socket(sys::fd_type fd, const Socket_profile& profile, const char* name,
+                    bool buffers) {
+            bool tcp = Socket_profile::tcp(fd);
+            if (!profile.apply(fd, tcp, buffers)) {
+                this->log("failed to set _ socket options: _", name, std::strerror(errno));
+            }
+            if (this->_verbose) {
+                this->log("_ socket: _", name, Socket_profile::describe(fd, tcp));
+            }
+        }
+
+        /// A tenth of a second worth of data but not less than the quantum.
+        inline double
+        burst() const {
+            return std::max(double(this->_quantum), double(this->_rate)/10);
+        }
+
+        inline void
+        refill() {
+            auto now = Task::clock_type::now();
+            if (this->_refilled != Task::time_point{}) {
+                using namespace std::chrono;
+                auto dt = duration_cast<duration<double>>(now - this->_refilled).count();
+                this->_tokens = std::min(this->_tokens + double(this->_rate)*dt, this->burst());
+            }
+            this->_refilled = now;
+        }
+
+        /// Resume relaying when the bucket has at least one quantum of tokens.
+        void wait_for_tokens();
+
+        /**
+        Hand the relay over to the kernel when the pipes are empty and both
+        sockets would block. The data that arrives after the insertion is
+        redirected by the kernel, but the data that is already queued on the
+        sockets is not: the caller relays it once more via the pipes.
+        The beginning of the VNC server's handshake is still relayed
+        by VNCD to record the login latency. Returns true if the sockets were
+        inserted into the sockmap.
+        */
+        bool
+        offload() {
+            // the data that is relayed in the kernel is not scheduled
+            if (!this->_kernel_relay || this->_rate != 0 || this->_offloaded ||
+                !this->_downstream_started ||
+                this->_upstream.pending != 0 || this->_downstream.pending != 0 ||
+                this->_upstream.readable || this->_downstream.readable ||
+                !this->_remote_socket || !this->_local_socket) {
+                return false;
+            }
+            this->_offloaded = true;
+            if (Sockmap::instance().insert(this->_remote_socket.fd(),
+                                           this->_local_socket.fd())) {
+                this->log("relay the data in the kernel");
+                return true;
+            }
+            if (this->_verbose) {
+                this->log("relay the data via splice");
+            }
+            return false;
+        }
+
+        /**
+        Splice the data only while it can make progress, i.e. until either
+        the source has no data or the destination has no space.
+        The source is throttled when the pipe reaches high water mark.
+        Returns false on end of file.
+        */
+        bool
+        relay(Channel& channel, sys::socket& source, sys::pipe& pipe,
+              sys::socket& destination, Direction direction,
+              size_t& budget, bool& more) {
+            if (!source) {
+                return true;
+            }
+            size_t nread = 0, nwritten = 0, nsplices = 0, neagain = 0;
+            bool progress = true, eof = false;
+            while (progress) {
+                progress = false;
+                if (channel.readable && !channel.throttled && budget != 0) {
+                    auto n = this->_splice(source, pipe,
+                                           std::min(this->_high_water - channel.pending, budget));
+                    ++nsplices;
+                    if (n > 0) {
+                        channel.pending += n;
+                        nread += n;
+                        budget -= size_t(n);
+                        progress = true;
+                        if (channel.pending >= this->_high_water) {
+                            channel.throttled = true;
+                            ++channel.nthrottles;
+                        }
+                    } else if (n == 0) {
+                        eof = true;
+                        break;
+                    } else {
+                        ++neagain;
+                        channel.readable = false;
+                        channel.pipe_full = channel.pending != 0;
+                    }
+                }
+                if (channel.pending != 0 && channel.writable && destination) {
+                    auto n = this->_splice(pipe, destination, channel.pending);
+                    ++nsplices;
+                    if (n > 0) {
+                        channel.pending -= n;
+                        nwritten += n;
+                        progress = true;
+                        if (channel.pipe_full) {
+                            channel.readable = true;
+                            channel.pipe_full = false;
+                        }
+                        if (channel.throttled && channel.pending <= this->_low_water) {
+                            channel.throttled = false;
+                        }
+                    } else {
+                        ++neagain;
+                        channel.writable = false;
+                    }
+                }
+            }
+            if (budget == 0 && channel.readable && !channel.throttled) {
+                more = true;
+            }
+            if (nread != 0) {
+                // the kernel leaves quick acknowledgement mode on its own
+                (direction == Direction::Upstream
+                 ? this->_remote_profile
+                 : this->_local_profile).rearm(source.fd());
+            }
+            this->account(direction, nwritten, nsplices, neagain);
+            if (this->_verbose && (nread != 0 || nwritten != 0)) {
+                this->log("_ read _ written _ pending _",
+                          to_string(direction), nread, nwritten, channel.pending);
+            }
+            return !eof;
+        }
+
+        /// Update the relay metrics of the session and of the server.
+        void
+        account(Direction direction, size_t nwritten, size_t nsplices, size_t neagain) {
+            this->_metrics[direction].add(nwritten, nsplices, neagain);
+            if (direction == Direction::Downstream && nwritten != 0) {
+                this->_downstream_started = true;
+                this->record(Phase::First_byte);
+            }
+            if (this->_parent) {
+                this->_parent->metrics()[direction].add(nwritten, nsplices, neagain);
+            }
+        }
+
+        /**
+        Close both connections and discard the data that was not relayed.
+        The session is terminated if no client reattaches within the grace period.
+        */
+        void detach();
+
+        /// Hand the terminated processes over to the server that waits for their exit
+        /// and kills them if they do not exit within the timeout.
+        void watch_processes();
+
+        static inline void
+        discard(sys::pipe& pipe, size_t n) {
+            char buf[4096];
+            while (n != 0) {
+                auto m = pipe.in().read(buf, std::min(n, sizeof(buf)));
+                if (m <= 0) {
+                    break;
+                }
+                n -= size_t(m);
+            }
+        }
+
+        /**
+        Ask for readability of the socket only when its channel is not throttled and
+        for writability only when the data is queued for it.
+        */
+        void
+        update_events(sys::fd_type fd, sys::event& current,
+                      const Channel& outgoing, const Channel& incoming) {
+            if (fd == -1 || !this->_parent) {
+                return;
+            }
+            auto events = relay_events(
+                !outgoing.throttled,
+                incoming.pending != 0 && !incoming.writable
+            );
+            if (events != current) {
+                this->_parent->modify(fd, events);
+                current = events;
+            }
+        }
+
+    };
 
     /// Local VNC client that connects to the local VNC server.
     class Local_client: public Connection {
 
     private:
         std::shared_ptr<Session> _session;
+        uint64_t _generation;
+        std::unique_ptr<Rfb_client_handshake> _handshake;
+        /// Connected to the VNC server's Unix socket.
+        bool _unix = false;
+        /// The delay before the next attempt and the deadline for all attempts.
+        duration _delay;
+        time_point _deadline;
 
     public:
 
         inline explicit
-        Local_client(std::shared_ptr<Session> session):
-        Connection{sys::family_type::ipv4},
-        _session(session) {
+        Local_client(std::shared_ptr<Session> session, duration delay,
+                     time_point deadline):
+        _session(session),
+        _generation(session->generation()),
+        _delay(delay),
+        _deadline(deadline) {
+            this->owner(session->user().id());
+            auto path = session->vnc_socket();
+            if (!path.empty()) {
+                if (session->verbose()) {
+                    session->log("connecting to _", path);
+                }
+                this->connect_unix(path, *session);
+                return;
+            }
             sys::ipv4_socket_address address{{127,0,0,1},this->_session->vnc_port()};
-            session->log("connecting to _", address);
+            if (session->verbose()) {
+                session->log("connecting to _", address);
+            }
+            this->_socket = sys::socket(sys::family_type::ipv4);
             this->_socket.bind(sys::ipv4_socket_address{{127,0,0,1},0});
+            // buffer sizes have to be set before the connection for window scaling
+            session->tune_local_socket(this->_socket.fd());
             this->_socket.connect(address);
         }
 
+        void
+        set_user_timeout(const duration& d) override {
+            if (!this->_unix) {
+                Connection::set_user_timeout(d);
+            }
+        }
+
         void
         process(const sys::epoll_event& event) override {
+            if (this->_generation != this->_session->generation()) {
+                // the client has disconnected
+                this->state(State::Stopped);
+                return;
+            }
+            if (starting() && event.bad() && !this->_handshake) {
+                // the server is not listening yet
+                this->retry();
+                this->state(State::Stopped);
+                return;
+            }
+            if (starting() && !event.bad() && !this->_handshake &&
+                !this->_session->credentials().empty()) {
+                // replay the handshake before relaying the data
+                this->_handshake.reset(new Rfb_client_handshake(this->_session->credentials()));
+            }
+            if (this->_handshake) {
+                if (!event.bad()) {
+                    this->_handshake->process(this->_socket);
+                }
+                if (event.bad() || this->_handshake->failed()) {
+                    this->_session->log(
+                        "handshake failed: _",
+                        event.bad() ? "connection closed" : this->_handshake->reason()
+                    );
+                    this->_session->terminate();
+                    this->state(State::Stopped);
+                    return;
+                }
+                if (this->_handshake->running()) {
+                    this->parent().modify(
+                        this->fd(),
+                        this->_handshake->writing() ? sys::event::inout : sys::event::in
+                    );
+                    return;
+                }
+                this->_handshake.reset();
+                this->_session->credentials().clear();
+            }
             if (starting() && !event.bad()) {
+                this->_session->record(Phase::Connect);
                 this->_session->set_local_socket(this->_socket);
-                this->_session->flush();
+#if defined(VNCD_IO_URING)
+                this->_session->relay(this->parent().uring());
+                // only hang-up and errors are reported from now on
+                this->parent().modify(this->fd(), sys::event{});
+#else
+                // switches the socket to edge-triggered events
+                this->_session->local_ready(true, true);
+#endif
                 this->_session->x_session_start();
                 this->state(State::Started);
+            } else if (started() && !event.bad()) {
+                this->_session->local_ready(event.in(), event.out());
             }
             if (started() && event.bad()) {
+                this->_session->log("VNC server closed the connection");
                 this->_session->terminate();
-                this->state(State::Stopping);
             }
-            if (started()) {
-                if (event.in()) {
-                    this->_session->copy_from_local_to_pipe();
-                    this->_session->copy_from_pipe_to_remote();
-                }
-                if (event.out()) {
-                    this->_session->copy_from_pipe_to_local();
-                    this->_session->copy_from_remote_to_pipe();
-                }
+            if (started() && (event.bad() || this->_session->has_been_terminated())) {
+                this->state(State::Stopped);
+            }
+        }
+
+    private:
+
+        void retry();
+
+        void
+        connect_unix(const std::string& path, Session& session) {
+            ::sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path)) {
+                throw std::invalid_argument("VNC socket path is too long");
             }
+            std::memcpy(address.sun_path, path.data(), path.size());
+            int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            UNISTDX_CHECK(fd);
+            this->_socket = sys::socket(fd);
+            this->_unix = true;
+            session.tune_local_socket(fd);
+            UNISTDX_CHECK(::connect(
+                fd,
+                reinterpret_cast<const ::sockaddr*>(&address),
+                sizeof(address)
+            ));
         }
 
     };
 
+    /**
+    Connects to the local VNC server as soon as it starts listening.
+    Connection attempts are repeated with exponentially increasing delay
+    (starting with a few milliseconds) until the session's start timeout.
+    */
     class Local_client_task: public Task {
 
     private:
         std::shared_ptr<Session> _session;
+        time_point _deadline;
 
     public:
 
         inline explicit
         Local_client_task(std::shared_ptr<Session> session):
-        _session(session) {
-            this->period(std::chrono::seconds(1));
-            this->repeat(1);
-            this->at(clock_type::now() + this->period());
+        Local_client_task(session, initial_delay(),
+                          clock_type::now() + session->start_timeout()) {}
+
+        inline explicit
+        Local_client_task(std::shared_ptr<Session> session, duration delay,
+                          time_point deadline):
+        _session(session),
+        _deadline(deadline) {
+            this->owner(session.get());
+            this->period(delay);
+            this->repeat_forever();
+            this->at(clock_type::now() + delay);
         }
 
         void run() override {
             Task::run();
-            this->_session->log("attempts left _", remaining_attempts());
-            this->parent().add(
-                new Local_client(this->_session),
-                sys::event::inout
-            );
+            if (this->_session->has_been_terminated()) {
+                this->repeat(0);
+                return;
+            }
+            try {
+                this->parent().add(
+                    new Local_client(this->_session, this->period(), this->_deadline),
+                    sys::event::inout
+                );
+                this->repeat(0);
+            } catch (const sys::bad_call& err) {
+                if (!not_listening(err.errc())) {
+                    this->repeat(0);
+                    throw;
+                }
+                if (this->expired()) {
+                    this->repeat(0);
+                } else {
+                    this->period(next_delay(this->period()));
+                }
+            }
+        }
+
+        /// Terminate the session if the server has not started in time.
+        inline bool
+        expired() {
+            if (clock_type::now() < this->_deadline) {
+                return false;
+            }
+            this->_session->log("VNC server has not started in time");
+            this->_session->terminate();
+            return true;
+        }
+
+        static inline duration
+        initial_delay() {
+            return std::chrono::milliseconds(5);
+        }
+
+        static inline duration
+        next_delay(duration d) {
+            return std::min<duration>(2*d, std::chrono::milliseconds(100));
+        }
+
+        /// The server is not listening yet (or its Unix socket backlog is full).
+        static inline bool
+        not_listening(std::errc e) {
+            return e == std::errc::connection_refused ||
+                e == std::errc::no_such_file_or_directory ||
+                e == std::errc::resource_unavailable_try_again;
         }
 
     };
 
+    inline void
+    Local_client::retry() {
+        if (this->_session->has_been_terminated()) {
+            return;
+        }
+        auto delay = Local_client_task::next_delay(this->_delay);
+        std::unique_ptr<Local_client_task> task(
+            new Local_client_task(this->_session, delay, this->_deadline)
+        );
+        if (!task->expired()) {
+            this->parent().submit(std::move(task));
+        }
+    }
+
     /// VNC remote client that connects to one of the local servers.
     class Remote_client: public Connection {
 
     private:
         sys::socket_address _address;
-        sys::process_group _vnc;
         std::shared_ptr<Session> _session;
+        uint64_t _generation;
+#if defined(VNCD_TLS)
+        std::unique_ptr<Tls_handshake> _tls;
+#endif
 
     public:
 
         inline explicit
-        Remote_client(sys::socket& server_socket,
-                      session_pointer session,
+        Remote_client(session_pointer session,
                       sys::socket&& socket,
                       const sys::socket_address& address):
         _address(address),
-        _session(std::move(session)) {
+        _session(std::move(session)),
+        _generation(this->_session->generation()) {
+            this->owner(this->_session->user().id());
             this->_socket = std::move(socket);
-            this->_session->set_remote_socket(this->_socket);
-            this->_session->vnc_start();
+            this->_session->tune_remote_socket(this->_socket.fd());
+#if defined(VNCD_TLS)
+            if (const auto* tls = this->_session->tls()) {
+                // VNC server is not started until the handshake is complete
+                this->_tls.reset(new Tls_handshake(*tls, this->_socket.fd()));
+                return;
+            }
+#endif
+            this->start_relay();
         }
 
         void
         process(const sys::epoll_event& event) override {
-            if (starting() && !event.bad()) {
+            if (this->_generation != this->_session->generation()) {
+                // the session was detached from this client
+                this->state(State::Stopped);
+                return;
+            }
+            if (starting()) {
                 this->session()->log("accept");
                 this->state(State::Started);
             }
+#if defined(VNCD_TLS)
+            if (this->_tls) {
+                this->handshake(event);
+                return;
+            }
+#endif
+            if (started() && !event.bad()) {
+                this->_session->remote_ready(event.in(), event.out());
+            }
             if (started() && event.bad()) {
-                this->_session->terminate();
-                this->state(State::Stopping);
+                this->_session->disconnect();
             }
-            if (started()) {
-                if (event.in()) {
-                    this->_session->copy_from_remote_to_pipe();
-                    this->_session->copy_from_pipe_to_local();
-                }
-                if (event.out()) {
-                    this->_session->copy_from_pipe_to_remote();
-                    this->_session->copy_from_local_to_pipe();
-                }
+            if (started() && (event.bad() || this->_session->has_been_terminated())) {
+                this->state(State::Stopped);
             }
         }
 
@@ -712,81 +2029,1007 @@ namespace vncd {
             return this->_session;
         }
 
+    private:
+
+        /// Hand the socket over to the session and start the VNC server.
+        inline void
+        start_relay() {
+            this->_session->set_remote_socket(this->_socket);
+            this->_session->vnc_start();
+        }
+
+#if defined(VNCD_TLS)
+        /**
+        Continue TLS handshake. When it is complete the session keys are in the kernel
+        and the socket is relayed as usual.
+        */
+        void
+        handshake(const sys::epoll_event& event) {
+            if (this->_session->has_been_terminated()) {
+                this->state(State::Stopped);
+                return;
+            }
+            if (!event.bad()) {
+                this->_tls->process();
+            }
+            if (event.bad() || this->_tls->failed()) {
+                this->_session->log(
+                    "TLS handshake failed: _",
+                    event.bad() ? "connection closed" : this->_tls->reason()
+                );
+                this->_session->disconnect();
+                this->state(State::Stopped);
+                return;
+            }
+            if (this->_tls->running()) {
+                this->parent().modify(this->fd(), relay_events(true, this->_tls->writing()));
+                return;
+            }
+            if (this->_session->verbose()) {
+                this->_session->log("TLS _", this->_tls->cipher());
+            }
+            this->_tls.reset();
+            this->parent().modify(this->fd(), relay_events(true, false));
+            this->start_relay();
+            this->_session->remote_ready(true, true);
+        }
+#endif
+
     };
 
-    /// Local server that accepts connections on a particular port.
-    class Local_server: public Connection {
+    /// Terminates the detached session when the grace period expires.
+    class Detached_session_task: public Task {
 
     private:
-        sys::socket_address _address;
-        sys::port_type _vnc_port;
-        User _user;
-        bool _verbose;
         session_pointer _session;
+        uint64_t _generation;
 
     public:
 
         inline explicit
-        Local_server(
-            const sys::socket_address& address,
-            sys::port_type vnc_port,
-            const User& user,
-            bool verbose
-        ):
-        Connection(address.family()),
-        _address(address),
-        _vnc_port(vnc_port),
-        _user(user),
-        _verbose(verbose) {
-            this->_socket.set(sys::socket::options::reuse_address);
-            this->_socket.bind(this->_address);
-            this->_socket.listen();
-            sys::log_message(this->_user.name().data(), "listen");
+        Detached_session_task(session_pointer session, duration grace_period):
+        _session(std::move(session)),
+        _generation(this->_session->generation()) {
+            this->owner(this->_session.get());
+            this->at(clock_type::now() + grace_period);
         }
 
-        inline sys::fd_type
-        fd() const noexcept {
-            return this->_socket.fd();
+        void run() override {
+            Task::run();
+            auto& s = *this->_session;
+            if (s.detached() && s.generation() == this->_generation &&
+                !s.has_been_terminated()) {
+                s.log("grace period expired");
+                s.terminate();
+            }
         }
 
-        inline sys::port_type
-        port() const noexcept {
-            return sys::socket_address_cast<sys::ipv4_socket_address>(this->_address).port();
-        }
+    };
 
-        inline sys::port_type
-        vnc_port() const noexcept {
-            return this->_vnc_port;
-        }
+    /**
+    Waits until the process exits by polling its pidfd in the event loop.
+    The process is reaped by the spawner. The session (if any) is terminated
+    when the process exits.
+    */
+    class Process_watch: public Fd_connection {
 
-        void
+    private:
+        std::string _user;
+        sys::pid_type _id;
+        session_pointer _session;
+
+    public:
+
+        inline explicit
+        Process_watch(const std::string& user, const Child_process& process,
+                      session_pointer session=nullptr):
+        Fd_connection(dup_pidfd(process)),
+        _user(user), _id(process.id()), _session(std::move(session)) {}
+
+        void
         process(const sys::epoll_event& event) override {
             Connection::process(event);
-            if (started() && event.in()) {
-                if (this->_session && !this->_session->has_been_terminated()) {
-                    this->_session->log("refusing multiple connections");
-                    sys::socket tmp;
-                    sys::socket_address tmp2;
-                    while (this->_socket.accept(tmp, tmp2)) { tmp.close(); }
+            // pidfd becomes readable when the process exits
+            if (event.in() || event.bad()) {
+                sys::log_message(this->_user.data(), "process _ exited", this->_id);
+                if (this->_session) {
+                    this->_session->terminate();
+                }
+                this->state(State::Stopped);
+            }
+        }
+
+    private:
+
+        static inline sys::fd_type
+        dup_pidfd(const Child_process& process) {
+            int fd = ::fcntl(process.fd(), F_DUPFD_CLOEXEC, 0);
+            UNISTDX_CHECK(fd);
+            return fd;
+        }
+
+    };
+
+    /**
+    Exits VNCD when the spawner helper dies, so that the service manager
+    restarts the daemon instead of every new session failing to start.
+    */
+    class Helper_watch: public Fd_connection {
+
+    public:
+
+        inline explicit
+        Helper_watch(const Spawner& spawner):
+        Fd_connection(dup_pidfd(spawner)) {}
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            if (event.in() || event.bad()) {
+                sys::log_message("spawner", "helper process exited");
+                // other threads are running, so destructors are not called
+                ::_exit(EXIT_FAILURE);
+            }
+        }
+
+    private:
+
+        static inline sys::fd_type
+        dup_pidfd(const Spawner& spawner) {
+            int fd = ::fcntl(spawner.pidfd(), F_DUPFD_CLOEXEC, 0);
+            UNISTDX_CHECK(fd);
+            return fd;
+        }
+
+    };
+
+    /// Sends SIGKILL to the process group of the script that was sent SIGTERM.
+    class Kill_task: public Task {
+
+    private:
+        std::string _user;
+        Child_process _process;
+
+    public:
+
+        inline explicit
+        Kill_task(const std::string& user, Child_process&& process, duration timeout):
+        _user(user), _process(std::move(process)) {
+            this->at(clock_type::now() + timeout);
+        }
+
+        void run() override {
+            Task::run();
+            if (!this->_process.exited()) {
+                sys::log_message(this->_user.data(), "killing process _", this->_process.id());
+            }
+            // the processes that the script started in the background may
+            // outlive it; the script is reaped after this task, so that its
+            // process group ID is not reused by then
+            this->_process.signal(SIGKILL);
+        }
+
+    };
+
+    /**
+    Shuts down the connection if it still exists after the timeout (e.g. the
+    client has not finished the handshake or the request). The connection is
+    looked up by its descriptor and slot generation, because it may be removed
+    before the task runs.
+    */
+    class Connection_timeout_task: public Task {
+
+    private:
+        sys::fd_type _fd;
+        uint32_t _generation;
+        const char* _name;
+
+    public:
+
+        inline explicit
+        Connection_timeout_task(sys::fd_type fd, uint32_t generation,
+                                duration timeout, const char* name):
+        _fd(fd), _generation(generation), _name(name) {
+            this->at(clock_type::now() + timeout);
+        }
+
+        void run() override {
+            Task::run();
+            // the slot is empty or reused if the connection was closed
+            auto* connection = this->parent().find(this->_fd, this->_generation);
+            if (connection && !connection->stopped()) {
+                sys::log_message(this->_name, "connection timed out");
+                // the connection is stopped by the hang-up event
+                ::shutdown(connection->fd(), SHUT_RDWR);
+            }
+        }
+
+    };
+
+    inline void
+    Session::watch_processes() {
+        // all processes were signalled by terminate(), so they share the deadline
+        const auto deadline = Task::clock_type::now() + this->_kill_timeout;
+        for (auto& process : this->_processes) {
+            bool exited = process.exited();
+            if (exited) {
+                this->log("process _ exited", process.id());
+            }
+            if (!this->_parent) {
+                // not in the event loop: wait for the process in place
+                using std::chrono::milliseconds;
+                using std::chrono::duration_cast;
+                auto left = deadline - Task::clock_type::now();
+                auto timeout = std::max(duration_cast<milliseconds>(left).count(),
+                                        milliseconds::rep(0));
+                if (!exited && !process.exited(int(timeout))) {
+                    this->log("killing process _", process.id());
+                }
+                // kills the rest of the process group even if the script has exited
+                process.signal(SIGKILL);
+                continue;
+            }
+            if (!exited) {
+                this->_parent->add(new Process_watch(this->_user.name(), process));
+            }
+            // kills the rest of the process group even if the script has exited
+            this->_parent->submit(
+                new Kill_task(this->_user.name(), std::move(process), this->_kill_timeout)
+            );
+        }
+        this->_processes.clear();
+    }
+
+    /**
+    Starts X session when the VNC server that received the client's socket
+    accepts connections on its X display socket (a stale socket does not
+    count). The socket is checked with exponentially increasing delay until
+    the session's start timeout.
+    */
+    class X_display_task: public Task {
+
+    private:
+        session_pointer _session;
+        time_point _deadline;
+
+    public:
+
+        inline explicit
+        X_display_task(session_pointer session):
+        _session(std::move(session)),
+        _deadline(clock_type::now() + this->_session->start_timeout()) {
+            this->owner(this->_session.get());
+            this->period(Local_client_task::initial_delay());
+            this->repeat_forever();
+            this->at(clock_type::now() + this->period());
+        }
+
+        void run() override {
+            Task::run();
+            auto& s = *this->_session;
+            if (s.has_been_terminated()) {
+                this->repeat(0);
+                return;
+            }
+            if (x_display_ready(s.user().id())) {
+                s.record(Phase::Connect);
+                s.x_session_start();
+                this->repeat(0);
+                return;
+            }
+            if (clock_type::now() >= this->_deadline) {
+                s.log("X display has not started in time");
+                s.terminate();
+                this->repeat(0);
+                return;
+            }
+            this->period(Local_client_task::next_delay(this->period()));
+        }
+
+    };
+
+    inline void
+    Session::hand_off(sys::socket&& socket) {
+        this->state(Session_metrics::State::Active);
+        this->_accepted = Task::clock_type::now();
+        this->_phases = 0;
+        this->log("accept, hand off the connection to VNC server");
+        auto nprocesses = this->_processes.size();
+        this->tune_remote_socket(socket.fd());
+        this->vnc_start(socket.fd());
+        // VNCD does not relay the data
+        socket.close();
+        if (this->_processes.size() == nprocesses) {
+            this->terminate();
+            return;
+        }
+        this->_parent->add(
+            new Process_watch(this->_user.name(), this->_processes.back(),
+                              this->shared_from_this())
+        );
+        this->_parent->submit(new X_display_task(this->shared_from_this()));
+    }
+
+    /// Puts the rate-limited session back in the relay queue.
+    class Relay_task: public Task {
+
+    private:
+        session_pointer _session;
+
+    public:
+
+        inline explicit
+        Relay_task(session_pointer session, time_point t):
+        _session(std::move(session)) {
+            this->owner(this->_session.get());
+            this->at(t);
+        }
+
+        void run() override {
+            Task::run();
+            this->_session->tokens_refilled();
+        }
+
+    };
+
+    inline void
+    Session::wait_for_tokens() {
+        if (this->_rate_limited || !this->_parent) {
+            return;
+        }
+        using namespace std::chrono;
+        this->_rate_limited = true;
+        auto dt = duration<double>((double(this->_quantum) - this->_tokens) / double(this->_rate));
+        this->_parent->submit(
+            new Relay_task(this->shared_from_this(),
+                           Task::clock_type::now() + duration_cast<Task::duration>(dt))
+        );
+    }
+
+    inline void
+    Server::remove(sys::uid_type uid) {
+        auto result = this->_sessions.find(uid);
+        if (result != this->_sessions.end()) {
+            // VNC server and X session receive SIGTERM (and SIGKILL later)
+            if (result->second) {
+                result->second->terminate();
+            }
+            this->_sessions.erase(result);
+        }
+        lock_type lock(this->_mutex);
+        auto range = this->_owners.equal_range(uid);
+        for (auto first = range.first; first != range.second; ++first) {
+            this->_slots[first->second].connection.reset();
+        }
+        this->_owners.erase(range.first, range.second);
+    }
+
+    inline void
+    Server::relay_sessions() {
+        // the sessions that are scheduled during this round are served in the next one
+        auto n = this->_relay_queue.size();
+        for (size_t i=0; i<n; ++i) {
+            auto session = std::move(this->_relay_queue.front());
+            this->_relay_queue.pop_front();
+            try {
+                if (session->relay_round()) {
+                    this->_relay_queue.emplace_back(std::move(session));
+                }
+            } catch (const std::exception& err) {
+                session->log("relay error: _", err.what());
+            }
+        }
+    }
+
+    inline void
+    Session::disconnect() {
+        if (this->has_been_terminated() || this->detached()) {
+            return;
+        }
+        bool keep = this->_grace_period != Task::duration::zero() &&
+            this->_x_session_started && this->_parent;
+#if defined(VNCD_IO_URING)
+        // the pipes and sockets are owned by io_uring requests until they complete
+        keep = keep && !this->_relay.started();
+#endif
+        if (keep) {
+            this->detach();
+        } else {
+            this->terminate();
+        }
+    }
+
+    inline void
+    Session::detach() {
+        using namespace std::chrono;
+        this->log("client disconnected, keep the session for _s",
+                  duration_cast<seconds>(this->_grace_period).count());
+        ++this->_generation;
+        this->_detached = true;
+        this->state(Session_metrics::State::Detached);
+        for (auto* s : {&this->_local_socket, &this->_remote_socket}) {
+            if (*s) {
+                ::shutdown(s->fd(), SHUT_RDWR);
+                s->close();
+            }
+        }
+        discard(this->_in, this->_upstream.pending);
+        discard(this->_out, this->_downstream.pending);
+        this->_upstream = Channel{};
+        this->_downstream = Channel{};
+        this->_remote_fd = -1;
+        this->_local_fd = -1;
+        this->_remote_events = relay_events(true, false);
+        this->_local_events = sys::event{};
+        this->_offloaded = false;
+        this->_downstream_started = false;
+        this->_parent->submit(
+            new Detached_session_task(this->shared_from_this(), this->_grace_period)
+        );
+    }
+
+    /// Start relaying the accepted connection and spawn VNC server for the session.
+    inline void
+    start_session(Server& server, session_pointer session,
+                  sys::socket&& socket, const sys::socket_address& address) {
+#if defined(VNCD_IO_URING)
+        // only hang-up and errors are reported, the data is relayed via io_uring
+        sys::event events{};
+#else
+        sys::event events = relay_events(true, false);
+#endif
+        session->parent(&server);
+        server.metrics().sessions.add(1);
+        if (session->handoff()) {
+            session->hand_off(std::move(socket));
+            return;
+        }
+        server.add(new Remote_client(session, std::move(socket), address), events);
+        server.submit(new Local_client_task(session));
+    }
+
+    inline session_pointer
+    make_session(const User& user, sys::port_type port, sys::port_type vnc_port,
+                 const Session_options& options) {
+        auto session = std::allocate_shared<Session>(Slab_allocator<Session>(), user);
+        session->set_port(port);
+        session->set_vnc_port(vnc_port);
+        session->options(options);
+        return session;
+    }
+
+    /// Which users have warm VNC servers.
+    struct Warm_pool_options {
+        /// Users that always have warm VNC server.
+        std::unordered_set<std::string> users;
+        /// Start VNC servers ahead of users' usual login time.
+        bool predict = false;
+        /// Upper bound of the total resident memory of warm servers.
+        size_t memory_budget = size_t(1) << 30;
+        /// Resident memory of a VNC server that is assumed until the first servers
+        /// are measured.
+        size_t server_memory = size_t(256) << 20;
+        /// Predicted servers that were not used for this long are stopped.
+        Task::duration idle_timeout = std::chrono::minutes(30);
+        /// How long before the usual login time the server is started.
+        Task::duration lead_time = std::chrono::minutes(15);
+        /// Minimal no. of logins in the same hour of the week to predict the next one.
+        unsigned min_logins = 2;
+        Session_options session;
+
+        inline bool
+        enabled() const {
+            return this->predict || !this->users.empty();
+        }
+    };
+
+    /// The user that is allowed to connect and its ports.
+    struct Warm_candidate {
+        User user;
+        sys::port_type port;
+        sys::port_type vnc_port;
+    };
+
+    /// No. of logins of each user in each hour of the week.
+    class Login_history {
+
+    public:
+        /// Wall clock: logins are counted per hour of the week in local time.
+        typedef std::chrono::system_clock clock_type;
+        typedef clock_type::time_point time_point;
+        static constexpr const size_t nbuckets = 7*24;
+        typedef std::array<uint16_t,nbuckets> counter_array;
+
+    private:
+        std::unordered_map<sys::uid_type,counter_array> _logins;
+
+    public:
+
+        inline void
+        record(sys::uid_type uid, time_point t) {
+            auto result = this->_logins.find(uid);
+            if (result == this->_logins.end()) {
+                result = this->_logins.emplace(uid, counter_array{}).first;
+            }
+            auto& count = result->second[bucket(t)];
+            if (count != UINT16_MAX) {
+                ++count;
+            }
+        }
+
+        inline unsigned
+        count(sys::uid_type uid, time_point t) const {
+            auto result = this->_logins.find(uid);
+            if (result == this->_logins.end()) {
+                return 0;
+            }
+            return result->second[bucket(t)];
+        }
+
+    private:
+
+        static inline size_t
+        bucket(time_point t) {
+            auto tmp = clock_type::to_time_t(t);
+            std::tm tm{};
+            ::localtime_r(&tmp, &tm);
+            return size_t(tm.tm_wday*24 + tm.tm_hour);
+        }
+
+    };
+
+    /**
+    VNC servers that are started before the user connects.
+    Incoming connection is attached to the warm server if there is one.
+    Servers of configured users are always warm, servers of other users
+    are started ahead of their usual login time (predicted from connection
+    history) and stopped if not used. Servers are stopped starting from the
+    oldest predicted ones when their total memory exceeds the budget.
+    */
+    class Warm_pool: public Task {
+
+    private:
+        struct Warm_session {
+            session_pointer session;
+            time_point since;
+            bool predicted;
+        };
+
+        typedef std::unordered_map<sys::uid_type,Warm_session> warm_map;
+
+    private:
+        Warm_pool_options _options;
+        std::unordered_map<sys::uid_type,Warm_candidate> _candidates;
+        warm_map _warm;
+        /// Sessions attached to connections.
+        std::unordered_map<sys::uid_type,std::weak_ptr<Session>> _active;
+        Login_history _history;
+        /// Resident memory of one server: the average of the started servers
+        /// or the configured value if none of them has started yet.
+        size_t _estimate;
+
+    public:
+
+        inline explicit
+        Warm_pool(const Warm_pool_options& options):
+        _options(options), _estimate(std::max<size_t>(options.server_memory, 1)) {
+            this->period(std::chrono::seconds(30));
+            this->repeat_forever();
+        }
+
+        void run() override {
+            Task::run();
+            this->update();
+        }
+
+        /// Replace the users that may have warm servers.
+        void
+        candidates(const std::vector<Warm_candidate>& rhs) {
+            this->_candidates.clear();
+            for (const auto& c : rhs) {
+                this->_candidates.emplace(c.user.id(), c);
+            }
+            this->update();
+        }
+
+        /// Returns warm session for the user or creates a new one.
+        session_pointer
+        attach(const User& user, sys::port_type port, sys::port_type vnc_port,
+               const Session_options& options) {
+            this->_history.record(user.id(), Login_history::clock_type::now());
+            session_pointer session;
+            auto result = this->_warm.find(user.id());
+            if (result != this->_warm.end()) {
+                if (!result->second.session->has_been_terminated()) {
+                    session = std::move(result->second.session);
+                    session->log("attach to warm VNC server");
+                }
+                this->_warm.erase(result);
+            }
+            if (!session) {
+                session = make_session(user, port, vnc_port, options);
+            }
+            this->_active[user.id()] = session;
+            return session;
+        }
+
+    private:
+
+        void
+        update() {
+            auto now = clock_type::now();
+            for (auto first = this->_warm.begin(); first != this->_warm.end(); ) {
+                const auto& w = first->second;
+                bool remove = w.session->has_been_terminated() ||
+                    this->_candidates.count(first->first) == 0 ||
+                    (w.predicted && now - w.since > this->_options.idle_timeout &&
+                     !this->predicted(first->first));
+                if (remove) {
+                    first = this->stop(first);
                 } else {
-                    this->_session = std::make_shared<Session>(this->_user);
-                    this->_session->set_port(port());
-                    this->_session->set_vnc_port(vnc_port());
-                    this->_session->verbose(this->_verbose);
-                    sys::socket socket;
-                    sys::socket_address address;
-                    while (this->_socket.accept(socket, address)) {
-                        this->parent().add(
-                            new Remote_client(this->_socket, this->_session, std::move(socket), address),
-                            sys::event::inout);
-                        this->parent().submit(new Local_client_task(this->_session));
-                    }
+                    ++first;
+                }
+            }
+            for (auto first = this->_active.begin(); first != this->_active.end(); ) {
+                if (first->second.expired()) {
+                    first = this->_active.erase(first);
+                } else {
+                    ++first;
+                }
+            }
+            this->measure(now);
+            size_t used = this->memory_usage(now);
+            for (const auto& pair : this->_candidates) {
+                auto uid = pair.first;
+                if (this->_warm.count(uid) != 0 || this->active(uid)) {
+                    continue;
+                }
+                bool configured = this->_options.users.count(pair.second.user.name()) != 0;
+                bool predicted = !configured && this->predicted(uid);
+                if (!configured && !predicted) {
+                    continue;
+                }
+                if (used + this->_estimate > this->_options.memory_budget) {
+                    sys::log_message("warm-pool", "memory budget is exhausted");
+                    break;
                 }
+                this->start(pair.second, predicted, now);
+                used += this->_estimate;
+            }
+            while (!this->_warm.empty() &&
+                   this->memory_usage(now) > this->_options.memory_budget) {
+                this->stop(this->oldest());
             }
         }
 
+        /// Servers that were started before the previous update have finished
+        /// their initialisation and their memory usage is representative.
+        inline bool
+        started(const Warm_session& w, time_point now) const {
+            return now - w.since >= this->period();
+        }
+
+        /// Update per-server estimate from the servers that have started.
+        void
+        measure(time_point now) {
+            size_t total = 0, n = 0;
+            for (const auto& pair : this->_warm) {
+                if (this->started(pair.second, now)) {
+                    total += pair.second.session->memory_usage();
+                    ++n;
+                }
+            }
+            if (n != 0 && total != 0) {
+                this->_estimate = total / n;
+            }
+        }
+
+        void
+        start(const Warm_candidate& c, bool predicted, time_point now) {
+            auto session = make_session(c.user, c.port, c.vnc_port,
+                                        this->_options.session);
+            session->parent(&this->parent());
+            session->log("start warm VNC server");
+            session->vnc_start();
+            this->_warm.emplace(c.user.id(), Warm_session{session, now, predicted});
+        }
+
+        warm_map::iterator
+        stop(warm_map::iterator result) {
+            auto& session = *result->second.session;
+            if (!session.has_been_terminated()) {
+                session.log("stop warm VNC server");
+                session.terminate();
+            }
+            return this->_warm.erase(result);
+        }
+
+        /// The oldest predicted server or the oldest server if there are no predicted ones.
+        warm_map::iterator
+        oldest() {
+            auto result = this->_warm.begin();
+            for (auto first = this->_warm.begin(); first != this->_warm.end(); ++first) {
+                const auto& a = first->second;
+                const auto& b = result->second;
+                if (a.predicted != b.predicted ? a.predicted : a.since < b.since) {
+                    result = first;
+                }
+            }
+            return result;
+        }
+
+        /// Servers that are still starting are accounted for at least the estimate.
+        size_t
+        memory_usage(time_point now) const {
+            size_t total = 0;
+            for (const auto& pair : this->_warm) {
+                auto rss = pair.second.session->memory_usage();
+                if (!this->started(pair.second, now)) {
+                    rss = std::max(rss, this->_estimate);
+                }
+                total += rss;
+            }
+            return total;
+        }
+
+        inline bool
+        active(sys::uid_type uid) const {
+            auto result = this->_active.find(uid);
+            if (result == this->_active.end()) {
+                return false;
+            }
+            auto session = result->second.lock();
+            return session && !session->has_been_terminated();
+        }
+
+        inline bool
+        predicted(sys::uid_type uid) const {
+            if (!this->_options.predict) {
+                return false;
+            }
+            auto now = Login_history::clock_type::now();
+            auto n = std::max(this->_history.count(uid, now),
+                              this->_history.count(uid, now + this->_options.lead_time));
+            return n >= this->_options.min_logins;
+        }
+
+    };
+
+    /// Updates warm pool candidates in the pool's thread.
+    class Warm_candidates_task: public Task {
+
+    private:
+        Warm_pool* _pool;
+        std::vector<Warm_candidate> _candidates;
+
+    public:
+
+        inline explicit
+        Warm_candidates_task(Warm_pool* pool, std::vector<Warm_candidate>&& candidates):
+        _pool(pool), _candidates(std::move(candidates)) {}
+
+        void run() override {
+            Task::run();
+            this->_pool->candidates(this->_candidates);
+        }
+
     };
 
+    inline void
+    Server_pool::warm_pool(const Warm_pool_options& options) {
+        for (auto& server : this->_servers) {
+            auto* pool = new Warm_pool(options);
+            server->warm_pool(pool);
+            server->submit(pool);
+        }
+    }
+
+    inline void
+    Server_pool::warm_candidates(const std::vector<Warm_candidate>& candidates) {
+        std::vector<std::vector<Warm_candidate>> shards(this->_servers.size());
+        for (const auto& c : candidates) {
+            shards[c.user.id() % shards.size()].emplace_back(c);
+        }
+        for (size_t i=0; i<shards.size(); ++i) {
+            auto* pool = this->_servers[i]->warm_pool();
+            if (pool) {
+                this->_servers[i]->submit(new Warm_candidates_task(pool, std::move(shards[i])));
+            }
+        }
+    }
+
+    /// Returns warm session for the user if there is one or creates a new session.
+    inline session_pointer
+    new_session(Server& server, const User& user, sys::port_type port,
+                sys::port_type vnc_port, const Session_options& options) {
+        if (auto* pool = server.warm_pool()) {
+            return pool->attach(user, port, vnc_port, options);
+        }
+        return make_session(user, port, vnc_port, options);
+    }
+
+#if defined(VNCD_IO_URING)
+    /**
+    Multishot accept request. The request outlives the server
+    until the last completion arrives.
+    */
+    class Accept_request: public Uring_request {
+
+    private:
+        Local_server* _server;
+
+    public:
+
+        inline explicit
+        Accept_request(Local_server* server): _server(server) {}
+
+        inline void
+        orphan() {
+            this->_server = nullptr;
+        }
+
+        void complete(const ::io_uring_cqe& cqe) override;
+
+    };
+#endif
+
+    /// Local server that accepts connections on a particular port.
+    class Local_server: public Connection {
+
+    private:
+        sys::socket_address _address;
+        sys::port_type _vnc_port;
+        User _user;
+        Session_options _options;
+#if defined(VNCD_IO_URING)
+        Accept_request* _accept = nullptr;
+        /// The accept request of this server is multishot.
+        bool _multishot = true;
+#endif
+
+    public:
+
+        inline explicit
+        Local_server(
+            const sys::socket_address& address,
+            sys::port_type vnc_port,
+            const User& user,
+            const Session_options& options
+        ):
+        Connection(address.family()),
+        _address(address),
+        _vnc_port(vnc_port),
+        _user(user),
+        _options(options) {
+            this->owner(user.id());
+            this->_socket.set(sys::socket::options::reuse_address);
+            // accepted sockets inherit the buffer sizes before the handshake
+            options.remote_profile.apply_buffers(this->_socket.fd());
+            this->_socket.bind(this->_address);
+            this->_socket.listen();
+            sys::log_message(this->_user.name().data(), "listen");
+        }
+
+#if defined(VNCD_IO_URING)
+        ~Local_server() {
+            if (this->_accept) {
+                this->_accept->orphan();
+                ::shutdown(this->fd(), SHUT_RDWR);
+                auto& ring = this->parent().uring();
+                ring.cancel(this->fd());
+                // cancel before the socket is closed
+                ring.submit();
+            }
+        }
+
+        void
+        submit(Uring& ring) override {
+            this->_accept = new Accept_request(this);
+            this->_multishot = multishot_supported();
+            ring.accept(this->fd(), this->_accept, this->_multishot);
+            // connections are accepted via io_uring
+            this->parent().modify(this->fd(), sys::event{});
+        }
+
+        void
+        complete_accept(int result, bool more) {
+            if (result == -EINVAL && this->_multishot) {
+                // multishot accept is not supported by the kernel
+                if (multishot_supported().exchange(false)) {
+                    sys::log_message("server",
+                                     "multishot accept is not supported, use single-shot accept");
+                }
+                this->_multishot = false;
+                this->parent().uring().accept(this->fd(), this->_accept, false);
+                return;
+            }
+            if (result >= 0) {
+                this->accept(sys::socket(result), sys::socket_address{});
+            } else if (result != -ECANCELED) {
+                sys::log_message(this->_user.name().data(), "accept error _",
+                                 std::make_error_code(std::errc(-result)).message());
+            }
+            if (!more && result != -ECANCELED && result != -EINVAL) {
+                this->parent().uring().accept(this->fd(), this->_accept, this->_multishot);
+            }
+        }
+
+        /// Shared by all servers: the first failed request turns multishot accept off.
+        static inline std::atomic<bool>&
+        multishot_supported() {
+            static std::atomic<bool> value{true};
+            return value;
+        }
+#endif
+
+        inline sys::fd_type
+        fd() const noexcept {
+            return this->_socket.fd();
+        }
+
+        sys::port_type
+        port() const override {
+            return sys::socket_address_cast<sys::ipv4_socket_address>(this->_address).port();
+        }
+
+        inline sys::port_type
+        vnc_port() const noexcept {
+            return this->_vnc_port;
+        }
+
+        void
+        process(const sys::epoll_event& event) override {
+            Connection::process(event);
+            if (started() && event.in()) {
+                sys::socket socket;
+                sys::socket_address address;
+                while (this->_socket.accept(socket, address)) {
+                    this->accept(std::move(socket), address);
+                }
+            }
+        }
+
+    private:
+
+        void
+        accept(sys::socket&& socket, const sys::socket_address& address) {
+            // the session is kept by the server, so that it is terminated
+            // when the user is removed
+            auto& session = this->parent().session(this->_user.id());
+            if (session && !session->has_been_terminated()) {
+                if (session->detached()) {
+                    session->reattach();
+                    start_session(this->parent(), session, std::move(socket), address);
+                    return;
+                }
+                session->log("refusing multiple connections");
+                socket.close();
+                return;
+            }
+            session = new_session(this->parent(), this->_user, port(),
+                                  vnc_port(), this->_options);
+            start_session(this->parent(), session, std::move(socket), address);
+        }
+
+    };
+
+#if defined(VNCD_IO_URING)
+    inline void
+    Accept_request::complete(const ::io_uring_cqe& cqe) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!this->_server) {
+            if (cqe.res >= 0) {
+                ::close(cqe.res);
+            }
+            if (!more) {
+                delete this;
+            }
+            return;
+        }
+        this->_server->complete_accept(cqe.res, more);
+    }
+#endif
+
 }
 
 #endif // vim:filetype=cpp
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_SLAB_HH
+#define VNCD_SLAB_HH
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <unistdx/base/simple_lock>
+#include <unistdx/base/spin_mutex>
+
+namespace vncd {
+
+    /**
+    Fixed-size blocks carved out of large chunks. Freed blocks are kept in
+    a free list and reused, so that objects of the same size are allocated
+    close to each other. Thread-safe: connections are created in one thread
+    and destroyed in another one.
+    */
+    class Slab {
+
+    private:
+        typedef sys::spin_mutex mutex_type;
+        typedef sys::simple_lock<mutex_type> lock_type;
+
+        struct Free_block {
+            Free_block* next;
+        };
+
+    private:
+        size_t _block_size;
+        size_t _blocks_per_chunk;
+        std::vector<std::unique_ptr<char[]>> _chunks;
+        Free_block* _free = nullptr;
+        mutex_type _mutex;
+
+    public:
+
+        inline explicit
+        Slab(size_t block_size, size_t blocks_per_chunk=64):
+        _block_size(block_size), _blocks_per_chunk(blocks_per_chunk) {}
+
+        Slab(const Slab&) = delete;
+        Slab& operator=(const Slab&) = delete;
+
+        void*
+        allocate() {
+            lock_type lock(this->_mutex);
+            if (!this->_free) {
+                this->grow();
+            }
+            auto* block = this->_free;
+            this->_free = block->next;
+            return block;
+        }
+
+        void
+        deallocate(void* ptr) {
+            lock_type lock(this->_mutex);
+            auto* block = static_cast<Free_block*>(ptr);
+            block->next = this->_free;
+            this->_free = block;
+        }
+
+    private:
+
+        void
+        grow() {
+            const auto n = this->_block_size;
+            std::unique_ptr<char[]> chunk(new char[n*this->_blocks_per_chunk]);
+            for (size_t i=this->_blocks_per_chunk; i-- > 0; ) {
+                auto* block = reinterpret_cast<Free_block*>(chunk.get() + i*n);
+                block->next = this->_free;
+                this->_free = block;
+            }
+            this->_chunks.emplace_back(std::move(chunk));
+        }
+
+    };
+
+    /// Slabs for each size class. Large objects are allocated with operator new.
+    class Slab_arena {
+
+    public:
+        static constexpr const size_t granularity = 64;
+        static constexpr const size_t max_size = 2048;
+
+    private:
+        std::vector<std::unique_ptr<Slab>> _slabs;
+
+    public:
+
+        inline
+        Slab_arena() {
+            for (size_t n=granularity; n<=max_size; n+=granularity) {
+                this->_slabs.emplace_back(new Slab(n));
+            }
+        }
+
+        static inline Slab_arena&
+        instance() {
+            static Slab_arena arena;
+            return arena;
+        }
+
+        inline void*
+        allocate(size_t n) {
+            if (n == 0 || n > max_size) {
+                return ::operator new(n);
+            }
+            return this->_slabs[index(n)]->allocate();
+        }
+
+        inline void
+        deallocate(void* ptr, size_t n) {
+            if (!ptr) {
+                return;
+            }
+            if (n == 0 || n > max_size) {
+                ::operator delete(ptr);
+                return;
+            }
+            this->_slabs[index(n)]->deallocate(ptr);
+        }
+
+    private:
+
+        static inline size_t
+        index(size_t n) {
+            return (n + granularity - 1)/granularity - 1;
+        }
+
+    };
+
+    /// Standard allocator that allocates objects from the slab arena.
+    template <class T>
+    class Slab_allocator {
+
+    public:
+        typedef T value_type;
+
+    public:
+
+        Slab_allocator() = default;
+
+        template <class U>
+        inline
+        Slab_allocator(const Slab_allocator<U>&) noexcept {}
+
+        inline T*
+        allocate(size_t n) {
+            return static_cast<T*>(Slab_arena::instance().allocate(n*sizeof(T)));
+        }
+
+        inline void
+        deallocate(T* ptr, size_t n) noexcept {
+            Slab_arena::instance().deallocate(ptr, n*sizeof(T));
+        }
+
+        template <class U>
+        inline bool
+        operator==(const Slab_allocator<U>&) const noexcept {
+            return true;
+        }
+
+        template <class U>
+        inline bool
+        operator!=(const Slab_allocator<U>&) const noexcept {
+            return false;
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
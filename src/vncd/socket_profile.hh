@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_SOCKET_PROFILE_HH
+#define VNCD_SOCKET_PROFILE_HH
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <unistdx/base/check>
+#include <unistdx/io/fildes>
+
+namespace vncd {
+
+    /**
+    Socket options that are set on each relayed connection. Remote (client)
+    and local (VNC server) connections have separate profiles. Zero values
+    and empty strings leave the system defaults intact. TCP options are skipped
+    for Unix sockets.
+    */
+    struct Socket_profile {
+        /// Send small writes (input events, cursor updates) without delay.
+        bool nodelay = false;
+        /// Acknowledge the data immediately (the flag is reset by the kernel,
+        /// so it is set again after each read).
+        bool quickack = false;
+        /// Keep at most this many unsent bytes in the kernel's send queue
+        /// (the rest stays in the relay pipe).
+        int notsent_lowat = 0;
+        /// Send buffer size in bytes (doubled by the kernel).
+        int send_buffer = 0;
+        /// Receive buffer size in bytes (doubled by the kernel).
+        int receive_buffer = 0;
+        /// Congestion control algorithm (e.g. bbr).
+        std::string congestion;
+        /// Busy poll the device queue for this many microseconds on blocking reads.
+        int busy_poll = 0;
+
+        /**
+        Parse comma-separated list of options: nodelay, quickack,
+        notsent-lowat=BYTES, sndbuf=BYTES, rcvbuf=BYTES, congestion=NAME,
+        busy-poll=MICROSECONDS and presets: default (no options) and
+        low-latency (nodelay, quickack, notsent-lowat=16384).
+        */
+        void
+        parse(const std::string& arg) {
+            std::stringstream tmp(arg);
+            std::string item;
+            while (std::getline(tmp, item, ',')) {
+                auto pos = item.find('=');
+                auto name = item.substr(0, pos);
+                auto value = pos == std::string::npos ? std::string() : item.substr(pos+1);
+                if (name == "default") {
+                    *this = Socket_profile{};
+                } else if (name == "low-latency") {
+                    this->nodelay = true;
+                    this->quickack = true;
+                    this->notsent_lowat = 16384;
+                } else if (name == "nodelay") {
+                    this->nodelay = true;
+                } else if (name == "quickack") {
+                    this->quickack = true;
+                } else if (name == "notsent-lowat") {
+                    this->notsent_lowat = parse_size(value);
+                } else if (name == "sndbuf") {
+                    this->send_buffer = parse_size(value);
+                } else if (name == "rcvbuf") {
+                    this->receive_buffer = parse_size(value);
+                } else if (name == "congestion" && !value.empty()) {
+                    this->congestion = value;
+                } else if (name == "busy-poll") {
+                    this->busy_poll = parse_size(value);
+                } else {
+                    throw std::invalid_argument("bad socket option: " + item);
+                }
+            }
+        }
+
+        /**
+        Set the options on the socket. Returns false if any of them was not set.
+        The buffer sizes are set only if \p buffers is true: they affect window
+        scaling only before the connection is established, so for the accepted
+        sockets they are set on the listening socket (and inherited).
+        */
+        bool
+        apply(sys::fd_type fd, bool tcp, bool buffers=true) const {
+            bool success = true;
+            if (tcp) {
+                if (this->nodelay) { success &= set(fd, IPPROTO_TCP, TCP_NODELAY, 1); }
+                if (this->quickack) { success &= set(fd, IPPROTO_TCP, TCP_QUICKACK, 1); }
+                if (this->notsent_lowat != 0) {
+                    success &= set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, this->notsent_lowat);
+                }
+                if (!this->congestion.empty()) {
+                    success &= ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+                                            this->congestion.data(),
+                                            this->congestion.size()) == 0;
+                }
+                if (this->busy_poll != 0) {
+                    success &= set(fd, SOL_SOCKET, SO_BUSY_POLL, this->busy_poll);
+                }
+            }
+            if (buffers) {
+                success &= this->apply_buffers(fd);
+            }
+            return success;
+        }
+
+        /// Set the buffer sizes (e.g. on the listening socket before listen()).
+        bool
+        apply_buffers(sys::fd_type fd) const {
+            bool success = true;
+            if (this->send_buffer != 0) {
+                success &= set(fd, SOL_SOCKET, SO_SNDBUF, this->send_buffer);
+            }
+            if (this->receive_buffer != 0) {
+                success &= set(fd, SOL_SOCKET, SO_RCVBUF, this->receive_buffer);
+            }
+            return success;
+        }
+
+        /// Set quick acknowledgements again after the data was read.
+        inline void
+        rearm(sys::fd_type fd) const {
+            if (this->quickack) {
+                set(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+            }
+        }
+
+        /// Whether the socket is TCP socket (the other ones are Unix sockets).
+        static inline bool
+        tcp(sys::fd_type fd) {
+            return get(fd, SOL_SOCKET, SO_PROTOCOL) == IPPROTO_TCP;
+        }
+
+        /// The effective values of the socket options (for verbose logging).
+        static std::string
+        describe(sys::fd_type fd, bool tcp) {
+            std::stringstream out;
+            out << "sndbuf=" << get(fd, SOL_SOCKET, SO_SNDBUF)
+                << " rcvbuf=" << get(fd, SOL_SOCKET, SO_RCVBUF);
+            if (tcp) {
+                char congestion[16]{};
+                ::socklen_t n = sizeof(congestion)-1;
+                ::getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion, &n);
+                out << " nodelay=" << get(fd, IPPROTO_TCP, TCP_NODELAY)
+                    << " notsent-lowat=" << get(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT)
+                    << " congestion=" << congestion
+                    << " busy-poll=" << get(fd, SOL_SOCKET, SO_BUSY_POLL);
+            }
+            return out.str();
+        }
+
+        /// Check that the kernel supports all the options (e.g. the congestion
+        /// control module is loaded) on a new TCP socket.
+        void
+        validate() const {
+            sys::fildes s(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+            UNISTDX_CHECK(s.fd());
+            if (!this->apply(s.fd(), true)) {
+                throw std::invalid_argument(
+                    std::string("bad socket options: ") + std::strerror(errno)
+                );
+            }
+        }
+
+    private:
+
+        static inline int
+        parse_size(const std::string& arg) {
+            long tmp;
+            if (!(std::stringstream(arg) >> tmp) || tmp <= 0 || tmp > (1L<<30)) {
+                throw std::invalid_argument("bad socket option value: " + arg);
+            }
+            return int(tmp);
+        }
+
+        static inline bool
+        set(sys::fd_type fd, int level, int name, int value) {
+            return ::setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+        }
+
+        static inline int
+        get(sys::fd_type fd, int level, int name) {
+            int value = 0;
+            ::socklen_t n = sizeof(value);
+            ::getsockopt(fd, level, name, &value, &n);
+            return value;
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
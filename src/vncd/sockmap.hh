@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_SOCKMAP_HH
+#define VNCD_SOCKMAP_HH
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <unistdx/base/check>
+#include <unistdx/io/fildes>
+
+namespace vncd {
+
+    /**
+    The connection as seen from one of its sockets in the format of
+    \c __sk_buff fields (the addresses and the remote port in network
+    byte order, the local port in host byte order).
+    */
+    struct Sockmap_key {
+        uint32_t remote_ip4 = 0;
+        uint32_t local_ip4 = 0;
+        uint32_t remote_port = 0;
+        uint32_t local_port = 0;
+    };
+
+    /**
+    Kernel-resident relay. The sockets of each session are inserted into two
+    BPF socket hash maps. The first one (targets) maps the socket's key to its
+    peer and has no programs attached. The second one has sk_skb programs
+    attached that redirect every packet that arrives to the socket to the
+    transmit queue of the socket's peer from the first map,
+    so that the data never reaches user space. The packets for which
+    the peer is not found are delivered to the socket as usual.
+    The sockets are removed from the maps by the kernel when they are closed.
+    */
+    class Sockmap {
+
+    private:
+        sys::fildes _targets;
+        sys::fildes _sockets;
+        sys::fildes _parser;
+        sys::fildes _verdict;
+        bool _started = false;
+
+    public:
+
+        static inline Sockmap&
+        instance() {
+            static Sockmap sockmap;
+            return sockmap;
+        }
+
+        /// Create the maps and load the programs. Throws if BPF is not available.
+        void
+        start(size_t max_sessions) {
+            this->_targets = create_map(2*max_sessions);
+            this->_sockets = create_map(2*max_sessions);
+            this->_verdict = load_verdict(this->_targets.fd());
+            // the verdict without stream parser is supported since Linux 5.13
+            if (attach(this->_verdict.fd(), this->_sockets.fd(), BPF_SK_SKB_VERDICT) == -1) {
+                this->_parser = load_parser();
+                UNISTDX_CHECK(attach(this->_parser.fd(), this->_sockets.fd(),
+                                     BPF_SK_SKB_STREAM_PARSER));
+                UNISTDX_CHECK(attach(this->_verdict.fd(), this->_sockets.fd(),
+                                     BPF_SK_SKB_STREAM_VERDICT));
+            }
+            this->_started = true;
+        }
+
+        inline bool
+        started() const {
+            return this->_started;
+        }
+
+        /**
+        Redirect the data between the sockets in the kernel.
+        Returns false if the sockets can not be inserted into the maps
+        (only IPv4 TCP sockets are supported).
+        */
+        bool
+        insert(sys::fd_type a, sys::fd_type b) {
+            if (!this->_started) {
+                return false;
+            }
+            Sockmap_key key_a, key_b;
+            if (!make_key(a, key_a) || !make_key(b, key_b)) {
+                return false;
+            }
+            // peers first: the programs are run as soon as the socket is
+            // inserted into the second map
+            if (!update(this->_targets.fd(), key_a, b)) {
+                return false;
+            }
+            if (!update(this->_targets.fd(), key_b, a)) {
+                remove(this->_targets.fd(), key_a);
+                return false;
+            }
+            if (!update(this->_sockets.fd(), key_a, a)) {
+                remove(this->_targets.fd(), key_a);
+                remove(this->_targets.fd(), key_b);
+                return false;
+            }
+            if (!update(this->_sockets.fd(), key_b, b)) {
+                remove(this->_sockets.fd(), key_a);
+                remove(this->_targets.fd(), key_a);
+                remove(this->_targets.fd(), key_b);
+                return false;
+            }
+            return true;
+        }
+
+    private:
+
+        Sockmap() = default;
+
+        static inline long
+        bpf(int command, ::bpf_attr& attr) {
+            return ::syscall(SYS_bpf, command, &attr, sizeof(attr));
+        }
+
+        static sys::fildes
+        create_map(size_t max_entries) {
+            ::bpf_attr attr{};
+            attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+            attr.key_size = sizeof(Sockmap_key);
+            attr.value_size = sizeof(uint32_t);
+            attr.max_entries = uint32_t(max_entries);
+            auto fd = bpf(BPF_MAP_CREATE, attr);
+            UNISTDX_CHECK(fd);
+            return sys::fildes(sys::fd_type(fd));
+        }
+
+        static sys::fildes
+        load(const std::vector<::bpf_insn>& code) {
+            static const char license[] = "GPL";
+            ::bpf_attr attr{};
+            attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+            attr.insn_cnt = uint32_t(code.size());
+            attr.insns = uint64_t(reinterpret_cast<uintptr_t>(code.data()));
+            attr.license = uint64_t(reinterpret_cast<uintptr_t>(license));
+            auto fd = bpf(BPF_PROG_LOAD, attr);
+            UNISTDX_CHECK(fd);
+            return sys::fildes(sys::fd_type(fd));
+        }
+
+        static inline int
+        attach(sys::fd_type program, sys::fd_type map, ::bpf_attach_type type) {
+            ::bpf_attr attr{};
+            attr.target_fd = uint32_t(map);
+            attr.attach_bpf_fd = uint32_t(program);
+            attr.attach_type = type;
+            return int(bpf(BPF_PROG_ATTACH, attr));
+        }
+
+        static inline ::bpf_insn
+        instruction(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+            ::bpf_insn insn{};
+            insn.code = code;
+            insn.dst_reg = dst & 0xf;
+            insn.src_reg = src & 0xf;
+            insn.off = off;
+            insn.imm = imm;
+            return insn;
+        }
+
+        /// Every packet is a message.
+        static sys::fildes
+        load_parser() {
+            return load({
+                // r0 = skb->len
+                instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1,
+                            offsetof(::__sk_buff, len), 0),
+                instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+            });
+        }
+
+        /// Redirect the packet to the socket's peer from the targets map.
+        static sys::fildes
+        load_verdict(sys::fd_type targets) {
+            const int16_t key = -int16_t(sizeof(Sockmap_key));
+            std::vector<::bpf_insn> code{
+                // r6 = skb
+                instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+            };
+            // copy the key fields to the stack
+            const int16_t fields[] = {
+                offsetof(::__sk_buff, remote_ip4),
+                offsetof(::__sk_buff, local_ip4),
+                offsetof(::__sk_buff, remote_port),
+                offsetof(::__sk_buff, local_port),
+            };
+            for (int16_t i=0; i<4; ++i) {
+                code.emplace_back(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2,
+                                              BPF_REG_6, fields[i], 0));
+                code.emplace_back(instruction(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+                                              BPF_REG_2, int16_t(key + 4*i), 0));
+            }
+            code.insert(code.end(), {
+                // bpf_sk_redirect_hash(skb, targets, &key, 0)
+                instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+                instruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, targets),
+                instruction(0, 0, 0, 0, 0),
+                instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+                instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, key),
+                instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+                instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+                // SK_PASS redirects the packet if the peer was found and
+                // delivers it to the socket otherwise
+                instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+                instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+            });
+            return load(code);
+        }
+
+        static bool
+        make_key(sys::fd_type fd, Sockmap_key& key) {
+            ::sockaddr_in local{}, remote{};
+            ::socklen_t n = sizeof(local), m = sizeof(remote);
+            if (::getsockname(fd, reinterpret_cast<::sockaddr*>(&local), &n) == -1 ||
+                ::getpeername(fd, reinterpret_cast<::sockaddr*>(&remote), &m) == -1 ||
+                local.sin_family != AF_INET || remote.sin_family != AF_INET) {
+                return false;
+            }
+            key.remote_ip4 = remote.sin_addr.s_addr;
+            key.local_ip4 = local.sin_addr.s_addr;
+            key.remote_port = remote.sin_port;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            // the kernel loads 16-bit port into the upper half of the field
+            key.remote_port <<= 16;
+#endif
+            key.local_port = ntohs(local.sin_port);
+            return true;
+        }
+
+        static bool
+        update(sys::fd_type map, const Sockmap_key& key, sys::fd_type socket) {
+            uint32_t value = uint32_t(socket);
+            ::bpf_attr attr{};
+            attr.map_fd = uint32_t(map);
+            attr.key = uint64_t(reinterpret_cast<uintptr_t>(&key));
+            attr.value = uint64_t(reinterpret_cast<uintptr_t>(&value));
+            attr.flags = BPF_ANY;
+            return bpf(BPF_MAP_UPDATE_ELEM, attr) != -1;
+        }
+
+        static void
+        remove(sys::fd_type map, const Sockmap_key& key) {
+            ::bpf_attr attr{};
+            attr.map_fd = uint32_t(map);
+            attr.key = uint64_t(reinterpret_cast<uintptr_t>(&key));
+            bpf(BPF_MAP_DELETE_ELEM, attr);
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
@@ -0,0 +1,605 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_SPAWNER_HH
+#define VNCD_SPAWNER_HH
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <unistdx/base/check>
+#include <unistdx/base/log_message>
+#include <unistdx/io/fildes>
+
+#if !defined(SYS_clone3)
+#define SYS_clone3 435
+#endif
+#if !defined(SYS_pidfd_send_signal)
+#define SYS_pidfd_send_signal 424
+#endif
+#if !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+#if !defined(SYS_close_range)
+#define SYS_close_range 436
+#endif
+#if !defined(CLONE_PIDFD)
+#define CLONE_PIDFD 0x00001000
+#endif
+#if !defined(CLOSE_RANGE_CLOEXEC)
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+extern char** environ;
+
+namespace vncd {
+
+    /// What to execute and on behalf of which user.
+    struct Spawn_request {
+        sys::uid_type uid = 0;
+        sys::gid_type gid = 0;
+        /// User name for supplementary groups.
+        std::string user;
+        std::string workdir;
+        std::string script;
+        /// Environment in NAME=VALUE format.
+        std::vector<std::string> environment;
+
+        /// Copy the environment of this process.
+        inline void
+        inherit_environment() {
+            for (char** e = environ; *e; ++e) {
+                this->environment.emplace_back(*e);
+            }
+        }
+
+        /// Set or replace environment variable.
+        template <class T>
+        inline void
+        set(const std::string& name, const T& value) {
+            this->set(name, std::to_string(value));
+        }
+
+        void
+        set(const std::string& name, const std::string& value) {
+            auto prefix = name + '=';
+            for (auto& e : this->environment) {
+                if (e.compare(0, prefix.size(), prefix) == 0) {
+                    e = prefix + value;
+                    return;
+                }
+            }
+            this->environment.emplace_back(prefix + value);
+        }
+
+        inline void
+        set(const std::string& name, const char* value) {
+            this->set(name, std::string(value));
+        }
+
+        /// IDs followed by null-terminated strings.
+        std::string
+        serialize() const {
+            std::string s;
+            s.append(reinterpret_cast<const char*>(&this->uid), sizeof(this->uid));
+            s.append(reinterpret_cast<const char*>(&this->gid), sizeof(this->gid));
+            for (const auto* str : {&this->user, &this->workdir, &this->script}) {
+                s.append(str->data(), str->size()+1);
+            }
+            for (const auto& e : this->environment) {
+                s.append(e.data(), e.size()+1);
+            }
+            return s;
+        }
+
+        bool
+        parse(const char* first, const char* last) {
+            if (size_t(last-first) < sizeof(uid) + sizeof(gid) || last[-1] != 0) {
+                return false;
+            }
+            std::memcpy(&this->uid, first, sizeof(uid));
+            first += sizeof(uid);
+            std::memcpy(&this->gid, first, sizeof(gid));
+            first += sizeof(gid);
+            std::vector<std::string> strings;
+            while (first != last) {
+                strings.emplace_back(first);
+                first += strings.back().size()+1;
+            }
+            if (strings.size() < 3) {
+                return false;
+            }
+            this->user = std::move(strings[0]);
+            this->workdir = std::move(strings[1]);
+            this->script = std::move(strings[2]);
+            this->environment.assign(strings.begin()+3, strings.end());
+            return true;
+        }
+
+    };
+
+    /**
+    Process spawned by the helper. Its exit is watched via the pidfd. The
+    helper does not reap the process until this object is destroyed, so that
+    the process ID (which is also the ID of the process group) is not reused
+    while VNCD may still signal the group.
+    */
+    class Child_process {
+
+    private:
+        sys::pid_type _id = -1;
+        sys::fildes _fd;
+        bool _group = true;
+
+    public:
+
+        Child_process() = default;
+
+        inline
+        Child_process(sys::pid_type id, sys::fd_type fd):
+        _id(id), _fd(fd) {}
+
+        inline
+        Child_process(Child_process&& rhs) noexcept:
+        _id(rhs._id), _fd(std::move(rhs._fd)), _group(rhs._group) {
+            rhs._id = -1;
+        }
+
+        inline Child_process&
+        operator=(Child_process&& rhs) noexcept {
+            Child_process tmp(std::move(rhs));
+            std::swap(this->_id, tmp._id);
+            std::swap(this->_fd, tmp._fd);
+            std::swap(this->_group, tmp._group);
+            return *this;
+        }
+
+        Child_process(const Child_process&) = delete;
+        Child_process& operator=(const Child_process&) = delete;
+
+        /// Asks the helper to reap the process.
+        inline ~Child_process();
+
+        inline sys::pid_type
+        id() const noexcept {
+            return this->_id;
+        }
+
+        inline sys::fd_type
+        fd() const noexcept {
+            return this->_fd.fd();
+        }
+
+        /**
+        Send the signal to the process and to its process group. The process
+        is the leader of its own session, so that the processes that the
+        script started in the background receive the signal as well. The
+        group is not signalled once it is known to be gone.
+        */
+        inline void
+        signal(int sig) {
+            if (this->_id == -1) {
+                return;
+            }
+            // the group does not exist until the process calls setsid;
+            // the unreaped leader keeps its ID from being reused
+            if (this->_group && ::kill(-this->_id, sig) == -1) {
+                if (errno != ESRCH) {
+                    UNISTDX_CHECK(-1);
+                }
+                if (this->exited()) {
+                    this->_group = false;
+                }
+            }
+            if (::syscall(SYS_pidfd_send_signal, this->fd(), sig, nullptr, 0) == -1 &&
+                errno != ESRCH) {
+                UNISTDX_CHECK(-1);
+            }
+        }
+
+        inline void
+        terminate() {
+            this->signal(SIGTERM);
+        }
+
+        /// Returns true if the process has exited.
+        inline bool
+        exited(int timeout_ms=0) const {
+            ::pollfd pfd{this->fd(), POLLIN, 0};
+            return ::poll(&pfd, 1, timeout_ms) == 1;
+        }
+
+    };
+
+    /**
+    Small helper process that is forked before VNCD opens any sockets and
+    spawns VNC servers and X sessions on its behalf. Forking the daemon itself
+    copies its page tables and descriptor table, which grows with the number of
+    sessions, and leaks the descriptors to user processes. The helper
+    spawns children with clone(CLONE_PIDFD) and returns the pidfd over Unix
+    socket right away; the child resolves the user's groups, closes all
+    descriptors on exec and executes the script. The helper reaps a child only
+    when VNCD asks for it (see \link reap\endlink), because the process group
+    of the child is signalled by its ID. The helper is not
+    restarted if it dies, because forking the multi-threaded daemon is what it
+    exists to avoid; VNCD watches \link pidfd\endlink and exits instead.
+    */
+    class Spawner {
+
+    public:
+        /// The descriptor number of the client's socket that is passed to the child.
+        static constexpr const int client_fd = 3;
+
+    private:
+        static constexpr const size_t max_message_size = 65536;
+
+        enum class Command: char {Spawn='s', Reap='r'};
+
+        struct Reply {
+            int32_t error;
+            int32_t pid;
+        };
+
+        /// Version 0 of the clone3 arguments.
+        struct Clone_args {
+            uint64_t flags;
+            uint64_t pidfd;
+            uint64_t child_tid;
+            uint64_t parent_tid;
+            uint64_t exit_signal;
+            uint64_t stack;
+            uint64_t stack_size;
+            uint64_t tls;
+        };
+
+    private:
+        sys::fildes _socket;
+        sys::pid_type _helper = -1;
+        sys::fildes _pidfd;
+        std::mutex _mutex;
+
+    public:
+
+        static inline Spawner&
+        instance() {
+            static Spawner spawner;
+            return spawner;
+        }
+
+        /**
+        Fork the helper process. The process must have only one thread:
+        the child of a multi-threaded process may deadlock on the locks that
+        other threads held at the time of the fork (e.g. in NSS or iostreams).
+        */
+        void
+        start() {
+            if (num_threads() > 1) {
+                throw std::logic_error("spawner helper is forked after the threads are started");
+            }
+            int fds[2];
+            UNISTDX_CHECK(::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+            auto pid = ::fork();
+            UNISTDX_CHECK(pid);
+            if (pid == 0) {
+                ::close(fds[0]);
+                serve(fds[1]);
+            }
+            ::close(fds[1]);
+            this->_socket = sys::fildes(fds[0]);
+            this->_helper = pid;
+            int fd = int(::syscall(SYS_pidfd_open, pid, 0));
+            UNISTDX_CHECK(fd);
+            this->_pidfd = sys::fildes(fd);
+        }
+
+        inline bool
+        started() const {
+            return this->_helper != -1;
+        }
+
+        /// The descriptor that becomes readable when the helper exits.
+        inline sys::fd_type
+        pidfd() const noexcept {
+            return this->_pidfd.fd();
+        }
+
+        /**
+        Spawn the process. Throws if the process was not created. If the
+        script can not be executed, the error is logged and the process exits
+        with status 127. If the client's socket is specified, it is inherited
+        by the process as descriptor number \link client_fd\endlink.
+        */
+        Child_process
+        spawn(const Spawn_request& request, sys::fd_type client=-1) {
+            std::string message(1, char(Command::Spawn));
+            message += request.serialize();
+            if (message.size() > max_message_size) {
+                throw std::invalid_argument("spawn request is too large");
+            }
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            if (!this->started()) {
+                throw std::logic_error("spawner is not started");
+            }
+            auto n = send_message(this->_socket.fd(), message.data(), message.size(), client);
+            UNISTDX_CHECK(n);
+            Reply reply{};
+            int fd = -1;
+            n = receive_message(this->_socket.fd(), &reply, sizeof(reply), fd);
+            UNISTDX_CHECK(n);
+            if (n != sizeof(reply)) {
+                throw std::runtime_error("spawner helper exited");
+            }
+            if (reply.error != 0) {
+                if (fd != -1) {
+                    ::close(fd);
+                }
+                throw std::system_error(reply.error, std::generic_category(), "spawn");
+            }
+            return Child_process(reply.pid, fd);
+        }
+
+        /**
+        Ask the helper to reap the child after it exits. The child must not be
+        signalled after this call. No reply is sent.
+        */
+        void
+        reap(sys::pid_type pid) {
+            char message[1+sizeof(int32_t)];
+            message[0] = char(Command::Reap);
+            int32_t id = int32_t(pid);
+            std::memcpy(message+1, &id, sizeof(id));
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            if (!this->started()) {
+                return;
+            }
+            send_message(this->_socket.fd(), message, sizeof(message), -1);
+        }
+
+    private:
+
+        Spawner() = default;
+
+        /// The number of entries in /proc/self/task (zero if it can not be read).
+        static size_t
+        num_threads() {
+            size_t n = 0;
+            if (auto* dir = ::opendir("/proc/self/task")) {
+                while (auto* entry = ::readdir(dir)) {
+                    if (entry->d_name[0] != '.') {
+                        ++n;
+                    }
+                }
+                ::closedir(dir);
+            }
+            return n;
+        }
+
+        /// Receive the message and the descriptor that is attached to it (if any).
+        static ssize_t
+        receive_message(int socket, void* data, size_t size, int& fd) {
+            ::iovec iov{data, size};
+            alignas(::cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            ::msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t n;
+            do {
+                n = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+            } while (n == -1 && errno == EINTR);
+            for (auto* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                    std::memcpy(&fd, CMSG_DATA(c), sizeof(int));
+                }
+            }
+            return n;
+        }
+
+        /// Send the message with the descriptor attached to it (unless it is -1).
+        static ssize_t
+        send_message(int socket, const void* data, size_t size, int fd) {
+            ::iovec iov{const_cast<void*>(data), size};
+            alignas(::cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            ::msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if (fd != -1) {
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                auto* c = CMSG_FIRSTHDR(&msg);
+                c->cmsg_level = SOL_SOCKET;
+                c->cmsg_type = SCM_RIGHTS;
+                c->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+            }
+            ssize_t n;
+            do {
+                n = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+            } while (n == -1 && errno == EINTR);
+            return n;
+        }
+
+        /// The main loop of the helper process.
+        [[noreturn]] static void
+        serve(int socket) {
+            // children are reaped on request, not automatically
+            ::signal(SIGCHLD, SIG_DFL);
+            close_other_descriptors(socket);
+            std::vector<char> buffer(max_message_size);
+            std::vector<sys::pid_type> zombies;
+            while (true) {
+                reap_children(zombies);
+                if (!zombies.empty()) {
+                    // the children that were asked to be reaped may still run
+                    ::pollfd pfd{socket, POLLIN, 0};
+                    if (::poll(&pfd, 1, 1000) == 0) {
+                        continue;
+                    }
+                }
+                int client = -1;
+                auto n = receive_message(socket, buffer.data(), buffer.size(), client);
+                if (n <= 0) {
+                    // VNCD has exited
+                    ::_exit(0);
+                }
+                if (buffer[0] == char(Command::Reap)) {
+                    int32_t pid = -1;
+                    if (size_t(n) == 1+sizeof(pid)) {
+                        std::memcpy(&pid, buffer.data()+1, sizeof(pid));
+                        zombies.emplace_back(pid);
+                    }
+                    if (client != -1) {
+                        ::close(client);
+                    }
+                    continue;
+                }
+                Spawn_request request;
+                Reply reply{EINVAL, -1};
+                int fd = -1;
+                if (buffer[0] == char(Command::Spawn) &&
+                    request.parse(buffer.data()+1, buffer.data()+n)) {
+                    reply.error = spawn_child(request, client, reply.pid, fd);
+                }
+                send_message(socket, &reply, sizeof(reply), fd);
+                for (int f : {fd, client}) {
+                    if (f != -1) {
+                        ::close(f);
+                    }
+                }
+            }
+        }
+
+        /// Reap the children that have exited and forget them.
+        static void
+        reap_children(std::vector<sys::pid_type>& zombies) {
+            auto first = zombies.begin();
+            while (first != zombies.end()) {
+                auto ret = ::waitpid(*first, nullptr, WNOHANG);
+                if (ret == 0 || (ret == -1 && errno == EINTR)) {
+                    ++first;
+                } else {
+                    first = zombies.erase(first);
+                }
+            }
+        }
+
+        static void
+        close_other_descriptors(int socket) {
+            for (int fd=3; fd<socket; ++fd) {
+                ::close(fd);
+            }
+            if (::syscall(SYS_close_range, unsigned(socket+1), ~0U, 0) == -1) {
+                for (int fd=socket+1; fd<1024; ++fd) {
+                    ::close(fd);
+                }
+            }
+        }
+
+        /**
+        Returns errno if the child was not created. The reply does not wait
+        for the child to execute the script, so that NSS lookups and exec
+        do not delay VNCD.
+        */
+        static int
+        spawn_child(const Spawn_request& r, int client, int32_t& pid, int& pidfd) {
+            int fd = -1;
+            Clone_args args{};
+            // the child is a copy of the small helper process, not of VNCD
+            args.flags = CLONE_PIDFD;
+            args.pidfd = uint64_t(reinterpret_cast<uintptr_t>(&fd));
+            args.exit_signal = SIGCHLD;
+            auto child = ::syscall(SYS_clone3, &args, sizeof(args));
+            if (child == 0) {
+                int err = child_main(r, client);
+                sys::log_message("spawner", "failed to execute _ for user _: _",
+                                 r.script, r.user, std::strerror(err));
+                ::_exit(127);
+            }
+            if (child == -1) {
+                return errno;
+            }
+            pid = int32_t(child);
+            pidfd = fd;
+            return 0;
+        }
+
+        /// Runs in the child; returns errno if the script was not executed.
+        static int
+        child_main(const Spawn_request& r, int client) {
+            ::sigset_t mask;
+            ::sigemptyset(&mask);
+            ::sigprocmask(SIG_SETMASK, &mask, nullptr);
+            for (int sig=1; sig<NSIG; ++sig) {
+                ::signal(sig, SIG_DFL);
+            }
+            // new session and process group that is terminated as a whole
+            if (::setsid() == -1) {
+                return errno;
+            }
+            if (::getuid() != r.uid || ::getgid() != r.gid) {
+                // supplementary groups are resolved here, because NSS may be slow
+                std::vector<gid_t> groups(64);
+                int ngroups = int(groups.size());
+                if (::getgrouplist(r.user.data(), r.gid, groups.data(), &ngroups) == -1) {
+                    groups.resize(size_t(ngroups));
+                    if (::getgrouplist(r.user.data(), r.gid, groups.data(), &ngroups) == -1) {
+                        return EINVAL;
+                    }
+                }
+                if (::setgroups(size_t(ngroups), groups.data()) == -1 ||
+                    ::setgid(r.gid) == -1 || ::setuid(r.uid) == -1) {
+                    return errno;
+                }
+            }
+            if (::chdir(r.workdir.data()) == -1 && ::chdir("/") == -1) {
+                return errno;
+            }
+            unsigned first = 3;
+            if (client != -1) {
+                // dup2 clears close-on-exec flag unless the descriptors are the same
+                if (client == client_fd ? ::fcntl(client, F_SETFD, 0) == -1
+                                        : ::dup2(client, client_fd) == -1) {
+                    return errno;
+                }
+                first = client_fd+1;
+            }
+            ::syscall(SYS_close_range, first, ~0U, CLOSE_RANGE_CLOEXEC);
+            std::vector<char*> argv{const_cast<char*>(r.script.data()), nullptr};
+            std::vector<char*> envp;
+            for (const auto& e : r.environment) {
+                envp.emplace_back(const_cast<char*>(e.data()));
+            }
+            envp.emplace_back(nullptr);
+            ::execvpe(argv[0], argv.data(), envp.data());
+            return errno;
+        }
+
+    };
+
+    inline
+    Child_process::~Child_process() {
+        if (this->_id != -1) {
+            Spawner::instance().reap(this->_id);
+        }
+    }
+
+}
+
+#endif // vim:filetype=cpp
@@ -4,24 +4,43 @@
 #define VNCD_TASK_HH
 
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
 namespace vncd {
 
     class Server;
+    class Timer_wheel;
 
     class Task {
 
     public:
-        typedef std::chrono::system_clock clock_type;
+        /// Monotonic clock: wall clock adjustments do not affect the timers.
+        typedef std::chrono::steady_clock clock_type;
         typedef clock_type::time_point time_point;
         typedef clock_type::duration duration;
 
+    private:
+        /// Intrusive list node of the timer wheel slot (not copied).
+        struct Link {
+            Task* prev = nullptr;
+            Task* next = nullptr;
+            uint64_t expires = 0;
+            unsigned slot = 0;
+            bool linked = false;
+            Link() = default;
+            Link(const Link&) {}
+            Link& operator=(const Link&) { return *this; }
+        };
+
     private:
         Server* _parent = nullptr;
         time_point _at{duration::zero()};
         duration _period{duration::zero()};
         int _nattempts = 1;
+        /// The object the task is tied to (e.g. a session).
+        const void* _owner = nullptr;
+        Link _link;
 
     public:
 
@@ -102,17 +121,20 @@ namespace vncd {
             return *this->_parent;
         }
 
-    };
+        /// The task is cancelled when its owner goes away.
+        inline void
+        owner(const void* rhs) {
+            this->_owner = rhs;
+        }
+
+        inline const void*
+        owner() const {
+            return this->_owner;
+        }
 
-    inline bool
-    operator<(const Task& a, const Task& b) {
-        return a.at() > b.at();
-    }
+        friend class Timer_wheel;
 
-    inline bool
-    operator<(const std::unique_ptr<Task>& a, const std::unique_ptr<Task>& b) {
-        return operator<(*a, *b);
-    }
+    };
 
 }
 
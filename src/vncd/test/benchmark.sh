@@ -0,0 +1,79 @@
+#!/bin/sh
+# Relay benchmark: VNCD spawns vnc-stub or rfb-stub instead of the VNC server
+# for each user of the benchmark group and vnc-load opens one connection per user.
+# Each mode is run with TCP and with Unix socket between VNCD and the stub,
+# and with the relay in the kernel (BPF sockmap). Finally, the round-trip time of
+# small messages and input-to-update latency are compared with the default
+# and with the low-latency socket options.
+# The benchmark needs root privileges and a group of benchmark users.
+#
+# usage: benchmark.sh VNCD VNC-STUB VNC-LOAD RFB-STUB
+# environment:
+#   VNCD_BENCH_GROUP  the group of benchmark users (required)
+#   VNCD_BENCH_PORT   base port (50000 by default)
+#   VNCD_LOAD_ARGS    additional arguments for vnc-load
+#   VNCD_STUB_RATE    bytes per second per session in stream mode
+#   VNCD_STUB_*       other variables of vnc-stub and rfb-stub
+
+set -e
+
+vncd="$1"
+stub="$2"
+load="$3"
+rfb_stub="$4"
+group="$VNCD_BENCH_GROUP"
+base_port="${VNCD_BENCH_PORT:-50000}"
+
+if test "$(id -u)" != 0 || test -z "$group"; then
+	echo "skipped: run as root with VNCD_BENCH_GROUP set to the group of benchmark users"
+	exit 77
+fi
+
+ports=
+for user in $(getent group "$group" | cut -d: -f4 | tr , ' '); do
+	ports="$ports $((base_port + $(id -u "$user")))"
+done
+if test -z "$ports"; then
+	echo "group $group has no members"
+	exit 1
+fi
+
+export VNCD_SESSION=/bin/true
+socket_directory=$(mktemp -d)
+trap 'rm -rf "$socket_directory"' EXIT
+vncd_args=
+
+run() {
+	mode="$1"
+	server="$2"
+	shift 2
+	echo "== $mode ${vncd_args:+($vncd_args)}"
+	VNCD_STUB_MODE="$mode" VNCD_SERVER="$server" \
+		"$vncd" -p "$base_port" -g "$group" $vncd_args 127.0.0.1 &
+	pid=$!
+	sleep 1
+	status=0
+	"$load" -p "$pid" $VNCD_LOAD_ARGS "$@" 127.0.0.1 $ports || status=$?
+	# the stubs of this run only: they are spawned by the helper process
+	# that is the only child of VNCD, and are orphaned when VNCD exits
+	helper=$(pgrep -P "$pid" | head -n 1)
+	servers=
+	if test -n "$helper"; then
+		servers=$(pgrep -x -P "$helper" "$(basename "$server")" || true)
+	fi
+	kill "$pid"
+	wait "$pid" || true
+	test -n "$servers" && kill $servers 2>/dev/null || true
+	return $status
+}
+
+for vncd_args in "" "-u $socket_directory" "-b"; do
+	run echo "$stub"
+	run stream "$stub" -s
+	run rfb "$rfb_stub" -r
+done
+
+for vncd_args in "-o default -O default" "-o low-latency -O low-latency"; do
+	run echo "$stub"
+	run rfb "$rfb_stub" -r
+done
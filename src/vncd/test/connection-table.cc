@@ -0,0 +1,163 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+#include <cstdint>
+#include <list>
+#include <set>
+
+#include <unistdx/base/check>
+
+#include <vncd/server.hh>
+#include <vncd/slab.hh>
+#include <vncd/test/test.hh>
+
+/**
+Checks the slab allocator of the connections and the server's connection
+table that is indexed by file descriptor: the slot generation that
+invalidates the events of the closed connections and the index by owner
+that removes the connections of the user.
+*/
+namespace vncd {
+
+    /// Eventfd that is polled like any other connection.
+    inline Connection*
+    make_connection(sys::uid_type owner=Connection::no_owner) {
+        auto* connection = new Fd_connection(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        UNISTDX_CHECK(connection->fd());
+        connection->owner(owner);
+        return connection;
+    }
+
+    void
+    test_slab() {
+        Slab slab(64, 4);
+        std::set<void*> blocks;
+        for (int i=0; i<10; ++i) {
+            auto* ptr = slab.allocate();
+            expect(uintptr_t(ptr) % alignof(void*) == 0, "alignment");
+            expect(blocks.insert(ptr).second, "the block is allocated twice");
+        }
+        auto* ptr = *blocks.begin();
+        slab.deallocate(ptr);
+        expect(slab.allocate() == ptr, "the freed block is not reused");
+        for (auto* p : blocks) {
+            slab.deallocate(p);
+        }
+    }
+
+    void
+    test_slab_arena() {
+        auto& arena = Slab_arena::instance();
+        // the sizes of the same class share the slab
+        auto* small = arena.allocate(1);
+        arena.deallocate(small, 1);
+        auto* same = arena.allocate(Slab_arena::granularity);
+        expect(same == small, "the size class is not reused");
+        arena.deallocate(same, Slab_arena::granularity);
+        auto* large = arena.allocate(Slab_arena::max_size+1);
+        expect(large != nullptr, "large object");
+        arena.deallocate(large, Slab_arena::max_size+1);
+        arena.deallocate(nullptr, 1);
+        std::list<int,Slab_allocator<int>> list;
+        for (int i=0; i<1000; ++i) {
+            list.push_back(i);
+        }
+        int expected = 0;
+        for (int x : list) {
+            expect_equal(x, expected++, "list element");
+        }
+    }
+
+    /// The slot of the closed connection's descriptor gets the next generation.
+    void
+    test_slot_generation() {
+        Server server;
+        auto* connection = make_connection(1000);
+        auto fd = connection->fd();
+        server.add(connection);
+        auto generation = server.generation(fd);
+        expect(server.find(fd, generation) == connection, "find");
+        expect(server.find(fd, generation+1) == nullptr, "find the next generation");
+        expect(server.find(-1, 0) == nullptr, "find negative descriptor");
+        expect(server.find(fd+1000, 0) == nullptr, "find descriptor out of range");
+        server.remove(1000);
+        expect(server.find(fd, generation) == nullptr, "find removed connection");
+        // the lowest descriptor is reused
+        auto* next = make_connection(1000);
+        expect_equal(next->fd(), fd, "descriptor");
+        server.add(next);
+        expect_equal(server.generation(fd), generation+1, "generation");
+        expect(server.find(fd, generation) == nullptr, "find the previous generation");
+        expect(server.find(fd, generation+1) == next, "find the new connection");
+    }
+
+    /// The descriptor that was closed behind the connection's back stays with the new one.
+    void
+    test_stale_slot() {
+        Server server;
+        auto* stale = make_connection(1000);
+        auto fd = stale->fd();
+        server.add(stale);
+        UNISTDX_CHECK(::close(fd));
+        auto* next = make_connection(1001);
+        expect_equal(next->fd(), fd, "descriptor");
+        server.add(next);
+        auto generation = server.generation(fd);
+        expect(::fcntl(fd, F_GETFD) != -1, "the descriptor of the new connection is closed");
+        server.remove(1000);
+        expect(server.find(fd, generation) == next, "removed by the stale owner");
+        server.remove(1001);
+        expect(server.find(fd, generation) == nullptr, "new connection is removed");
+    }
+
+    /// Only the connections of the user are removed.
+    void
+    test_remove_by_owner() {
+        Server server;
+        Connection* connections[] = {
+            make_connection(1000),
+            make_connection(1000),
+            make_connection(1001),
+            make_connection(),
+        };
+        sys::fd_type fds[4];
+        uint32_t generations[4];
+        for (int i=0; i<4; ++i) {
+            fds[i] = connections[i]->fd();
+            server.add(connections[i]);
+            generations[i] = server.generation(fds[i]);
+        }
+        server.remove(1000);
+        expect(server.find(fds[0], generations[0]) == nullptr, "first connection of the user");
+        expect(server.find(fds[1], generations[1]) == nullptr, "second connection of the user");
+        expect(server.find(fds[2], generations[2]) == connections[2], "other user");
+        expect(server.find(fds[3], generations[3]) == connections[3], "no owner");
+        // nothing is left to remove
+        server.remove(1000);
+        expect(server.find(fds[2], generations[2]) == connections[2], "other user");
+        server.remove(1001);
+        expect(server.find(fds[2], generations[2]) == nullptr, "other user is removed");
+        expect(server.find(fds[3], generations[3]) == connections[3], "no owner");
+        server.remove(Connection::no_owner);
+        expect(server.find(fds[3], generations[3]) == connections[3], "no owner is not a user");
+    }
+
+}
+
+int main() {
+    using namespace vncd;
+    bool ok = true;
+    ok &= run("slab", test_slab);
+    ok &= run("slab arena", test_slab_arena);
+    ok &= run("slot generation", test_slot_generation);
+    ok &= run("stale slot", test_stale_slot);
+    ok &= run("remove by owner", test_remove_by_owner);
+    return ok ? 0 : 1;
+}
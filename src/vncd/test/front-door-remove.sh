@@ -0,0 +1,97 @@
+#!/bin/sh
+# Single port mode: the session of a user that is removed from the group has
+# to be terminated (the client is disconnected and the VNC server exits)
+# without waiting for the client to disconnect. The test creates a temporary
+# group with the specified user, logs in via the front door with rfb-login
+# (rfb-stub is the VNC server) and removes the user from the group.
+# The test needs root privileges and an unprivileged user (UID >= 1000).
+#
+# usage: front-door-remove.sh VNCD RFB-STUB RFB-LOGIN
+# environment:
+#   VNCD_TEST_USER  the user that logs in (required)
+#   VNCD_TEST_PORT  single port (55900 by default)
+
+set -e
+
+vncd="$1"
+rfb_stub="$2"
+login="$3"
+user="$VNCD_TEST_USER"
+port="${VNCD_TEST_PORT:-55900}"
+timeout=10
+
+if test "$(id -u)" != 0 || test -z "$user"; then
+	echo "skipped: run as root with VNCD_TEST_USER set to an unprivileged user"
+	exit 77
+fi
+
+group=vncd-test-$$
+workdir=$(mktemp -d)
+vncd_pid=
+# VNC servers of this test only: they are spawned by the helper process
+# that is the only child of VNCD (exited servers are not counted)
+vnc_servers() {
+	test -n "$vncd_pid" || return 0
+	helper=$(pgrep -P "$vncd_pid" | head -n 1)
+	test -n "$helper" || return 0
+	for pid in $(pgrep -x -P "$helper" "$(basename "$rfb_stub")"); do
+		case "$(ps -o stat= -p "$pid")" in
+			Z*|'') ;;
+			*) echo "$pid" ;;
+		esac
+	done
+}
+cleanup() {
+	# the servers are orphaned when VNCD exits
+	servers=$(vnc_servers)
+	test -n "$vncd_pid" && kill "$vncd_pid" 2>/dev/null || true
+	test -n "$servers" && kill $servers 2>/dev/null || true
+	groupdel "$group" 2>/dev/null || true
+	rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+groupadd "$group"
+gpasswd -a "$user" "$group" >/dev/null
+export VNCD_SERVER="$rfb_stub"
+export VNCD_SESSION=/bin/true
+"$vncd" -s "$port" -u "$workdir" -g "$group" 127.0.0.1 &
+vncd_pid=$!
+sleep 1
+
+"$login" "$user" 127.0.0.1 "$port" "$timeout" > "$workdir/login.log" 2>&1 &
+login_pid=$!
+i=0
+while ! grep -q "logged in" "$workdir/login.log"; do
+	i=$((i+1))
+	if test "$i" -gt "$timeout" || ! kill -0 "$login_pid" 2>/dev/null; then
+		cat "$workdir/login.log"
+		echo "FAIL: login"
+		exit 1
+	fi
+	sleep 1
+done
+if test -z "$(vnc_servers)"; then
+	echo "FAIL: VNC server is not running"
+	exit 1
+fi
+
+# the change in /etc/group is picked up via inotify
+gpasswd -d "$user" "$group" >/dev/null
+status=0
+wait "$login_pid" || status=$?
+cat "$workdir/login.log"
+if test "$status" != 0; then
+	echo "FAIL: the client of the removed user was not disconnected"
+	exit 1
+fi
+i=0
+while test -n "$(vnc_servers)"; do
+	i=$((i+1))
+	if test "$i" -gt "$timeout"; then
+		echo "FAIL: VNC server of the removed user is still running"
+		exit 1
+	fi
+	sleep 1
+done
+echo "OK"
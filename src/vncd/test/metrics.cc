@@ -0,0 +1,141 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <vncd/metrics.hh>
+#include <vncd/test/test.hh>
+
+/**
+Checks the bucket math of the log-linear histogram: the quantile of any
+recorded value is within the relative error of 1/16 above the value and
+falls into the same bucket, and the quantiles of many values are ranked
+correctly. Also checks that label values are escaped in the text format.
+*/
+namespace vncd {
+
+    /// The quantile of the histogram with only one value.
+    inline uint64_t
+    bucket_bound(uint64_t value) {
+        Histogram h;
+        h.record(value);
+        std::vector<uint64_t> counts;
+        h.add_to(counts);
+        return Histogram::quantile(counts, 0.5);
+    }
+
+    inline std::vector<uint64_t>
+    bucket_counts(uint64_t value) {
+        Histogram h;
+        h.record(value);
+        std::vector<uint64_t> counts;
+        h.add_to(counts);
+        return counts;
+    }
+
+    void
+    test_buckets() {
+        std::vector<uint64_t> values;
+        for (uint64_t v=0; v<5000; ++v) {
+            values.emplace_back(v);
+        }
+        for (unsigned bit=13; bit<40; ++bit) {
+            auto p = uint64_t(1) << bit;
+            for (auto v : {p-1, p, p+1, p + p/3}) {
+                values.emplace_back(v);
+            }
+        }
+        uint64_t previous = 0;
+        for (auto v : values) {
+            auto bound = bucket_bound(v);
+            auto s = std::to_string(v);
+            expect(bound >= v, "the bound is less than the value " + s);
+            expect(bound - v <= v/16, "the relative error is too large for " + s);
+            expect(bound >= previous, "the bounds are not monotonic at " + s);
+            expect(bucket_counts(bound) == bucket_counts(v),
+                   "the bound is in another bucket for " + s);
+            previous = bound;
+        }
+        // the values below 16 are exact
+        for (uint64_t v=0; v<16; ++v) {
+            expect_equal(bucket_bound(v), v, "small value");
+        }
+    }
+
+    void
+    test_clamp() {
+        const uint64_t max_value = (uint64_t(1) << 40) - 1;
+        expect_equal(bucket_bound(max_value), max_value, "the largest value");
+        expect_equal(bucket_bound(uint64_t(1) << 50), max_value, "clamped value");
+        Histogram h;
+        h.record(uint64_t(1) << 50);
+        expect_equal(h.sum(), max_value, "the sum of clamped values");
+    }
+
+    void
+    test_quantiles() {
+        Histogram h;
+        std::vector<uint64_t> counts;
+        expect_equal(Histogram::quantile(counts, 0.5), 0u, "the quantile of no values");
+        for (uint64_t v=1; v<=1000; ++v) {
+            h.record(v);
+        }
+        expect_equal(h.count(), 1000u, "count");
+        expect_equal(h.sum(), 500500u, "sum");
+        h.add_to(counts);
+        expect_equal(Histogram::quantile(counts, 0.5), bucket_bound(500), "median");
+        expect_equal(Histogram::quantile(counts, 0.99), bucket_bound(990), "99th percentile");
+        expect_equal(Histogram::quantile(counts, 1.0), bucket_bound(1000), "maximum");
+        expect_equal(Histogram::quantile(counts, 0.0), bucket_bound(1), "minimum");
+        // the histograms of the shards are merged
+        Histogram other;
+        other.record(uint64_t(1) << 30);
+        other.add_to(counts);
+        expect_equal(Histogram::quantile(counts, 1.0), bucket_bound(uint64_t(1) << 30),
+                     "maximum of merged histograms");
+    }
+
+    void
+    test_durations() {
+        using namespace std::chrono;
+        Histogram h;
+        h.record(milliseconds(3));
+        h.record(nanoseconds(1500));
+        h.record(microseconds(-5));
+        expect_equal(h.count(), 3u, "count");
+        expect_equal(h.sum(), 3001u, "the sum in microseconds");
+    }
+
+    void
+    test_label_escaping() {
+        Session_metrics m;
+        m.user = "a\\b\"c\nd";
+        m[Direction::Upstream].add(1, 1, 0);
+        auto& registry = Metrics_registry::instance();
+        registry.add(&m);
+        auto text = registry.text();
+        registry.remove(&m);
+        auto line = "vncd_session_bytes_total{user=\"a\\\\b\\\"c\\nd\",session=\"" +
+            std::to_string(m.id) + "\",direction=\"upstream\"} 1\n";
+        expect(text.find(line) != std::string::npos, "the label is not escaped: " + text);
+    }
+
+}
+
+int main() {
+    using namespace vncd;
+    bool ok = true;
+    ok &= run("buckets", test_buckets);
+    ok &= run("clamp", test_clamp);
+    ok &= run("quantiles", test_quantiles);
+    ok &= run("durations", test_durations);
+    ok &= run("label escaping", test_label_escaping);
+    return ok ? 0 : 1;
+}
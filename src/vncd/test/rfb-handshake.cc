@@ -0,0 +1,195 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <sys/socket.h>
+
+#include <string>
+#include <utility>
+
+#include <unistdx/base/check>
+#include <unistdx/net/socket>
+
+#include <vncd/rfb.hh>
+#include <vncd/test/test.hh>
+
+/**
+Checks the state machines of RFB handshakes over a pair of non-blocking Unix
+sockets: the server side that receives the credentials from VNC client,
+the client side that replays them to the local VNC server, and that neither
+of them reads past the end of the handshake.
+*/
+namespace vncd {
+
+    typedef std::pair<sys::socket,sys::socket> socket_pair;
+
+    inline socket_pair
+    make_socket_pair() {
+        int fds[2];
+        UNISTDX_CHECK(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                   0, fds));
+        return socket_pair(sys::socket(fds[0]), sys::socket(fds[1]));
+    }
+
+    inline void
+    write_all(sys::socket& socket, const std::string& data) {
+        expect_equal(socket.write(data.data(), data.size()), ssize_t(data.size()), "write");
+    }
+
+    /// Reads everything that is available without blocking.
+    inline std::string
+    read_all(sys::socket& socket) {
+        std::string result;
+        char buf[512];
+        ssize_t n;
+        while ((n = socket.read(buf, sizeof(buf))) > 0) {
+            result.append(buf, size_t(n));
+        }
+        return result;
+    }
+
+    inline Rfb_credentials
+    make_credentials(Rfb_security security) {
+        Rfb_credentials c;
+        c.version = "RFB 003.008\n";
+        c.user = "alice";
+        c.password = "secret";
+        c.security = security;
+        return c;
+    }
+
+    /// UnixLogin message with the credentials.
+    inline std::string
+    unix_login(const std::string& user, const std::string& password) {
+        std::string message{char(Rfb_security::Unix_login)};
+        rfb_append_u32(message, uint32_t(user.size()));
+        rfb_append_u32(message, uint32_t(password.size()));
+        return message + user + password;
+    }
+
+    /// Runs both sides of the handshake until neither of them makes progress.
+    inline void
+    run_handshakes(Rfb_server_handshake& server, Rfb_client_handshake& client) {
+        auto sockets = make_socket_pair();
+        for (int i=0; i<100 && (server.running() || client.running()); ++i) {
+            server.process(sockets.first);
+            client.process(sockets.second);
+        }
+    }
+
+    void
+    test_unix_login() {
+        auto credentials = make_credentials(Rfb_security::Unix_login);
+        Rfb_server_handshake server;
+        Rfb_client_handshake client(credentials);
+        run_handshakes(server, client);
+        expect(server.finished(), server.reason());
+        expect(client.finished(), client.reason());
+        const auto& c = server.credentials();
+        expect_equal(c.version, credentials.version, "version");
+        expect_equal(c.user, credentials.user, "user");
+        expect_equal(c.password, credentials.password, "password");
+        expect(c.security == Rfb_security::Unix_login, "security type");
+    }
+
+    void
+    test_vencrypt_plain() {
+        auto credentials = make_credentials(Rfb_security::VeNCrypt);
+        Rfb_server_handshake server;
+        Rfb_client_handshake client(credentials);
+        run_handshakes(server, client);
+        expect(server.finished(), server.reason());
+        expect(client.finished(), client.reason());
+        const auto& c = server.credentials();
+        expect_equal(c.user, credentials.user, "user");
+        expect_equal(c.password, credentials.password, "password");
+        expect(c.security == Rfb_security::VeNCrypt, "security type");
+    }
+
+    /// The bytes that follow the credentials belong to the VNC server.
+    void
+    test_exact_read() {
+        auto sockets = make_socket_pair();
+        Rfb_server_handshake server;
+        write_all(sockets.second, "RFB 003.007\n" + unix_login("bob", "") + "tail");
+        server.process(sockets.first);
+        expect(server.finished(), server.reason());
+        expect_equal(server.credentials().user, "bob", "user");
+        expect_equal(server.credentials().password, "", "password");
+        expect_equal(read_all(sockets.first), "tail", "the rest of the stream");
+    }
+
+    /// The messages may arrive in any number of pieces.
+    void
+    test_byte_by_byte() {
+        auto sockets = make_socket_pair();
+        Rfb_server_handshake server;
+        auto stream = "RFB 003.008\n" + unix_login("carol", "password");
+        for (char ch : stream) {
+            expect(server.running(), "finished early");
+            write_all(sockets.second, std::string(1, ch));
+            server.process(sockets.first);
+        }
+        expect(server.finished(), server.reason());
+        expect_equal(server.credentials().user, "carol", "user");
+        expect_equal(server.credentials().password, "password", "password");
+    }
+
+    void
+    test_server_failures() {
+        struct { const char* name; std::string stream; } cases[] = {
+            {"old version", "RFB 003.003\n"},
+            {"unknown security type", "RFB 003.008\n" + std::string(1, char(2))},
+            {"empty user", "RFB 003.008\n" + unix_login("", "password")},
+            {"long user", "RFB 003.008\n" + unix_login(std::string(257, 'u'), "")},
+        };
+        for (const auto& c : cases) {
+            auto sockets = make_socket_pair();
+            Rfb_server_handshake server;
+            write_all(sockets.second, c.stream);
+            server.process(sockets.first);
+            expect(server.failed(), c.name);
+        }
+    }
+
+    void
+    test_client_failures() {
+        auto version = std::string("RFB 003.008\n");
+        struct { const char* name; Rfb_security security; std::string stream; } cases[] = {
+            {"bad version", Rfb_security::Unix_login, "HTTP/1.1 200"},
+            {"connection refused", Rfb_security::Unix_login, version + char(0)},
+            {"security type is not offered", Rfb_security::Unix_login,
+             version + char(1) + char(Rfb_security::VeNCrypt)},
+            {"VeNCrypt version is not supported", Rfb_security::VeNCrypt,
+             version + char(1) + char(Rfb_security::VeNCrypt) + char(0) + char(2) + char(1)},
+        };
+        for (const auto& c : cases) {
+            auto sockets = make_socket_pair();
+            Rfb_client_handshake client(make_credentials(c.security));
+            write_all(sockets.second, c.stream);
+            client.process(sockets.first);
+            expect(client.failed(), c.name);
+        }
+        auto sockets = make_socket_pair();
+        sockets.second.close();
+        Rfb_client_handshake client(make_credentials(Rfb_security::Unix_login));
+        client.process(sockets.first);
+        expect(client.failed(), "connection closed");
+    }
+
+}
+
+int main() {
+    using namespace vncd;
+    bool ok = true;
+    ok &= run("unix login", test_unix_login);
+    ok &= run("vencrypt plain", test_vencrypt_plain);
+    ok &= run("exact read", test_exact_read);
+    ok &= run("byte by byte", test_byte_by_byte);
+    ok &= run("server failures", test_server_failures);
+    ok &= run("client failures", test_client_failures);
+    return ok ? 0 : 1;
+}
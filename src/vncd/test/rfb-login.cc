@@ -0,0 +1,177 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <unistdx/base/check>
+#include <unistdx/io/fildes>
+
+#include <vncd/rfb.hh>
+
+/**
+Minimal VNC viewer for the tests of single port mode. It logs in as the
+specified user via UnixLogin security type (the password is empty, so the
+VNC server has to be rfb-stub that does not check it), waits for ServerInit
+and then waits until the connection is closed by VNCD.
+Exits with zero status if the connection was closed within the timeout.
+*/
+namespace vncd {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    class Login {
+
+    private:
+        sys::fildes _socket;
+        clock_type::time_point _deadline;
+
+    public:
+
+        inline explicit
+        Login(const std::string& host, uint16_t port) {
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            UNISTDX_CHECK(fd);
+            this->_socket = sys::fildes(fd);
+            ::sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            if (::inet_pton(AF_INET, host.data(), &address.sin_addr) != 1) {
+                throw std::invalid_argument("bad address");
+            }
+            UNISTDX_CHECK(::connect(fd, reinterpret_cast<const ::sockaddr*>(&address),
+                                    sizeof(address)));
+        }
+
+        void
+        login(const std::string& user, std::chrono::seconds timeout) {
+            this->_deadline = clock_type::now() + timeout;
+            auto version = this->read(12);
+            if (version.compare(0, 4, "RFB ") != 0) {
+                throw std::runtime_error("bad protocol version");
+            }
+            this->write("RFB 003.008\n");
+            auto types = this->read(size_t(uint8_t(this->read(1)[0])));
+            if (types.find(char(Rfb_security::Unix_login)) == std::string::npos) {
+                throw std::runtime_error("UnixLogin is not offered");
+            }
+            std::string message{char(Rfb_security::Unix_login)};
+            rfb_append_u32(message, uint32_t(user.size()));
+            rfb_append_u32(message, 0);
+            message += user;
+            this->write(message);
+            if (rfb_u32(this->read(4).data()) != 0) {
+                throw std::runtime_error("authentication failed");
+            }
+            // shared session
+            this->write(std::string{char(1)});
+            auto init = this->read(24);
+            this->read(rfb_u32(init.data()+20));
+        }
+
+        /// Returns true if the connection was closed within the timeout.
+        bool
+        wait_for_close(std::chrono::seconds timeout) {
+            this->_deadline = clock_type::now() + timeout;
+            char buffer[4096];
+            while (this->wait()) {
+                auto n = ::read(this->_socket.fd(), buffer, sizeof(buffer));
+                if (n == 0 || (n == -1 && errno == ECONNRESET)) {
+                    return true;
+                }
+                UNISTDX_CHECK(n);
+            }
+            return false;
+        }
+
+    private:
+
+        /// Returns false on timeout.
+        bool
+        wait() {
+            using std::chrono::duration_cast;
+            using std::chrono::milliseconds;
+            auto left = duration_cast<milliseconds>(this->_deadline - clock_type::now());
+            if (left.count() <= 0) {
+                return false;
+            }
+            ::pollfd pfd{this->_socket.fd(), POLLIN, 0};
+            int ret = ::poll(&pfd, 1, int(left.count()));
+            UNISTDX_CHECK(ret);
+            return ret == 1;
+        }
+
+        std::string
+        read(size_t n) {
+            std::string s(n, '\0');
+            size_t offset = 0;
+            while (offset != n) {
+                if (!this->wait()) {
+                    throw std::runtime_error("handshake timed out");
+                }
+                auto m = ::read(this->_socket.fd(), &s[offset], n-offset);
+                UNISTDX_CHECK(m);
+                if (m == 0) {
+                    throw std::runtime_error("connection closed during handshake");
+                }
+                offset += size_t(m);
+            }
+            return s;
+        }
+
+        void
+        write(const std::string& s) {
+            size_t offset = 0;
+            while (offset != s.size()) {
+                auto m = ::write(this->_socket.fd(), s.data()+offset, s.size()-offset);
+                UNISTDX_CHECK(m);
+                offset += size_t(m);
+            }
+        }
+
+    };
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace vncd;
+    if (argc != 5) {
+        std::cerr << "usage: " << argv[0] << " USER HOST PORT TIMEOUT\n";
+        return 1;
+    }
+    try {
+        uint16_t port = 0;
+        long timeout = 0;
+        if (!(std::stringstream(argv[3]) >> port) ||
+            !(std::stringstream(argv[4]) >> timeout) || timeout <= 0) {
+            throw std::invalid_argument("bad port or timeout");
+        }
+        Login login(argv[2], port);
+        login.login(argv[1], std::chrono::seconds(timeout));
+        std::cout << "logged in" << std::endl;
+        if (!login.wait_for_close(std::chrono::seconds(timeout))) {
+            std::cout << "the connection is still open" << std::endl;
+            return 1;
+        }
+        std::cout << "the connection was closed" << std::endl;
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
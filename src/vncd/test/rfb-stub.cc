@@ -0,0 +1,473 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistdx/base/check>
+#include <unistdx/base/log_message>
+#include <unistdx/io/poller>
+#include <unistdx/net/socket>
+#include <unistdx/net/socket_address>
+
+#include <vncd/port.hh>
+#include <vncd/rfb.hh>
+#include <vncd/test/stub.hh>
+
+/**
+Synthetic VNC server for benchmarks. It implements enough of RFB 3.8
+(security types None, VeNCrypt Plain and UnixLogin without checking the
+password, SetPixelFormat, SetEncodings, FramebufferUpdateRequest) to send
+FramebufferUpdate messages of the specified size at the specified frame rate
+while the client requests them, i.e. the traffic is small input events from
+the client and large bursty updates from the server, like with Xvnc.
+It is started by VNCD as the server script and is configured via environment
+variables.
+- VNCD_STUB_GEOMETRY: framebuffer size (1920x1080 by default).
+- VNCD_STUB_UPDATE_SIZE: the size of pixel data in each update in bytes
+  (64 KiB by default, at most the size of the framebuffer).
+- VNCD_STUB_FPS: the maximal no. of updates per second (30 by default).
+The stub listens on VNCD_SOCKET Unix socket if VNCD runs with -u option
+and on VNCD_PORT otherwise.
+*/
+namespace vncd {
+
+    inline void
+    rfb_append_u16(std::string& s, uint16_t x) {
+        s += char((x >> 8) & 0xff);
+        s += char(x & 0xff);
+    }
+
+    inline uint16_t
+    rfb_u16(const char* s) {
+        auto* p = reinterpret_cast<const unsigned char*>(s);
+        return uint16_t((unsigned(p[0]) << 8) | unsigned(p[1]));
+    }
+
+    /// RFB client message types.
+    enum class Rfb_message: uint8_t {
+        Set_pixel_format = 0,
+        Set_encodings = 2,
+        Framebuffer_update_request = 3,
+        Key_event = 4,
+        Pointer_event = 5,
+        Client_cut_text = 6,
+    };
+
+    class Server {
+
+    private:
+        typedef std::chrono::steady_clock clock_type;
+        typedef clock_type::time_point time_point;
+        typedef clock_type::duration duration;
+
+        enum class State {
+            Version,
+            Security_type,
+            VeNCrypt_version,
+            VeNCrypt_subtype,
+            Credentials,
+            Client_init,
+            Messages,
+        };
+
+        struct Client {
+            sys::socket socket;
+            State state = State::Version;
+            std::string version;
+            std::string input;
+            std::string output;
+            size_t offset = 0;
+            bool writable = true;
+            /// The client is waiting for the update.
+            bool update_requested = false;
+            bool incremental = true;
+            time_point last_update{};
+            /// Bytes per pixel.
+            size_t bpp = 4;
+            uint64_t nupdates = 0;
+        };
+
+    private:
+        sys::socket _server{sys::family_type::inet};
+        sys::event_poller _poller;
+        std::unordered_map<sys::fd_type,Client> _clients;
+        std::vector<char> _buffer;
+        /// Synthetic pixel data.
+        std::string _pixels;
+        uint16_t _width = 1920;
+        uint16_t _height = 1080;
+        size_t _update_size = 65536;
+        duration _frame_interval;
+
+    public:
+
+        Server(): _buffer(4096*4) {
+            this->parse_geometry();
+            this->_update_size = environment_number("VNCD_STUB_UPDATE_SIZE", 65536, 1);
+            this->_frame_interval = std::chrono::duration_cast<duration>(
+                std::chrono::duration<double>(1.0/double(environment_number("VNCD_STUB_FPS", 30, 1)))
+            );
+            if (const char* path = std::getenv("VNCD_SOCKET")) {
+                sys::log_message("rfb-stub", "listen _ geometry _x_ update size _",
+                                 path, this->_width, this->_height, this->_update_size);
+                this->_server = listen_unix(path);
+            } else {
+                const char* str = std::getenv("VNCD_PORT");
+                if (!str) {
+                    throw std::invalid_argument("bad vnc port");
+                }
+                Port port;
+                str >> port;
+                sys::socket_address address{sys::ipv4_socket_address{{127,0,0,1},port}};
+                sys::log_message("rfb-stub", "listen _ geometry _x_ update size _",
+                                 address, this->_width, this->_height, this->_update_size);
+                this->_server.set(sys::socket::options::reuse_address);
+                this->_server.bind(address);
+                this->_server.listen();
+            }
+            this->_poller.emplace(this->_server.fd(), sys::event::in);
+        }
+
+        void
+        run() {
+            No_lock lock;
+            const auto timeout = std::chrono::milliseconds(1);
+            while (true) {
+                this->_poller.wait_for(lock, timeout);
+                this->process_events();
+                this->send_updates();
+            }
+        }
+
+    private:
+
+        void
+        parse_geometry() {
+            const char* str = std::getenv("VNCD_STUB_GEOMETRY");
+            if (!str) {
+                return;
+            }
+            std::stringstream tmp(str);
+            unsigned width = 0, height = 0;
+            char x = 0;
+            if (!(tmp >> width >> x >> height) || x != 'x' ||
+                width == 0 || height == 0 || width > 0xffff || height > 0xffff) {
+                throw std::invalid_argument("bad VNCD_STUB_GEOMETRY");
+            }
+            this->_width = uint16_t(width);
+            this->_height = uint16_t(height);
+        }
+
+        void
+        process_events() {
+            for (const auto& event : this->_poller) {
+                if (event.fd() == this->_server.fd()) {
+                    this->accept();
+                    continue;
+                }
+                auto result = this->_clients.find(event.fd());
+                if (result == this->_clients.end()) {
+                    continue;
+                }
+                auto& client = result->second;
+                bool ok = true;
+                if (event.in()) {
+                    ok = this->read(client);
+                }
+                if (event.out()) {
+                    client.writable = true;
+                }
+                if (!ok || event.bad()) {
+                    sys::log_message("rfb-stub", "connection closed after _ updates",
+                                     client.nupdates);
+                    this->erase(event.fd());
+                    continue;
+                }
+                this->write(client);
+            }
+        }
+
+        void
+        accept() {
+            sys::socket socket;
+            sys::socket_address address;
+            while (this->_server.accept(socket, address)) {
+                sys::log_message("rfb-stub", "accepted connection from _", address);
+                auto fd = socket.fd();
+                auto& client = this->_clients[fd];
+                client.socket = std::move(socket);
+                client.output = "RFB 003.008\n";
+                // edge-triggered: the socket is read and written until EAGAIN
+                this->_poller.emplace(
+                    fd,
+                    static_cast<sys::event>(EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+                );
+                this->write(client);
+            }
+        }
+
+        /// Returns false on end of file or protocol error.
+        bool
+        read(Client& client) {
+            ssize_t n;
+            while ((n = client.socket.read(this->_buffer.data(), this->_buffer.size())) > 0) {
+                client.input.append(this->_buffer.data(), size_t(n));
+                if (!this->parse(client)) {
+                    return false;
+                }
+            }
+            return n != 0;
+        }
+
+        /// Process all complete messages in the input buffer.
+        bool
+        parse(Client& client) {
+            size_t first = 0;
+            while (true) {
+                const char* s = client.input.data() + first;
+                const size_t size = client.input.size() - first;
+                const size_t n = this->message_size(client, s, size);
+                if (n == 0 || n > size) {
+                    break;
+                }
+                if (!this->receive(client, s, n)) {
+                    return false;
+                }
+                first += n;
+            }
+            client.input.erase(0, first);
+            return true;
+        }
+
+        /// The size of the next message or zero if it is not known yet.
+        size_t
+        message_size(const Client& client, const char* s, size_t size) const {
+            switch (client.state) {
+                case State::Version: return 12;
+                case State::Security_type: return 1;
+                case State::VeNCrypt_version: return 2;
+                case State::VeNCrypt_subtype: return 4;
+                case State::Credentials:
+                    return size < 8 ? 0 : 8 + rfb_u32(s) + rfb_u32(s+4);
+                case State::Client_init: return 1;
+                case State::Messages: break;
+            }
+            if (size == 0) {
+                return 0;
+            }
+            switch (Rfb_message(uint8_t(s[0]))) {
+                case Rfb_message::Set_pixel_format: return 20;
+                case Rfb_message::Set_encodings:
+                    return size < 4 ? 0 : 4 + 4*size_t(rfb_u16(s+2));
+                case Rfb_message::Framebuffer_update_request: return 10;
+                case Rfb_message::Key_event: return 8;
+                case Rfb_message::Pointer_event: return 6;
+                case Rfb_message::Client_cut_text:
+                    return size < 8 ? 0 : 8 + size_t(rfb_u32(s+4));
+                default: return 1;
+            }
+        }
+
+        bool
+        receive(Client& client, const char* s, size_t n) {
+            switch (client.state) {
+                case State::Version:
+                    client.version.assign(s, n);
+                    if (client.version == "RFB 003.003\n") {
+                        // the server chooses security type
+                        rfb_append_u32(client.output, 1);
+                        client.state = State::Client_init;
+                    } else {
+                        client.output += {char(3), char(1), char(Rfb_security::VeNCrypt),
+                                          char(Rfb_security::Unix_login)};
+                        client.state = State::Security_type;
+                    }
+                    break;
+                case State::Security_type:
+                    switch (uint8_t(s[0])) {
+                        case 1:
+                            this->security_result(client);
+                            break;
+                        case uint8_t(Rfb_security::VeNCrypt):
+                            client.output += {char(0), char(2)};
+                            client.state = State::VeNCrypt_version;
+                            break;
+                        case uint8_t(Rfb_security::Unix_login):
+                            client.state = State::Credentials;
+                            break;
+                        default:
+                            sys::log_message("rfb-stub", "unsupported security type");
+                            return false;
+                    }
+                    break;
+                case State::VeNCrypt_version:
+                    client.output += char(0);
+                    client.output += char(1);
+                    rfb_append_u32(client.output, rfb_vencrypt_plain);
+                    client.state = State::VeNCrypt_subtype;
+                    break;
+                case State::VeNCrypt_subtype:
+                    client.state = State::Credentials;
+                    break;
+                case State::Credentials:
+                    // the password is not checked
+                    this->security_result(client);
+                    break;
+                case State::Client_init:
+                    this->server_init(client);
+                    client.state = State::Messages;
+                    break;
+                case State::Messages:
+                    this->client_message(client, s);
+                    break;
+            }
+            return true;
+        }
+
+        void
+        security_result(Client& client) {
+            if (client.version == "RFB 003.008\n") {
+                rfb_append_u32(client.output, 0);
+            }
+            client.state = State::Client_init;
+        }
+
+        void
+        server_init(Client& client) {
+            const std::string name = "vncd-rfb-stub";
+            auto& out = client.output;
+            rfb_append_u16(out, this->_width);
+            rfb_append_u16(out, this->_height);
+            // 32 bits per pixel, depth 24, little endian, true colour
+            out += {char(32), char(24), char(0), char(1)};
+            rfb_append_u16(out, 255);
+            rfb_append_u16(out, 255);
+            rfb_append_u16(out, 255);
+            out += {char(16), char(8), char(0), char(0), char(0), char(0)};
+            rfb_append_u32(out, uint32_t(name.size()));
+            out += name;
+        }
+
+        void
+        client_message(Client& client, const char* s) {
+            switch (Rfb_message(uint8_t(s[0]))) {
+                case Rfb_message::Set_pixel_format:
+                    client.bpp = std::max(size_t(1), size_t(uint8_t(s[4]))/8);
+                    break;
+                case Rfb_message::Framebuffer_update_request:
+                    client.update_requested = true;
+                    client.incremental = client.incremental && s[1] != 0;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        /// Send updates to the clients that requested them when the frame interval has elapsed.
+        void
+        send_updates() {
+            const auto now = clock_type::now();
+            for (auto& pair : this->_clients) {
+                auto& client = pair.second;
+                if (!client.update_requested || client.offset != client.output.size()) {
+                    continue;
+                }
+                if (client.incremental && now - client.last_update < this->_frame_interval) {
+                    continue;
+                }
+                this->framebuffer_update(client);
+                client.update_requested = false;
+                client.incremental = true;
+                client.last_update = now;
+                this->write(client);
+            }
+        }
+
+        /**
+        Single raw-encoded rectangle that spans the full width of the framebuffer.
+        Its height is chosen so that the pixel data is close to the update size.
+        The rectangle moves down with each update.
+        */
+        void
+        framebuffer_update(Client& client) {
+            const size_t row = size_t(this->_width)*client.bpp;
+            const size_t height = std::min(
+                size_t(this->_height),
+                std::max(size_t(1), this->_update_size/row)
+            );
+            const size_t nbytes = row*height;
+            if (this->_pixels.size() < nbytes) {
+                this->_pixels.resize(nbytes);
+                for (size_t i=0; i<nbytes; ++i) {
+                    this->_pixels[i] = char((i*2654435761u) >> 24);
+                }
+            }
+            const size_t y = (client.nupdates*height) % (this->_height - height + 1);
+            auto& out = client.output;
+            out.clear();
+            client.offset = 0;
+            out += {char(0), char(0)};
+            rfb_append_u16(out, 1);
+            rfb_append_u16(out, 0);
+            rfb_append_u16(out, uint16_t(y));
+            rfb_append_u16(out, this->_width);
+            rfb_append_u16(out, uint16_t(height));
+            rfb_append_u32(out, 0); // raw encoding
+            out.append(this->_pixels.data(), nbytes);
+            ++client.nupdates;
+        }
+
+        void
+        write(Client& client) {
+            while (client.writable && client.offset != client.output.size()) {
+                auto n = client.socket.write(client.output.data() + client.offset,
+                                             client.output.size() - client.offset);
+                if (n <= 0) {
+                    client.writable = false;
+                    break;
+                }
+                client.offset += size_t(n);
+            }
+            if (client.offset == client.output.size()) {
+                client.output.clear();
+                client.offset = 0;
+            }
+        }
+
+        void
+        erase(sys::fd_type fd) {
+            this->_poller.erase(sys::epoll_event(fd, sys::event::in));
+            this->_clients.erase(fd);
+        }
+
+    };
+
+}
+
+int main() {
+    using namespace vncd;
+    try {
+        Server server;
+        server.run();
+    } catch (const std::exception& err) {
+        sys::log_message("rfb-stub", "error: _", err.what());
+        return 1;
+    }
+    return 0;
+}
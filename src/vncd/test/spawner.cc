@@ -0,0 +1,108 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <vncd/spawner.hh>
+#include <vncd/test/test.hh>
+
+/**
+Checks that spawn requests are serialized and parsed back, that malformed
+requests are rejected, and that the helper spawns the process as the current
+user and does not reap it until it is asked to (the process group ID
+must not be reused while VNCD may signal the group).
+*/
+namespace vncd {
+
+    inline Spawn_request
+    make_request() {
+        Spawn_request r;
+        r.uid = ::getuid();
+        r.gid = ::getgid();
+        r.user = "user";
+        r.workdir = "/";
+        r.script = "true";
+        r.set("DISPLAY", ":1000");
+        r.set("VNCD_FD", 3);
+        return r;
+    }
+
+    /// The state of the process from /proc (zero if the process does not exist).
+    inline char
+    process_state(sys::pid_type pid) {
+        std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+        std::string id, name;
+        char state = 0;
+        in >> id >> name >> state;
+        return state;
+    }
+
+    void
+    test_serialize() {
+        auto r = make_request();
+        r.set("DISPLAY", ":1001");
+        expect_equal(r.environment.size(), 2u, "the variable is not replaced");
+        auto s = r.serialize();
+        Spawn_request q;
+        expect(q.parse(s.data(), s.data()+s.size()), "parse");
+        expect_equal(q.uid, r.uid, "uid");
+        expect_equal(q.gid, r.gid, "gid");
+        expect_equal(q.user, r.user, "user");
+        expect_equal(q.workdir, r.workdir, "workdir");
+        expect_equal(q.script, r.script, "script");
+        expect(q.environment == r.environment, "environment");
+        expect_equal(q.environment[0], "DISPLAY=:1001", "environment");
+    }
+
+    void
+    test_parse_errors() {
+        auto s = make_request().serialize();
+        Spawn_request q;
+        expect(!q.parse(s.data(), s.data()), "empty message");
+        expect(!q.parse(s.data(), s.data()+4), "no gid");
+        expect(!q.parse(s.data(), s.data()+s.size()-1), "no terminating null character");
+        Spawn_request r;
+        r.user = "user";
+        s = r.serialize();
+        // user, workdir and script are required
+        auto end = s.find('\0', sizeof(r.uid)+sizeof(r.gid)) + 1;
+        expect(!q.parse(s.data(), s.data()+end), "no workdir and script");
+    }
+
+    void
+    test_spawn() {
+        auto& spawner = Spawner::instance();
+        spawner.start();
+        auto process = spawner.spawn(make_request());
+        auto pid = process.id();
+        expect(process.exited(5000), "the process has not exited");
+        // give the helper the time to reap the process if it does so on its own
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        expect_equal(process_state(pid), 'Z', "the process is reaped early");
+        process.signal(SIGKILL);
+        { Child_process tmp(std::move(process)); }
+        for (int i=0; i<50 && process_state(pid) != 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        expect_equal(int(process_state(pid)), 0, "the process is not reaped");
+    }
+
+}
+
+int main() {
+    using namespace vncd;
+    bool ok = true;
+    ok &= run("serialize", test_serialize);
+    ok &= run("parse errors", test_parse_errors);
+    ok &= run("spawn", test_spawn);
+    return ok ? 0 : 1;
+}
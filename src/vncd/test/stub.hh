@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_TEST_STUB_HH
+#define VNCD_TEST_STUB_HH
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <unistdx/base/check>
+#include <unistdx/net/socket>
+
+/// Common parts of the benchmark programmes.
+namespace vncd {
+
+    /// The benchmark programmes are single-threaded.
+    struct No_lock {
+        void lock() {}
+        void unlock() {}
+    };
+
+    /**
+    Returns the value of the environment variable or the default value
+    if the variable is not set. Throws if the value is less than the minimum.
+    */
+    inline size_t
+    environment_number(const char* name, size_t default_value, size_t min_value=0) {
+        const char* str = std::getenv(name);
+        if (!str) {
+            return default_value;
+        }
+        long tmp;
+        if (!(std::stringstream(str) >> tmp) || tmp < 0 || size_t(tmp) < min_value) {
+            throw std::invalid_argument(std::string("bad ") + name);
+        }
+        return static_cast<size_t>(tmp);
+    }
+
+    /// Non-blocking Unix socket that listens on the path.
+    inline sys::socket
+    listen_unix(const std::string& path) {
+        ::sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::invalid_argument("bad vnc socket");
+        }
+        std::memcpy(address.sun_path, path.data(), path.size());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        UNISTDX_CHECK(fd);
+        sys::socket socket(fd);
+        UNISTDX_CHECK(::bind(fd, reinterpret_cast<const ::sockaddr*>(&address),
+                             sizeof(address)));
+        UNISTDX_CHECK(::listen(fd, SOMAXCONN));
+        return socket;
+    }
+
+}
+
+#endif // vim:filetype=cpp
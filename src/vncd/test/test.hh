@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_TEST_TEST_HH
+#define VNCD_TEST_TEST_HH
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/// Common parts of the unit tests.
+namespace vncd {
+
+    /// Throws if the condition is false.
+    inline void
+    expect(bool condition, const std::string& what) {
+        if (!condition) {
+            throw std::runtime_error(what);
+        }
+    }
+
+    /// Throws if the values are not equal.
+    template <class T, class U>
+    inline void
+    expect_equal(const T& actual, const U& expected, const std::string& what) {
+        if (!(actual == expected)) {
+            std::stringstream tmp;
+            tmp << what << ": expected " << expected << ", got " << actual;
+            throw std::runtime_error(tmp.str());
+        }
+    }
+
+    /// Runs the test and prints its name and the result. Returns false on failure.
+    template <class Test>
+    inline bool
+    run(const char* name, Test test) {
+        try {
+            test();
+            std::cout << name << ": ok" << std::endl;
+            return true;
+        } catch (const std::exception& err) {
+            std::cout << name << ": " << err.what() << std::endl;
+            return false;
+        }
+    }
+
+}
+
+#endif // vim:filetype=cpp
@@ -0,0 +1,161 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <vncd/test/test.hh>
+#include <vncd/timer_wheel.hh>
+
+/**
+Checks that the timer wheel neither runs the tasks early nor late (by more
+than one tick) for the delays on every level of the wheel and beyond its
+span, that erased tasks do not run, and that the next expiry time is not
+later than the earliest task.
+*/
+namespace vncd {
+
+    typedef Timer_wheel::time_point time_point;
+    typedef Timer_wheel::duration duration;
+    typedef std::chrono::milliseconds ms;
+
+    class Test_task: public Task {
+
+    public:
+        bool expired = false;
+
+        inline explicit
+        Test_task(time_point t) {
+            this->at(t);
+        }
+
+    };
+
+    /// Advance the wheel and check the tasks that expired.
+    inline void
+    advance(Timer_wheel& wheel, time_point now, std::vector<Test_task*>& tasks) {
+        std::vector<Task*> expired;
+        wheel.advance(now, expired);
+        time_point previous{};
+        for (auto* task : expired) {
+            auto* t = static_cast<Test_task*>(task);
+            expect(!t->expired, "the task expired twice");
+            expect(t->at() <= now, "the task expired early");
+            // the tasks of the same tick may be in any order
+            expect(t->at() + ms(1) >= previous, "the tasks expired out of order");
+            previous = t->at();
+            t->expired = true;
+        }
+        for (auto* t : tasks) {
+            expect(t->expired || t->at() + ms(1) > now, "the task expired late");
+        }
+        for (auto*& t : tasks) {
+            if (t->expired) {
+                delete t;
+                t = nullptr;
+            }
+        }
+        tasks.erase(std::remove(tasks.begin(), tasks.end(), nullptr), tasks.end());
+        expect_equal(wheel.size(), tasks.size(), "the number of tasks");
+    }
+
+    void
+    test_levels() {
+        Timer_wheel wheel;
+        auto t0 = Timer_wheel::clock_type::now();
+        std::vector<Test_task*> tasks;
+        // a delay on each level, on the level boundaries and beyond the span
+        const uint64_t delays[] = {
+            0, 1, 2, 255, 256, 257, 1000, 65535, 65536, 65537,
+            (uint64_t(1) << 24) - 1, uint64_t(1) << 24, (uint64_t(1) << 24) + 1,
+            (uint64_t(1) << 32) - 1, uint64_t(1) << 32, (uint64_t(1) << 33) + 3,
+        };
+        for (auto d : delays) {
+            tasks.emplace_back(new Test_task(t0 + ms(d)));
+            wheel.insert(tasks.back());
+        }
+        for (auto d : delays) {
+            for (int64_t delta : {-1, 0, 1}) {
+                if (int64_t(d) + delta < 0) {
+                    continue;
+                }
+                advance(wheel, t0 + ms(int64_t(d) + delta), tasks);
+            }
+        }
+        advance(wheel, t0 + ms(uint64_t(1) << 34), tasks);
+        expect(tasks.empty(), "not all tasks expired");
+        expect(wheel.empty(), "the wheel is not empty");
+    }
+
+    void
+    test_random() {
+        std::mt19937_64 prng(7);
+        std::uniform_int_distribution<int> nnew(0, 10);
+        std::uniform_int_distribution<int> exponent(0, 36);
+        std::uniform_int_distribution<int64_t> step_us(0, 300000);
+        Timer_wheel wheel;
+        auto now = Timer_wheel::clock_type::now();
+        std::vector<Test_task*> tasks;
+        for (int i=0; i<2000; ++i) {
+            for (int j=nnew(prng); j>0; --j) {
+                // the delays are distributed over all levels
+                std::uniform_int_distribution<int64_t> delay(0, int64_t(1) << exponent(prng));
+                tasks.emplace_back(new Test_task(now + std::chrono::microseconds(delay(prng))));
+                wheel.insert(tasks.back());
+            }
+            time_point next;
+            if (wheel.next_expiry(next)) {
+                auto earliest = tasks.front()->at();
+                for (auto* t : tasks) {
+                    earliest = std::min(earliest, t->at());
+                }
+                expect(next <= earliest + ms(1), "the next expiry is later than the earliest task");
+                // jump to the next expiry from time to time
+                if (i%3 == 0 && next > now) {
+                    now = next;
+                }
+            } else {
+                expect(tasks.empty(), "the next expiry of non-empty wheel");
+            }
+            now += std::chrono::microseconds(step_us(prng)) * (i%50 == 0 ? 100000 : 1);
+            advance(wheel, now, tasks);
+        }
+    }
+
+    void
+    test_erase() {
+        Timer_wheel wheel;
+        auto t0 = Timer_wheel::clock_type::now();
+        std::unique_ptr<Test_task> erased(new Test_task(t0 + ms(10)));
+        std::vector<Test_task*> tasks{new Test_task(t0 + ms(10)), new Test_task(t0 + ms(300))};
+        wheel.insert(erased.get());
+        for (auto* t : tasks) {
+            wheel.insert(t);
+        }
+        wheel.erase(erased.get());
+        // erasing twice does nothing
+        wheel.erase(erased.get());
+        expect_equal(wheel.size(), tasks.size(), "the number of tasks");
+        advance(wheel, t0 + ms(1000), tasks);
+        expect(!erased->expired, "the erased task expired");
+        time_point next;
+        expect(!wheel.next_expiry(next), "the next expiry of empty wheel");
+    }
+
+}
+
+int main() {
+    using namespace vncd;
+    bool ok = true;
+    ok &= run("levels", test_levels);
+    ok &= run("random", test_random);
+    ok &= run("erase", test_erase);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <unistdx/base/check>
+#include <unistdx/io/fildes>
+
+#include <vncd/uring.hh>
+
+/**
+Checks that the sockets accepted via io_uring (both multishot and single-shot
+accept) are non-blocking, otherwise splices linked to poll requests block
+io-wq workers on slow clients. Exits with status 77 (skipped) if the kernel
+does not support io_uring.
+*/
+namespace vncd {
+
+    class Accept_result: public Uring_request {
+
+    public:
+        int result = 0;
+        bool completed = false;
+        /// No more completions will arrive for this request.
+        bool finished = false;
+
+        void
+        complete(const ::io_uring_cqe& cqe) override {
+            // the first completion of multishot accept is enough
+            if (!this->completed) {
+                this->result = cqe.res;
+                this->completed = true;
+            } else if (cqe.res >= 0) {
+                ::close(cqe.res);
+            }
+            if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+                this->finished = true;
+            }
+        }
+
+    };
+
+    inline void
+    wait(Uring& ring, const bool& condition) {
+        while (!condition) {
+            ::pollfd pfd{ring.fd(), POLLIN, 0};
+            if (::poll(&pfd, 1, 5000) != 1) {
+                throw std::runtime_error("io_uring request has not completed");
+            }
+            ring.process();
+        }
+    }
+
+    /// Returns the descriptor of the accepted socket or negated errno.
+    inline int
+    accept_via_ring(Uring& ring, bool multishot) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        UNISTDX_CHECK(fd);
+        sys::fildes server(fd);
+        ::sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::socklen_t size = sizeof(address);
+        UNISTDX_CHECK(::bind(fd, reinterpret_cast<::sockaddr*>(&address), size));
+        UNISTDX_CHECK(::listen(fd, 1));
+        UNISTDX_CHECK(::getsockname(fd, reinterpret_cast<::sockaddr*>(&address), &size));
+        Accept_result request;
+        ring.accept(fd, &request, multishot);
+        ring.submit();
+        int client_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        UNISTDX_CHECK(client_fd);
+        sys::fildes client(client_fd);
+        UNISTDX_CHECK(::connect(client_fd, reinterpret_cast<::sockaddr*>(&address), size));
+        wait(ring, request.completed);
+        if (!request.finished) {
+            // the request has to complete before it goes out of scope
+            ring.cancel(fd);
+            ring.submit();
+            wait(ring, request.finished);
+        }
+        return request.result;
+    }
+
+}
+
+int main() {
+    using namespace vncd;
+    try {
+        std::unique_ptr<Uring> ring;
+        try {
+            ring.reset(new Uring(16));
+        } catch (const sys::bad_call& err) {
+            std::cout << "skipped: " << err.what() << std::endl;
+            return 77;
+        }
+        int ret = 0;
+        for (bool multishot : {true, false}) {
+            const char* name = multishot ? "multishot accept" : "accept";
+            int fd = accept_via_ring(*ring, multishot);
+            if (fd == -EINVAL && multishot) {
+                std::cout << name << ": not supported" << std::endl;
+                continue;
+            }
+            if (fd < 0) {
+                std::cout << name << ": " << std::strerror(-fd) << std::endl;
+                ret = 1;
+                continue;
+            }
+            sys::fildes socket(fd);
+            int flags = ::fcntl(fd, F_GETFL);
+            UNISTDX_CHECK(flags);
+            bool ok = (flags & O_NONBLOCK) != 0;
+            std::cout << name << ": " << (ok ? "non-blocking" : "blocking") << std::endl;
+            if (!ok) {
+                ret = 1;
+            }
+        }
+        return ret;
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+}
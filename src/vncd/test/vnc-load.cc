@@ -0,0 +1,615 @@
+/*
+VNCD — multi-user VNC proxy server.
+© 2019, 2020 Ivan Gankevich
+
+SPDX-License-Identifier: gpl3+
+*/
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistdx/base/check>
+#include <unistdx/base/log_message>
+#include <unistdx/io/poller>
+#include <unistdx/net/socket>
+#include <unistdx/net/socket_address>
+
+#include <vncd/metrics.hh>
+#include <vncd/port.hh>
+#include <vncd/rfb.hh>
+#include <vncd/test/stub.hh>
+
+/**
+Load generator for VNCD benchmarks. Opens connections to the specified ports
+(one port per user, VNCD spawns vnc-stub for each of them) and either sends
+messages and waits for the echo (measuring round-trip time) or receives the
+data that the stub streams. In RFB mode it talks to rfb-stub like a VNC viewer:
+it requests framebuffer updates one after another, sends a pointer event with
+each request and measures the time from the request to the complete update.
+The measurement starts when every connection has received its first reply,
+so that the start-up of the sessions is excluded.
+*/
+namespace vncd {
+
+    inline size_t
+    parse_positive(const char* arg) {
+        long tmp;
+        if (!(std::stringstream(arg) >> tmp) || tmp <= 0) {
+            throw std::invalid_argument("bad number");
+        }
+        return static_cast<size_t>(tmp);
+    }
+
+    /// User and system CPU time of the process in seconds.
+    inline double
+    cpu_time(sys::pid_type pid) {
+        std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+        std::string stat;
+        std::getline(in, stat);
+        auto pos = stat.rfind(')');
+        if (!in || pos == std::string::npos) {
+            throw std::invalid_argument("unable to read /proc/PID/stat");
+        }
+        std::stringstream fields(stat.substr(pos+1));
+        std::string field;
+        // utime and stime are the 14th and 15th fields, the first two are pid and comm
+        for (int i=3; i<14; ++i) {
+            fields >> field;
+        }
+        unsigned long utime = 0, stime = 0;
+        fields >> utime >> stime;
+        return double(utime + stime) / double(::sysconf(_SC_CLK_TCK));
+    }
+
+    enum class Load_mode { Echo, Stream, Rfb };
+
+    inline void
+    rfb_append_u16(std::string& s, uint16_t x) {
+        s += char((x >> 8) & 0xff);
+        s += char(x & 0xff);
+    }
+
+    inline uint16_t
+    rfb_u16(const char* s) {
+        auto* p = reinterpret_cast<const unsigned char*>(s);
+        return uint16_t((unsigned(p[0]) << 8) | unsigned(p[1]));
+    }
+
+    class Load_generator {
+
+    private:
+        typedef std::chrono::steady_clock clock_type;
+        typedef clock_type::time_point time_point;
+        typedef clock_type::duration duration;
+
+        /// The next message from RFB server.
+        enum class Rfb_state {
+            Version,
+            Number_of_security_types,
+            Security_types,
+            Security_result,
+            Server_init,
+            Server_name,
+            Message_type,
+            Update_header,
+            Rectangle_header,
+            Rectangle_data,
+            Colour_map_header,
+            Cut_text_header,
+            Skip,
+        };
+
+        struct Client {
+            sys::socket socket;
+            /// Bytes of the current message that were sent.
+            size_t nsent = 0;
+            /// Bytes of the current message that were received.
+            size_t nreceived = 0;
+            time_point sent_at;
+            bool writable = false;
+            bool ready = false;
+            // RFB mode
+            Rfb_state state = Rfb_state::Version;
+            std::string input;
+            size_t need = 12;
+            /// Bytes to skip (pixel data, cut text).
+            uint64_t skip = 0;
+            /// Rectangles left in the current update.
+            size_t nrectangles = 0;
+            uint16_t width = 0;
+            uint16_t height = 0;
+            std::string output;
+            size_t offset = 0;
+        };
+
+    private:
+        sys::event_poller _poller;
+        std::unordered_map<sys::fd_type,Client> _clients;
+        std::vector<sys::socket_address> _addresses;
+        std::vector<char> _message;
+        std::vector<char> _buffer;
+        size_t _nconnections = 1;
+        size_t _message_size = 64;
+        Load_mode _mode = Load_mode::Echo;
+        sys::pid_type _vncd_pid = 0;
+        std::chrono::seconds _duration{10};
+        std::chrono::seconds _warmup_timeout{60};
+        size_t _nready = 0;
+        bool _measuring = false;
+        uint64_t _nbytes = 0;
+        uint64_t _nmessages = 0;
+        Histogram _rtt;
+
+    public:
+
+        Load_generator(): _buffer(4096*16) {}
+
+        void
+        parse_arguments(int argc, char* argv[]) {
+            for (int opt; (opt = ::getopt(argc, argv, "hc:d:m:p:rst:")) != -1;) {
+                switch (opt) {
+                case 'h':
+                    usage();
+                    std::exit(EXIT_SUCCESS);
+                case 'c':
+                    this->_nconnections = parse_positive(::optarg);
+                    break;
+                case 'd':
+                    this->_duration = std::chrono::seconds(parse_positive(::optarg));
+                    break;
+                case 'm':
+                    this->_message_size = parse_positive(::optarg);
+                    break;
+                case 'p':
+                    this->_vncd_pid = sys::pid_type(parse_positive(::optarg));
+                    break;
+                case 'r':
+                    this->_mode = Load_mode::Rfb;
+                    break;
+                case 's':
+                    this->_mode = Load_mode::Stream;
+                    break;
+                case 't':
+                    this->_warmup_timeout = std::chrono::seconds(parse_positive(::optarg));
+                    break;
+                default:
+                    usage();
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+            if (::optind+2 > argc) {
+                usage();
+                std::exit(EXIT_FAILURE);
+            }
+            sys::socket_address host;
+            std::stringstream tmp;
+            tmp << argv[::optind] << ":0";
+            tmp >> host;
+            if (!tmp) {
+                throw std::invalid_argument("bad address");
+            }
+            for (int i=::optind+1; i<argc; ++i) {
+                Port port;
+                argv[i] >> port;
+                this->_addresses.emplace_back(host, port);
+            }
+            this->_message.assign(this->_message_size, 'x');
+        }
+
+        void
+        usage() {
+            std::cout <<
+                "usage: vnc-load [-h] [-c CONNECTIONS] [-d SECONDS] [-m BYTES] [-p PID] [-r] [-s]"
+                " [-t SECONDS] ADDRESS PORT...\n"
+                "    -c  no. of connections per port\n"
+                "    -d  measurement duration\n"
+                "    -m  message size (echo mode)\n"
+                "    -p  VNCD process id (to measure its CPU time)\n"
+                "    -r  RFB mode (request framebuffer updates from rfb-stub)\n"
+                "    -s  stream mode (receive the data instead of sending messages)\n"
+                "    -t  how long to wait for the first reply from every connection\n";
+        }
+
+        void
+        run() {
+            for (const auto& address : this->_addresses) {
+                for (size_t i=0; i<this->_nconnections; ++i) {
+                    this->connect(address);
+                }
+            }
+            No_lock lock;
+            const auto timeout = std::chrono::milliseconds(100);
+            auto deadline = clock_type::now() + this->_warmup_timeout;
+            time_point start{};
+            double cpu_start = 0;
+            while (true) {
+                this->_poller.wait_for(lock, timeout);
+                this->process_events();
+                auto now = clock_type::now();
+                if (!this->_measuring) {
+                    if (this->_nready == this->_clients.size()) {
+                        this->_measuring = true;
+                        start = now;
+                        if (this->_vncd_pid) {
+                            cpu_start = cpu_time(this->_vncd_pid);
+                        }
+                    } else if (now > deadline) {
+                        throw std::runtime_error("timed out waiting for the first reply");
+                    }
+                } else if (now - start >= this->_duration) {
+                    double cpu = 0;
+                    if (this->_vncd_pid) {
+                        cpu = cpu_time(this->_vncd_pid) - cpu_start;
+                    }
+                    this->report(now - start, cpu);
+                    break;
+                }
+            }
+        }
+
+    private:
+
+        void
+        connect(const sys::socket_address& address) {
+            sys::socket socket(sys::family_type::inet);
+            socket.connect(address);
+            auto fd = socket.fd();
+            this->_clients[fd].socket = std::move(socket);
+            // edge-triggered: the socket is read and written until EAGAIN
+            this->_poller.emplace(
+                fd,
+                static_cast<sys::event>(EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+            );
+        }
+
+        void
+        process_events() {
+            for (const auto& event : this->_poller) {
+                auto result = this->_clients.find(event.fd());
+                if (result == this->_clients.end()) {
+                    continue;
+                }
+                auto& client = result->second;
+                if (event.in()) {
+                    this->read(client);
+                }
+                if (event.bad()) {
+                    throw std::runtime_error("connection closed");
+                }
+                if (event.out()) {
+                    client.writable = true;
+                }
+                this->write(client);
+            }
+        }
+
+        void
+        read(Client& client) {
+            ssize_t n;
+            while ((n = client.socket.read(this->_buffer.data(), this->_buffer.size())) > 0) {
+                if (this->_measuring) {
+                    this->_nbytes += n;
+                }
+                if (this->_mode == Load_mode::Stream) {
+                    this->ready(client);
+                    continue;
+                }
+                if (this->_mode == Load_mode::Rfb) {
+                    this->receive(client, this->_buffer.data(), size_t(n));
+                    continue;
+                }
+                client.nreceived += size_t(n);
+                if (client.nreceived >= this->_message_size) {
+                    if (this->_measuring) {
+                        this->_rtt.record(clock_type::now() - client.sent_at);
+                        ++this->_nmessages;
+                    }
+                    this->ready(client);
+                    client.nreceived -= this->_message_size;
+                    client.nsent = 0;
+                }
+            }
+            if (n == 0) {
+                throw std::runtime_error("connection closed");
+            }
+        }
+
+        void
+        write(Client& client) {
+            if (this->_mode == Load_mode::Stream) {
+                return;
+            }
+            if (this->_mode == Load_mode::Rfb) {
+                this->flush(client);
+                return;
+            }
+            while (client.writable && client.nsent != this->_message_size) {
+                if (client.nsent == 0) {
+                    client.sent_at = clock_type::now();
+                }
+                auto n = client.socket.write(this->_message.data() + client.nsent,
+                                             this->_message_size - client.nsent);
+                if (n <= 0) {
+                    client.writable = false;
+                    break;
+                }
+                client.nsent += size_t(n);
+                if (this->_measuring) {
+                    this->_nbytes += n;
+                }
+            }
+        }
+
+        void
+        flush(Client& client) {
+            while (client.writable && client.offset != client.output.size()) {
+                auto n = client.socket.write(client.output.data() + client.offset,
+                                             client.output.size() - client.offset);
+                if (n <= 0) {
+                    client.writable = false;
+                    break;
+                }
+                client.offset += size_t(n);
+                if (this->_measuring) {
+                    this->_nbytes += n;
+                }
+            }
+            if (client.offset == client.output.size()) {
+                client.output.clear();
+                client.offset = 0;
+            }
+        }
+
+        /// Parse the data from RFB server. Pixel data is skipped without copying.
+        void
+        receive(Client& client, const char* data, size_t size) {
+            while (size != 0) {
+                if (client.skip != 0) {
+                    auto n = size_t(std::min(client.skip, uint64_t(size)));
+                    client.skip -= n;
+                    data += n;
+                    size -= n;
+                    if (client.skip == 0) {
+                        this->skipped(client);
+                    }
+                    continue;
+                }
+                auto n = std::min(client.need - client.input.size(), size);
+                client.input.append(data, n);
+                data += n;
+                size -= n;
+                if (client.input.size() == client.need) {
+                    std::string message;
+                    message.swap(client.input);
+                    this->receive(client, message);
+                }
+            }
+        }
+
+        void
+        receive(Client& client, const std::string& message) {
+            const char* s = message.data();
+            switch (client.state) {
+                case Rfb_state::Version:
+                    client.output += "RFB 003.008\n";
+                    this->expect(client, Rfb_state::Number_of_security_types, 1);
+                    break;
+                case Rfb_state::Number_of_security_types:
+                    if (s[0] == 0) {
+                        throw std::runtime_error("RFB server refused the connection");
+                    }
+                    this->expect(client, Rfb_state::Security_types, uint8_t(s[0]));
+                    break;
+                case Rfb_state::Security_types:
+                    if (message.find(char(1)) == std::string::npos) {
+                        throw std::runtime_error("RFB server does not support security type None");
+                    }
+                    client.output += char(1);
+                    this->expect(client, Rfb_state::Security_result, 4);
+                    break;
+                case Rfb_state::Security_result:
+                    if (rfb_u32(s) != 0) {
+                        throw std::runtime_error("RFB authentication failed");
+                    }
+                    // shared session
+                    client.output += char(1);
+                    this->expect(client, Rfb_state::Server_init, 24);
+                    break;
+                case Rfb_state::Server_init:
+                    client.width = rfb_u16(s);
+                    client.height = rfb_u16(s+2);
+                    this->expect(client, Rfb_state::Server_name, rfb_u32(s+20));
+                    if (client.need == 0) {
+                        this->server_init(client);
+                    }
+                    break;
+                case Rfb_state::Server_name:
+                    this->server_init(client);
+                    break;
+                case Rfb_state::Message_type:
+                    switch (uint8_t(s[0])) {
+                        case 0: this->expect(client, Rfb_state::Update_header, 3); break;
+                        case 1: this->expect(client, Rfb_state::Colour_map_header, 5); break;
+                        case 2: this->expect(client, Rfb_state::Message_type, 1); break;
+                        case 3: this->expect(client, Rfb_state::Cut_text_header, 7); break;
+                        default: throw std::runtime_error("bad RFB server message");
+                    }
+                    break;
+                case Rfb_state::Update_header:
+                    client.nrectangles = rfb_u16(s+1);
+                    if (client.nrectangles == 0) {
+                        this->update(client);
+                    } else {
+                        this->expect(client, Rfb_state::Rectangle_header, 12);
+                    }
+                    break;
+                case Rfb_state::Rectangle_header:
+                    if (rfb_u32(s+8) != 0) {
+                        throw std::runtime_error("unsupported RFB encoding");
+                    }
+                    // raw encoding, 32 bits per pixel
+                    client.state = Rfb_state::Rectangle_data;
+                    client.skip = uint64_t(rfb_u16(s+4))*rfb_u16(s+6)*4;
+                    if (client.skip == 0) {
+                        this->skipped(client);
+                    }
+                    break;
+                case Rfb_state::Colour_map_header:
+                    client.state = Rfb_state::Skip;
+                    client.skip = uint64_t(rfb_u16(s+3))*6;
+                    if (client.skip == 0) {
+                        this->skipped(client);
+                    }
+                    break;
+                case Rfb_state::Cut_text_header:
+                    client.state = Rfb_state::Skip;
+                    client.skip = rfb_u32(s+3);
+                    if (client.skip == 0) {
+                        this->skipped(client);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            this->flush(client);
+        }
+
+        /// Called when the data that was skipped has ended.
+        void
+        skipped(Client& client) {
+            if (client.state == Rfb_state::Rectangle_data && --client.nrectangles == 0) {
+                this->update(client);
+            } else if (client.state == Rfb_state::Rectangle_data) {
+                this->expect(client, Rfb_state::Rectangle_header, 12);
+            } else {
+                this->expect(client, Rfb_state::Message_type, 1);
+            }
+        }
+
+        inline void
+        expect(Client& client, Rfb_state state, size_t n) {
+            client.state = state;
+            client.need = n;
+        }
+
+        /// Ask for 32-bit pixels, raw encoding and the full framebuffer.
+        void
+        server_init(Client& client) {
+            auto& out = client.output;
+            out += {char(0), char(0), char(0), char(0)};
+            out += {char(32), char(24), char(0), char(1)};
+            rfb_append_u16(out, 255);
+            rfb_append_u16(out, 255);
+            rfb_append_u16(out, 255);
+            out += {char(16), char(8), char(0), char(0), char(0), char(0)};
+            out += {char(2), char(0)};
+            rfb_append_u16(out, 1);
+            rfb_append_u32(out, 0);
+            this->request_update(client, false);
+            this->expect(client, Rfb_state::Message_type, 1);
+        }
+
+        /// The update is complete: move the pointer and ask for the next one.
+        void
+        update(Client& client) {
+            if (this->_measuring) {
+                this->_rtt.record(clock_type::now() - client.sent_at);
+                ++this->_nmessages;
+            }
+            this->ready(client);
+            auto& out = client.output;
+            const auto n = this->_nmessages;
+            out += {char(5), char(0)};
+            rfb_append_u16(out, uint16_t(n % std::max(client.width, uint16_t(1))));
+            rfb_append_u16(out, uint16_t(n % std::max(client.height, uint16_t(1))));
+            this->request_update(client, true);
+            this->expect(client, Rfb_state::Message_type, 1);
+        }
+
+        void
+        request_update(Client& client, bool incremental) {
+            auto& out = client.output;
+            out += {char(3), char(incremental)};
+            rfb_append_u16(out, 0);
+            rfb_append_u16(out, 0);
+            rfb_append_u16(out, client.width);
+            rfb_append_u16(out, client.height);
+            client.sent_at = clock_type::now();
+        }
+
+        inline void
+        ready(Client& client) {
+            if (!client.ready) {
+                client.ready = true;
+                ++this->_nready;
+            }
+        }
+
+        void
+        report(duration elapsed, double cpu) {
+            using std::chrono::duration_cast;
+            const double seconds =
+                duration_cast<std::chrono::duration<double>>(elapsed).count();
+            const double gigabytes = double(this->_nbytes) * 1e-9;
+            std::cout << std::fixed << std::setprecision(3);
+            std::cout << "connections: " << this->_clients.size() << '\n';
+            std::cout << "duration: " << seconds << " s\n";
+            std::cout << "relayed: " << double(this->_nbytes)/double(1<<20) << " MiB\n";
+            std::cout << "throughput: "
+                << double(this->_nbytes)/double(1<<20)/seconds << " MiB/s\n";
+            if (this->_mode != Load_mode::Stream) {
+                const bool rfb = this->_mode == Load_mode::Rfb;
+                std::vector<uint64_t> counts;
+                this->_rtt.add_to(counts);
+                std::cout << (rfb ? "updates: " : "messages: ") << this->_nmessages << '\n';
+                if (rfb) {
+                    std::cout << "updates per second: "
+                        << double(this->_nmessages)/seconds << '\n';
+                }
+                std::cout << (rfb ? "update latency:" : "rtt:");
+                const std::pair<const char*,double> quantiles[] = {
+                    {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p99.9", 0.999}
+                };
+                for (const auto& q : quantiles) {
+                    std::cout << ' ' << q.first << '='
+                        << Histogram::quantile(counts, q.second) << "us";
+                }
+                std::cout << '\n';
+            }
+            if (this->_vncd_pid) {
+                std::cout << "vncd cpu: " << cpu << " s";
+                if (gigabytes > 0) {
+                    std::cout << ", " << cpu/gigabytes << " s/GB";
+                }
+                std::cout << '\n';
+            }
+        }
+
+    };
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace vncd;
+    try {
+        Load_generator generator;
+        generator.parse_arguments(argc, argv);
+        generator.run();
+    } catch (const std::exception& err) {
+        sys::log_message("load", "error: _", err.what());
+        return 1;
+    }
+    return 0;
+}
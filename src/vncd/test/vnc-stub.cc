@@ -5,91 +5,230 @@ VNCD — multi-user VNC proxy server.
 SPDX-License-Identifier: gpl3+
 */
 
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-#include <unistdx/base/byte_buffer>
+#include <unistdx/base/check>
 #include <unistdx/base/log_message>
 #include <unistdx/io/poller>
 #include <unistdx/net/socket>
 #include <unistdx/net/socket_address>
 
 #include <vncd/port.hh>
-
-#include <thread>
-
+#include <vncd/test/stub.hh>
+
+/**
+VNC server stand-in for benchmarks. It is started by VNCD as the server script
+and is configured via environment variables.
+- VNCD_STUB_MODE: "echo" (default) sends back everything it receives,
+  "stream" sends the data to each client without reading.
+- VNCD_STUB_RATE: bytes per second per client in stream mode (0 means as fast
+  as possible).
+- VNCD_STUB_DELAY: seconds to wait before listening (simulates slow start of
+  the VNC server).
+The stub listens on VNCD_SOCKET Unix socket if VNCD runs with -u option
+and on VNCD_PORT otherwise.
+*/
 namespace vncd {
 
-    struct No_lock {
-        void lock() {}
-        void unlock() {}
-    };
+    enum class Stub_mode { Echo, Stream };
 
     class Server {
 
+    private:
+        typedef std::chrono::steady_clock clock_type;
+        typedef clock_type::time_point time_point;
+
+        struct Client {
+            sys::socket socket;
+            /// Received bytes that were not echoed yet.
+            std::vector<char> pending;
+            /// How many bytes can be sent in stream mode.
+            double credit = 0;
+            bool writable = true;
+        };
+
     private:
         sys::socket _server{sys::family_type::inet};
         sys::event_poller _poller;
-        sys::socket _client;
-        sys::byte_buffer _buffer{4096*10};
+        std::unordered_map<sys::fd_type,Client> _clients;
+        std::vector<char> _buffer;
+        Stub_mode _mode = Stub_mode::Echo;
+        size_t _rate = 0;
+        time_point _last_tick;
 
     public:
 
-        Server() {
+        Server(): _buffer(4096*16, 'x') {
+            const char* mode = std::getenv("VNCD_STUB_MODE");
+            if (mode && std::string(mode) == "stream") {
+                this->_mode = Stub_mode::Stream;
+            } else if (mode && std::string(mode) != "echo") {
+                throw std::invalid_argument("bad VNCD_STUB_MODE");
+            }
+            this->_rate = environment_number("VNCD_STUB_RATE", 0);
+            const char* path = std::getenv("VNCD_SOCKET");
             const char* str = std::getenv("VNCD_PORT");
-            if (!str) {
+            if (!path && !str) {
                 throw std::invalid_argument("bad vnc port");
             }
-            Port port;
-            str >> port;
-            sys::socket_address address{sys::ipv4_socket_address{{127,0,0,1},port}};
-            sys::log_message("stub", "listen _", address);
-            this->_server.bind(address);
-            this->_server.listen();
+            std::this_thread::sleep_for(
+                std::chrono::seconds(environment_number("VNCD_STUB_DELAY", 0))
+            );
+            if (path) {
+                sys::log_message("stub", "listen _", path);
+                this->_server = listen_unix(path);
+            } else {
+                Port port;
+                str >> port;
+                sys::socket_address address{sys::ipv4_socket_address{{127,0,0,1},port}};
+                sys::log_message("stub", "listen _", address);
+                this->_server.set(sys::socket::options::reuse_address);
+                this->_server.bind(address);
+                this->_server.listen();
+            }
             this->_poller.emplace(this->_server.fd(), sys::event::in);
         }
 
         void
         run() {
-            using namespace std::chrono;
-            using namespace std::this_thread;
-            sleep_for(seconds(10));
             No_lock lock;
-            sys::log_message("stub", "wait");
-            this->_poller.wait(lock, [this] () { return process_events(); });
-            sys::log_message("stub", "end");
+            const bool ticks = this->_mode == Stub_mode::Stream && this->_rate != 0;
+            const auto timeout = ticks
+                ? std::chrono::milliseconds(1)
+                : std::chrono::milliseconds(-1);
+            this->_last_tick = clock_type::now();
+            while (true) {
+                this->_poller.wait_for(lock, timeout);
+                this->process_events();
+                if (ticks) {
+                    this->tick();
+                }
+            }
         }
 
-        bool
+    private:
+
+        void
         process_events() {
             for (const auto& event : this->_poller) {
-                sys::log_message("stub", "event _", event);
                 if (event.fd() == this->_server.fd()) {
-                    sys::socket_address address;
-                    this->_server.accept(this->_client, address);
-                    sys::log_message("stub", "accepted connection from _", address);
-                    this->_poller.emplace(this->_client.fd(), sys::event::in);
+                    this->accept();
+                    continue;
+                }
+                auto result = this->_clients.find(event.fd());
+                if (result == this->_clients.end()) {
+                    continue;
+                }
+                auto& client = result->second;
+                if (event.in() && !this->read(client)) {
+                    this->erase(event.fd());
+                    continue;
+                }
+                if (event.out()) {
+                    client.writable = true;
+                }
+                if (event.bad()) {
+                    sys::log_message("stub", "connection closed");
+                    this->erase(event.fd());
+                    continue;
+                }
+                this->write(client);
+            }
+        }
+
+        void
+        accept() {
+            sys::socket socket;
+            sys::socket_address address;
+            while (this->_server.accept(socket, address)) {
+                sys::log_message("stub", "accepted connection from _", address);
+                auto fd = socket.fd();
+                auto& client = this->_clients[fd];
+                client.socket = std::move(socket);
+                // edge-triggered: the socket is read and written until EAGAIN
+                this->_poller.emplace(
+                    fd,
+                    static_cast<sys::event>(EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+                );
+            }
+        }
+
+        /// Returns false on end of file.
+        bool
+        read(Client& client) {
+            ssize_t n;
+            while ((n = client.socket.read(this->_buffer.data(), this->_buffer.size())) > 0) {
+                if (this->_mode == Stub_mode::Echo) {
+                    client.pending.insert(client.pending.end(),
+                                          this->_buffer.data(), this->_buffer.data()+n);
+                }
+            }
+            return n != 0;
+        }
+
+        /// Write until the socket buffer is full.
+        void
+        write(Client& client) {
+            while (client.writable) {
+                const char* data;
+                size_t size;
+                if (this->_mode == Stub_mode::Echo) {
+                    data = client.pending.data();
+                    size = client.pending.size();
                 } else {
-                    if (event.bad()) {
-                        sys::log_message("stub", "connection closed");
-                        break;
-                    }
-                    if (event.in()) {
-                        ssize_t nread = 0;
-                        nread += this->_client.read(
-                            this->_buffer.data(),
-                            this->_buffer.size()
-                        );
-                        ssize_t nwritten = 0;
-                        while (nread != nwritten) {
-                            nwritten += this->_client.write(
-                                this->_buffer.data() + nwritten,
-                                nread
-                            );
-                        }
+                    data = this->_buffer.data();
+                    size = this->_buffer.size();
+                    if (this->_rate != 0) {
+                        size = std::min(size, size_t(client.credit));
                     }
                 }
+                if (size == 0) {
+                    break;
+                }
+                auto n = client.socket.write(data, size);
+                if (n <= 0) {
+                    client.writable = false;
+                    break;
+                }
+                if (this->_mode == Stub_mode::Echo) {
+                    client.pending.erase(client.pending.begin(), client.pending.begin()+n);
+                } else if (this->_rate != 0) {
+                    client.credit -= double(n);
+                }
+            }
+        }
+
+        /// Give clients the credit for the elapsed time (at most one second worth of data).
+        void
+        tick() {
+            using namespace std::chrono;
+            auto now = clock_type::now();
+            auto dt = duration_cast<duration<double>>(now - this->_last_tick).count();
+            this->_last_tick = now;
+            const double rate = double(this->_rate);
+            for (auto& pair : this->_clients) {
+                auto& client = pair.second;
+                client.credit = std::min(client.credit + rate*dt, rate);
+                this->write(client);
             }
-            return false;
+        }
+
+        void
+        erase(sys::fd_type fd) {
+            this->_poller.erase(sys::epoll_event(fd, sys::event::in));
+            this->_clients.erase(fd);
         }
 
     };
@@ -98,7 +237,12 @@ namespace vncd {
 
 int main() {
     using namespace vncd;
-    Server server;
-    server.run();
+    try {
+        Server server;
+        server.run();
+    } catch (const std::exception& err) {
+        sys::log_message("stub", "error: _", err.what());
+        return 1;
+    }
     return 0;
 }
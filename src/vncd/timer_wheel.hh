@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_TIMER_WHEEL_HH
+#define VNCD_TIMER_WHEEL_HH
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+#include <unistdx/base/check>
+#include <unistdx/io/fildes>
+
+#include <vncd/task.hh>
+
+namespace vncd {
+
+    /**
+    Hierarchical timer wheel with millisecond ticks: four levels of 256 slots
+    cover 2^32 ms (about 49 days). Insertion and removal are O(1). Tasks from
+    higher levels are moved to lower levels (cascaded) when the wheel reaches
+    their slot. The tasks are owned by the wheel.
+    */
+    class Timer_wheel {
+
+    public:
+        typedef Task::clock_type clock_type;
+        typedef Task::time_point time_point;
+        typedef Task::duration duration;
+        typedef std::chrono::milliseconds tick_type;
+
+    private:
+        static constexpr const unsigned bits = 8;
+        static constexpr const unsigned nslots = 1u << bits;
+        static constexpr const unsigned nlevels = 4;
+        static constexpr const uint64_t max_delta = (uint64_t(1) << (bits*nlevels)) - 1;
+        static constexpr const uint64_t no_expiry = UINT64_MAX;
+
+    private:
+        time_point _origin;
+        /// The next tick to process.
+        uint64_t _now = 0;
+        Task* _slots[nlevels*nslots] = {};
+        size_t _count[nlevels] = {};
+        size_t _size = 0;
+        /// Cached result of next_expiry().
+        mutable uint64_t _next = no_expiry;
+        mutable bool _dirty = false;
+
+    public:
+
+        inline
+        Timer_wheel():
+        _origin(clock_type::now()) {}
+
+        inline
+        ~Timer_wheel() {
+            for (auto* head : this->_slots) {
+                while (head) {
+                    auto* next = head->_link.next;
+                    delete head;
+                    head = next;
+                }
+            }
+        }
+
+        Timer_wheel(const Timer_wheel&) = delete;
+        Timer_wheel& operator=(const Timer_wheel&) = delete;
+
+        inline bool
+        empty() const {
+            return this->_size == 0;
+        }
+
+        inline size_t
+        size() const {
+            return this->_size;
+        }
+
+        /// Schedule the task to run at task->at().
+        inline void
+        insert(Task* task) {
+            task->_link.expires = std::max(this->ticks(task->at()), this->_now);
+            this->place(task);
+            ++this->_size;
+            this->_dirty = true;
+        }
+
+        /// Remove the task without deleting it.
+        inline void
+        erase(Task* task) {
+            if (!task->_link.linked) {
+                return;
+            }
+            this->unlink(task);
+            --this->_size;
+            this->_dirty = true;
+        }
+
+        /// Move expired tasks to the output vector (earlier ticks first).
+        void
+        advance(time_point now, std::vector<Task*>& expired) {
+            const auto target = this->ticks_floor(now);
+            if (target < this->_now) {
+                return;
+            }
+            if (this->_size == 0) {
+                this->_now = target + 1;
+                return;
+            }
+            this->_dirty = true;
+            while (this->_now <= target) {
+                for (unsigned level=nlevels-1; level>0; --level) {
+                    const auto mask = (uint64_t(1) << (bits*level)) - 1;
+                    if ((this->_now & mask) == 0) {
+                        this->cascade(level);
+                    }
+                }
+                auto& head = this->_slots[this->_now % nslots];
+                while (head) {
+                    auto* task = head;
+                    this->unlink(task);
+                    if (task->_link.expires > this->_now) {
+                        // the delay was longer than the wheel span
+                        this->place(task);
+                    } else {
+                        --this->_size;
+                        expired.emplace_back(task);
+                    }
+                }
+                ++this->_now;
+                this->skip(target);
+            }
+        }
+
+        /// The time when the wheel has to be advanced next (may be earlier than
+        /// the earliest task because of cascading). Returns false if the wheel is empty.
+        bool
+        next_expiry(time_point& result) const {
+            if (this->_dirty) {
+                this->_next = this->compute_next();
+                this->_dirty = false;
+            }
+            if (this->_next == no_expiry) {
+                return false;
+            }
+            result = this->_origin + tick_type(this->_next);
+            return true;
+        }
+
+    private:
+
+        inline uint64_t
+        ticks(time_point t) const {
+            if (t <= this->_origin) {
+                return 0;
+            }
+            using namespace std::chrono;
+            auto d = t - this->_origin;
+            auto n = duration_cast<tick_type>(d);
+            if (n < d) {
+                ++n;
+            }
+            return uint64_t(n.count());
+        }
+
+        inline uint64_t
+        ticks_floor(time_point t) const {
+            if (t <= this->_origin) {
+                return 0;
+            }
+            using namespace std::chrono;
+            return uint64_t(duration_cast<tick_type>(t - this->_origin).count());
+        }
+
+        inline void
+        place(Task* task) {
+            auto expires = task->_link.expires;
+            auto delta = std::min(expires - std::min(expires, this->_now), uint64_t(max_delta));
+            expires = this->_now + delta;
+            unsigned level = 0;
+            while (level+1 < nlevels && delta >= (uint64_t(1) << (bits*(level+1)))) {
+                ++level;
+            }
+            auto index = unsigned((expires >> (bits*level)) % nslots);
+            auto slot = level*nslots + index;
+            auto& link = task->_link;
+            link.slot = slot;
+            link.prev = nullptr;
+            link.next = this->_slots[slot];
+            if (link.next) {
+                link.next->_link.prev = task;
+            }
+            this->_slots[slot] = task;
+            link.linked = true;
+            ++this->_count[level];
+        }
+
+        inline void
+        unlink(Task* task) {
+            auto& link = task->_link;
+            if (link.prev) {
+                link.prev->_link.next = link.next;
+            } else {
+                this->_slots[link.slot] = link.next;
+            }
+            if (link.next) {
+                link.next->_link.prev = link.prev;
+            }
+            link.prev = link.next = nullptr;
+            link.linked = false;
+            --this->_count[link.slot / nslots];
+        }
+
+        inline void
+        cascade(unsigned level) {
+            auto index = unsigned((this->_now >> (bits*level)) % nslots);
+            auto* head = this->_slots[level*nslots + index];
+            this->_slots[level*nslots + index] = nullptr;
+            while (head) {
+                auto* next = head->_link.next;
+                head->_link.linked = false;
+                --this->_count[level];
+                this->place(head);
+                head = next;
+            }
+        }
+
+        /// Jump over the ticks that have nothing to process.
+        inline void
+        skip(uint64_t target) {
+            unsigned level = 0;
+            while (level < nlevels-1 && this->_count[level] == 0) {
+                ++level;
+            }
+            if (level == 0) {
+                return;
+            }
+            const auto shift = bits*level;
+            auto next = ((this->_now + (uint64_t(1) << shift) - 1) >> shift) << shift;
+            this->_now = std::min(next, target + 1);
+        }
+
+        uint64_t
+        compute_next() const {
+            if (this->_size == 0) {
+                return no_expiry;
+            }
+            uint64_t result = no_expiry;
+            for (unsigned i=0; i<nslots && this->_count[0] != 0; ++i) {
+                auto t = this->_now + i;
+                if (this->_slots[t % nslots]) {
+                    result = t;
+                    break;
+                }
+            }
+            for (unsigned level=1; level<nlevels; ++level) {
+                if (this->_count[level] == 0) {
+                    continue;
+                }
+                const auto shift = bits*level;
+                auto first = (this->_now + (uint64_t(1) << shift) - 1) >> shift;
+                for (unsigned i=0; i<nslots; ++i) {
+                    auto t = (first + i) << shift;
+                    if (t >= result) {
+                        break;
+                    }
+                    if (this->_slots[level*nslots + unsigned((first + i) % nslots)]) {
+                        result = t;
+                        break;
+                    }
+                }
+            }
+            return result;
+        }
+
+    };
+
+    /// Monotonic timer that makes the poller wake up when the wheel has to be advanced.
+    class Timer_fd {
+
+    private:
+        sys::fildes _fd;
+        Task::time_point _armed{};
+        bool _set = false;
+
+    public:
+
+        inline
+        Timer_fd():
+        _fd(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+            UNISTDX_CHECK(this->_fd.fd());
+        }
+
+        inline sys::fd_type
+        fd() const noexcept {
+            return this->_fd.fd();
+        }
+
+        /// Set absolute expiration time (steady clock is CLOCK_MONOTONIC).
+        inline void
+        arm(Task::time_point t) {
+            if (this->_set && this->_armed == t) {
+                return;
+            }
+            using namespace std::chrono;
+            auto ns = duration_cast<nanoseconds>(t.time_since_epoch()).count();
+            if (ns <= 0) {
+                ns = 1;
+            }
+            ::itimerspec spec{};
+            spec.it_value.tv_sec = ns / 1000000000;
+            spec.it_value.tv_nsec = ns % 1000000000;
+            UNISTDX_CHECK(::timerfd_settime(this->fd(), TFD_TIMER_ABSTIME, &spec, nullptr));
+            this->_armed = t;
+            this->_set = true;
+        }
+
+        inline void
+        disarm() {
+            if (!this->_set) {
+                return;
+            }
+            ::itimerspec spec{};
+            UNISTDX_CHECK(::timerfd_settime(this->fd(), 0, &spec, nullptr));
+            this->_set = false;
+        }
+
+        /// Clear the readiness after the timer has expired.
+        inline void
+        clear() {
+            uint64_t n = 0;
+            while (::read(this->fd(), &n, sizeof(n)) > 0) {}
+            this->_set = false;
+        }
+
+    };
+
+}
+
+#endif // vim:filetype=cpp
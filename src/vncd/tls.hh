@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_TLS_HH
+#define VNCD_TLS_HH
+
+#if defined(VNCD_TLS)
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <stdexcept>
+#include <string>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <unistdx/base/check>
+#include <unistdx/io/fildes>
+
+#if defined(OPENSSL_NO_KTLS)
+#error "OpenSSL is built without kernel TLS support"
+#endif
+
+#if !defined(TCP_ULP)
+#define TCP_ULP 31
+#endif
+
+namespace vncd {
+
+    /// The last OpenSSL error as a string.
+    inline std::string
+    tls_error() {
+        char buf[256];
+        auto code = ::ERR_get_error();
+        if (code == 0) {
+            return "unknown TLS error";
+        }
+        ::ERR_error_string_n(code, buf, sizeof(buf));
+        ::ERR_clear_error();
+        return buf;
+    }
+
+    /**
+    Check that the kernel supports TLS by attaching the upper layer protocol
+    to a connected loopback socket (the module is not loaded automatically
+    in some distributions).
+    */
+    inline bool
+    kernel_tls_available() {
+        ::sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::socklen_t n = sizeof(address);
+        auto* ptr = reinterpret_cast<::sockaddr*>(&address);
+        sys::fildes server(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        sys::fildes client(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (!server || !client ||
+            ::bind(server.fd(), ptr, n) == -1 || ::listen(server.fd(), 1) == -1 ||
+            ::getsockname(server.fd(), ptr, &n) == -1 ||
+            ::connect(client.fd(), ptr, n) == -1) {
+            return false;
+        }
+        return ::setsockopt(client.fd(), SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    }
+
+    /**
+    Server-side TLS context with the certificate chain and the private key
+    that are loaded once at startup. Only the protocol versions and the ciphers
+    that the kernel can encrypt are enabled.
+    */
+    class Tls_context {
+
+    private:
+        ::SSL_CTX* _context = nullptr;
+
+    public:
+
+        inline explicit
+        Tls_context(const std::string& certificate, const std::string& key) {
+            this->_context = ::SSL_CTX_new(::TLS_server_method());
+            if (!this->_context) {
+                throw std::runtime_error(tls_error());
+            }
+            auto* ctx = this->_context;
+            ::SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+            // OpenSSL installs TLS 1.3 receive keys in the kernel since version 3.2
+            ::SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+#endif
+            ::SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+            // the relay does not send session tickets after the handshake
+            ::SSL_CTX_set_num_tickets(ctx, 0);
+            ::SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+            if (::SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20") != 1 ||
+                ::SSL_CTX_use_certificate_chain_file(ctx, certificate.data()) != 1 ||
+                ::SSL_CTX_use_PrivateKey_file(ctx, key.data(), SSL_FILETYPE_PEM) != 1 ||
+                ::SSL_CTX_check_private_key(ctx) != 1) {
+                auto message = tls_error();
+                ::SSL_CTX_free(ctx);
+                throw std::invalid_argument(message);
+            }
+        }
+
+        inline
+        ~Tls_context() {
+            ::SSL_CTX_free(this->_context);
+        }
+
+        Tls_context(const Tls_context&) = delete;
+        Tls_context& operator=(const Tls_context&) = delete;
+
+        inline ::SSL_CTX*
+        get() const {
+            return this->_context;
+        }
+
+    };
+
+    /**
+    Non-blocking server-side TLS handshake. When the handshake is complete
+    the session keys are installed in the kernel by OpenSSL, so that from
+    then on the plain socket is read and written (and spliced) in cleartext.
+    */
+    class Tls_handshake {
+
+    public:
+        enum class Status { Running, Finished, Failed };
+
+    private:
+        ::SSL* _ssl = nullptr;
+        Status _status = Status::Running;
+        bool _writing = false;
+        std::string _reason;
+
+    public:
+
+        inline explicit
+        Tls_handshake(const Tls_context& context, sys::fd_type fd) {
+            this->_ssl = ::SSL_new(context.get());
+            if (!this->_ssl) {
+                throw std::runtime_error(tls_error());
+            }
+            // the socket is not closed by OpenSSL
+            if (::SSL_set_fd(this->_ssl, fd) != 1) {
+                ::SSL_free(this->_ssl);
+                throw std::runtime_error(tls_error());
+            }
+            ::SSL_set_accept_state(this->_ssl);
+        }
+
+        inline
+        ~Tls_handshake() {
+            ::SSL_free(this->_ssl);
+        }
+
+        Tls_handshake(const Tls_handshake&) = delete;
+        Tls_handshake& operator=(const Tls_handshake&) = delete;
+
+        /// Read and write as much as possible without blocking.
+        void
+        process() {
+            if (this->_status != Status::Running) {
+                return;
+            }
+            ::ERR_clear_error();
+            int ret = ::SSL_do_handshake(this->_ssl);
+            if (ret == 1) {
+                if (BIO_get_ktls_send(::SSL_get_wbio(this->_ssl)) != 1 ||
+                    BIO_get_ktls_recv(::SSL_get_rbio(this->_ssl)) != 1) {
+                    this->fail("kernel TLS is not available for the negotiated cipher");
+                } else if (::SSL_has_pending(this->_ssl)) {
+                    this->fail("unexpected data after the handshake");
+                } else {
+                    this->_status = Status::Finished;
+                    this->_writing = false;
+                }
+                return;
+            }
+            switch (::SSL_get_error(this->_ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+                this->_writing = false;
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                this->_writing = true;
+                break;
+            case SSL_ERROR_SYSCALL:
+                this->fail(::ERR_peek_error() == 0 ? "connection closed" : tls_error());
+                break;
+            default:
+                this->fail(tls_error());
+                break;
+            }
+        }
+
+        inline bool
+        finished() const {
+            return this->_status == Status::Finished;
+        }
+
+        inline bool
+        failed() const {
+            return this->_status == Status::Failed;
+        }
+
+        inline bool
+        running() const {
+            return this->_status == Status::Running;
+        }
+
+        /// The handshake waits for the socket to become writable.
+        inline bool
+        writing() const {
+            return this->_writing;
+        }
+
+        inline const char*
+        reason() const {
+            return this->_reason.data();
+        }
+
+        /// The negotiated protocol version and cipher.
+        inline std::string
+        cipher() const {
+            return std::string(::SSL_get_version(this->_ssl)) + ' ' +
+                ::SSL_get_cipher_name(this->_ssl);
+        }
+
+    private:
+
+        inline void
+        fail(const std::string& reason) {
+            this->_status = Status::Failed;
+            this->_reason = reason;
+        }
+
+    };
+
+}
+
+#endif
+
+#endif // vim:filetype=cpp
@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: gpl3+
+
+#ifndef VNCD_URING_HH
+#define VNCD_URING_HH
+
+#if defined(VNCD_IO_URING)
+
+#include <liburing.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#include <unistdx/io/fildes>
+#include <unistdx/io/pipe>
+
+namespace vncd {
+
+    /// Base class for all io_uring requests. The pointer to the request is stored in SQE.
+    class Uring_request {
+
+    public:
+        virtual ~Uring_request() = default;
+        virtual void complete(const ::io_uring_cqe& cqe) = 0;
+
+    };
+
+    /**
+    io_uring instance which completion events are delivered to
+    the server's poller via eventfd.
+    */
+    class Uring {
+
+    private:
+        ::io_uring _ring;
+        sys::fildes _eventfd;
+
+    public:
+
+        inline explicit
+        Uring(unsigned nentries=1024) {
+            int ret = ::io_uring_queue_init(nentries, &this->_ring, 0);
+            if (ret < 0) {
+                errno = -ret;
+                throw sys::bad_call();
+            }
+            sys::fd_type fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd == -1) {
+                ::io_uring_queue_exit(&this->_ring);
+                throw sys::bad_call();
+            }
+            this->_eventfd = sys::fildes(fd);
+            ret = ::io_uring_register_eventfd(&this->_ring, fd);
+            if (ret < 0) {
+                ::io_uring_queue_exit(&this->_ring);
+                errno = -ret;
+                throw sys::bad_call();
+            }
+        }
+
+        inline
+        ~Uring() {
+            ::io_uring_queue_exit(&this->_ring);
+        }
+
+        Uring(const Uring&) = delete;
+        Uring& operator=(const Uring&) = delete;
+
+        /// File descriptor that becomes readable when completions are available.
+        inline sys::fd_type
+        fd() const noexcept {
+            return this->_eventfd.fd();
+        }
+
+        /// Returns free submission queue entry flushing the queue if it is full.
+        inline ::io_uring_sqe*
+        sqe(Uring_request* request) {
+            auto* s = ::io_uring_get_sqe(&this->_ring);
+            if (!s) {
+                this->submit();
+                s = ::io_uring_get_sqe(&this->_ring);
+                if (!s) {
+                    throw std::runtime_error("io_uring submission queue is full");
+                }
+            }
+            ::io_uring_sqe_set_data(s, request);
+            return s;
+        }
+
+        /**
+        Multishot accept (Linux 5.19) or single-shot accept for older kernels.
+        Accepted sockets are non-blocking, so that splices linked to poll
+        requests never block io-wq workers.
+        */
+        inline void
+        accept(sys::fd_type fd, Uring_request* request, bool multishot=true) {
+            const int flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+            if (multishot) {
+                ::io_uring_prep_multishot_accept(this->sqe(request), fd,
+                                                 nullptr, nullptr, flags);
+            } else {
+                ::io_uring_prep_accept(this->sqe(request), fd, nullptr, nullptr, flags);
+            }
+        }
+
+        /// One-shot poll request (usually linked to the following request).
+        inline void
+        poll(sys::fd_type fd, unsigned mask, Uring_request* request, unsigned flags=0) {
+            auto* s = this->sqe(request);
+            ::io_uring_prep_poll_add(s, fd, mask);
+            ::io_uring_sqe_set_flags(s, flags);
+        }
+
+        inline void
+        splice(sys::fd_type in, sys::fd_type out, size_t n,
+               Uring_request* request, unsigned flags=0) {
+            auto* s = this->sqe(request);
+            ::io_uring_prep_splice(s, in, -1, out, -1, static_cast<unsigned>(n),
+                                   SPLICE_F_MOVE);
+            ::io_uring_sqe_set_flags(s, flags);
+        }
+
+        /// Cancel all requests on the file descriptor. Completions are ignored.
+        inline void
+        cancel(sys::fd_type fd) {
+            ::io_uring_prep_cancel_fd(this->sqe(nullptr), fd, IORING_ASYNC_CANCEL_ALL);
+        }
+
+        /// Submits all queued requests with a single system call.
+        inline void
+        submit() {
+            if (::io_uring_sq_ready(&this->_ring) == 0) {
+                return;
+            }
+            int ret = ::io_uring_submit(&this->_ring);
+            if (ret < 0 && ret != -EAGAIN && ret != -EINTR) {
+                errno = -ret;
+                throw sys::bad_call();
+            }
+        }
+
+        /// Dispatches all available completions to the corresponding requests.
+        void
+        process() {
+            ::eventfd_t value = 0;
+            ::eventfd_read(this->_eventfd.fd(), &value);
+            ::io_uring_cqe* cqe = nullptr;
+            while (::io_uring_peek_cqe(&this->_ring, &cqe) == 0) {
+                ::io_uring_cqe copy = *cqe;
+                ::io_uring_cqe_seen(&this->_ring, cqe);
+                auto* request = static_cast<Uring_request*>(::io_uring_cqe_get_data(&copy));
+                if (request) {
+                    request->complete(copy);
+                }
+            }
+        }
+
+    };
+
+    /**
+    Relays the data between remote and local sockets via splice requests
+    (socket → pipe → socket) in both directions. The sockets stay non-blocking:
+    each splice is linked to a poll request that waits until the socket is
+    readable (writable), so that no io-wq worker is blocked in the splice while
+    the connection is idle. Filling and draining the pipe are independent chains.
+    The source is not polled while the pipe is above high water mark until it
+    is drained below low water mark, like in the event loop's relay.
+    The result of each splice is reported to the owner for accounting.
+    */
+    class Uring_relay {
+
+    public:
+        typedef std::function<void()> close_function;
+
+        /// The result of one splice.
+        struct Progress {
+            /// Bytes written to the destination.
+            size_t nwritten = 0;
+            size_t nsplices = 0;
+            /// Splices that would block.
+            size_t neagain = 0;
+            /// How many times the source was throttled.
+            size_t nthrottles = 0;
+        };
+
+        /// Called with the channel index (zero is upstream) and the result.
+        typedef std::function<void(size_t,const Progress&)> progress_function;
+
+    private:
+
+        class Channel;
+
+        enum class Kind { Fill_poll, Fill, Drain_poll, Drain };
+
+        class Request: public Uring_request {
+
+        private:
+            Channel* _channel = nullptr;
+            Kind _kind = Kind::Fill;
+
+        public:
+
+            inline void
+            set(Channel* channel, Kind kind) {
+                this->_channel = channel;
+                this->_kind = kind;
+            }
+
+            void
+            complete(const ::io_uring_cqe& cqe) override;
+
+        };
+
+        class Channel {
+
+        private:
+            Uring_relay* _parent = nullptr;
+            size_t _index = 0;
+            sys::fd_type _source = -1;
+            sys::fd_type _pipe_in = -1;
+            sys::fd_type _pipe_out = -1;
+            sys::fd_type _destination = -1;
+            size_t _pending = 0;
+            int _inflight = 0;
+            bool _filling = false;
+            bool _draining = false;
+            /// The source is not polled until the pipe is drained below low water mark.
+            bool _throttled = false;
+            Request _fill_poll;
+            Request _fill;
+            Request _drain_poll;
+            Request _drain;
+
+        public:
+
+            inline void
+            set(Uring_relay* parent, size_t index, sys::fd_type source,
+                sys::fd_type pipe_in, sys::fd_type pipe_out, sys::fd_type destination) {
+                this->_parent = parent;
+                this->_index = index;
+                this->_source = source;
+                this->_pipe_in = pipe_in;
+                this->_pipe_out = pipe_out;
+                this->_destination = destination;
+                this->_fill_poll.set(this, Kind::Fill_poll);
+                this->_fill.set(this, Kind::Fill);
+                this->_drain_poll.set(this, Kind::Drain_poll);
+                this->_drain.set(this, Kind::Drain);
+            }
+
+            inline int
+            inflight() const {
+                return this->_inflight;
+            }
+
+            inline sys::fd_type
+            source() const {
+                return this->_source;
+            }
+
+            inline sys::fd_type
+            destination() const {
+                return this->_destination;
+            }
+
+            inline sys::fd_type
+            pipe_in() const {
+                return this->_pipe_in;
+            }
+
+            /// Fill the pipe below high water mark and drain it if it has data.
+            void
+            submit() {
+                auto& ring = *this->_parent->_ring;
+                auto n = this->_parent->_high_water;
+                if (!this->_filling && !this->_throttled && this->_pending < n) {
+                    ring.poll(this->_source, POLLIN, &this->_fill_poll, IOSQE_IO_LINK);
+                    ring.splice(this->_source, this->_pipe_out, n - this->_pending,
+                                &this->_fill);
+                    this->_filling = true;
+                    this->_inflight += 2;
+                }
+                if (!this->_draining && this->_pending != 0) {
+                    ring.poll(this->_destination, POLLOUT, &this->_drain_poll, IOSQE_IO_LINK);
+                    ring.splice(this->_pipe_in, this->_destination, this->_pending,
+                                &this->_drain);
+                    this->_draining = true;
+                    this->_inflight += 2;
+                }
+            }
+
+            void
+            complete(Kind kind, int result) {
+                --this->_inflight;
+                auto* parent = this->_parent;
+                Progress progress;
+                switch (kind) {
+                case Kind::Fill_poll:
+                case Kind::Drain_poll:
+                    // hang-up and errors are reported by the linked splice
+                    if (result < 0 && result != -ECANCELED) {
+                        parent->close();
+                    }
+                    break;
+                case Kind::Fill:
+                    this->_filling = false;
+                    if (result > 0) {
+                        this->_pending += size_t(result);
+                        if (this->_pending >= parent->_high_water) {
+                            this->_throttled = true;
+                            ++progress.nthrottles;
+                        }
+                    } else if (result == 0) {
+                        // end of file
+                        parent->close();
+                    } else if (result != -EAGAIN && result != -ECANCELED) {
+                        parent->close();
+                    }
+                    break;
+                case Kind::Drain:
+                    this->_draining = false;
+                    if (result > 0) {
+                        this->_pending -= std::min(this->_pending, size_t(result));
+                        progress.nwritten = size_t(result);
+                        if (this->_throttled && this->_pending <= parent->_low_water) {
+                            this->_throttled = false;
+                        }
+                    } else if (result < 0 && result != -EAGAIN && result != -ECANCELED) {
+                        parent->close();
+                    }
+                    break;
+                }
+                // cancelled requests are not splices
+                if ((kind == Kind::Fill || kind == Kind::Drain) && result != -ECANCELED) {
+                    progress.nsplices = 1;
+                    progress.neagain = result == -EAGAIN ? 1 : 0;
+                    parent->progress(this->_index, progress);
+                }
+                if (!parent->_closed) {
+                    this->submit();
+                }
+                parent->release();
+            }
+
+        };
+
+    private:
+        Uring* _ring = nullptr;
+        size_t _high_water = 65536;
+        size_t _low_water = 16384;
+        Channel _channels[2];
+        std::shared_ptr<void> _owner;
+        close_function _close;
+        progress_function _progress;
+        bool _closed = false;
+
+    public:
+
+        Uring_relay() = default;
+        Uring_relay(const Uring_relay&) = delete;
+        Uring_relay& operator=(const Uring_relay&) = delete;
+
+        /**
+        Start relaying in both directions.
+        The owner is kept alive until all requests complete.
+        */
+        void
+        start(Uring& ring, std::shared_ptr<void> owner,
+              size_t high_water, size_t low_water, sys::fd_type remote, sys::fd_type local,
+              const sys::pipe& in, const sys::pipe& out,
+              close_function close, progress_function progress) {
+            this->_ring = &ring;
+            this->_owner = std::move(owner);
+            this->_high_water = high_water;
+            this->_low_water = low_water;
+            this->_close = std::move(close);
+            this->_progress = std::move(progress);
+            this->_channels[0].set(this, 0, remote, in.in().fd(), in.out().fd(), local);
+            this->_channels[1].set(this, 1, local, out.in().fd(), out.out().fd(), remote);
+            for (auto& channel : this->_channels) {
+                channel.submit();
+            }
+        }
+
+        inline bool
+        started() const {
+            return this->_ring != nullptr;
+        }
+
+        /**
+        Wake up and cancel all requests in flight.
+        The file descriptors must stay open until the owner is released.
+        */
+        void
+        stop() {
+            if (this->_closed) {
+                return;
+            }
+            this->_closed = true;
+            const auto& channel = this->_channels[0];
+            ::shutdown(channel.source(), SHUT_RDWR);
+            ::shutdown(channel.destination(), SHUT_RDWR);
+            // the sources of the channels are the destinations of each other
+            for (const auto& c : this->_channels) {
+                this->_ring->cancel(c.source());
+                this->_ring->cancel(c.pipe_in());
+            }
+        }
+
+    private:
+
+        inline void
+        progress(size_t channel, const Progress& p) {
+            if (this->_progress) {
+                this->_progress(channel, p);
+            }
+        }
+
+        inline void
+        close() {
+            if (this->_closed) {
+                return;
+            }
+            this->stop();
+            if (this->_close) {
+                this->_close();
+            }
+        }
+
+        /// Drop the reference to the owner when there are no requests in flight.
+        inline void
+        release() {
+            if (!this->_closed) {
+                return;
+            }
+            for (const auto& channel : this->_channels) {
+                if (channel.inflight() != 0) {
+                    return;
+                }
+            }
+            // may destroy this object
+            auto owner = std::move(this->_owner);
+        }
+
+    };
+
+    inline void
+    Uring_relay::Request::complete(const ::io_uring_cqe& cqe) {
+        this->_channel->complete(this->_kind, cqe.res);
+    }
+
+}
+
+#endif
+
+#endif // vim:filetype=cpp